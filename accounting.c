@@ -0,0 +1,60 @@
+/** @file
+ * Helpers shared by the collector backends
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "accounting.h"
+
+/**
+ * Wrap a zero terminated string for use in a struct linedata
+ * @param s is the string, which may be NULL if the value is missing
+ * @return the slice
+ */
+slice_t acct_slice(const char *s) {
+    slice_t slice;
+    slice.str = s;
+    slice.len = s ? strlen(s) : 0;
+    return slice;
+}
+
+/**
+ * Convert a protocol number into the name that iptables-save would show.
+ * The common names are built in, to avoid non-reentrant /etc/protocols
+ * lookups.
+ * @param proto is the IP protocol number
+ * @param buf is used to hold the number if there is no known name
+ * @param size is the size of buf
+ * @return the name or NULL if there was no protocol
+ */
+char *acct_proto_name(unsigned int proto, char *buf, size_t size) {
+    switch (proto) {
+        case 0:
+            return NULL;
+        case IPPROTO_ICMP:
+            return "icmp";
+        case IPPROTO_TCP:
+            return "tcp";
+        case IPPROTO_UDP:
+            return "udp";
+        case IPPROTO_GRE:
+            return "gre";
+        case IPPROTO_ESP:
+            return "esp";
+        case IPPROTO_AH:
+            return "ah";
+        case IPPROTO_ICMPV6:
+            return "ipv6-icmp";
+        case IPPROTO_SCTP:
+            return "sctp";
+        case IPPROTO_UDPLITE:
+            return "udplite";
+    }
+    snprintf(buf, size, "%u", proto);
+    return buf;
+}
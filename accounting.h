@@ -0,0 +1,47 @@
+/** @file
+ * Definitions shared between the exporter and its collector backends
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef ACCOUNTING_H
+#define ACCOUNTING_H
+
+#include <stddef.h>
+
+/**
+ * A string that is not zero terminated, borrowed from a larger buffer.
+ * A missing value has a NULL str.
+ */
+typedef struct slice {
+    const char *str;
+    size_t len;
+} slice_t;
+
+/**
+ * The details extracted from one accounting rule.
+ * All the strings are borrowed from the collector and are only valid for
+ * the duration of the callback they are passed to.
+ */
+struct linedata {
+    slice_t packets;
+    slice_t bytes;
+    slice_t chain;
+    slice_t proto;
+    slice_t port;
+    int matched;
+    // -1 = bad syntax
+    // 0 = good syntax but not matched
+    // 1 = matched
+};
+
+/**
+ * Called by a collector backend once for each rule it finds
+ */
+typedef void (*linedata_cb_t)(struct linedata *, void *);
+
+slice_t acct_slice(const char *);
+char *acct_proto_name(unsigned int, char *, size_t);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Benchmark the cost of each connslot wakeup as the number of idle
+ * connections grows, with one or several connections active at once
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connslot.h"
+
+#define ROUNDS 2000
+
+// The connections are kept open between rounds
+static const char request[] = "GET / HTTP/1.1\r\n\r\n";
+
+struct bench {
+    strbuf_t *reply;
+    int done;           // the number of requests answered
+};
+
+static void bench_request(conn_t *conn, void *arg) {
+    struct bench *b = arg;
+
+    conn->reply = b->reply;
+    sb_reprintf(&conn->reply_header, "HTTP/1.1 200 OK\r\n");
+    sb_reprintf(&conn->reply_header, "Content-Length: %lu\r\n\r\n",
+            sb_len(conn->reply));
+    conn_write(conn);
+    b->done++;
+}
+
+static int bench_connect(int port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+static void bench_wait(slots_t *slots, struct bench *b, int *wakeups) {
+    if (slots_wait(slots, 1000, bench_request, b) < 0) {
+        perror("slots_wait");
+        exit(1);
+    }
+    (*wakeups)++;
+}
+
+static void bench(int nr_idle, int nr_active) {
+    // Start small, so the pool grows as the clients connect
+    int nr_clients = nr_idle + nr_active;
+    slots_t *slots = slots_malloc(4);
+    if (!slots || slots_listen_tcp(slots, 0) != 0) {
+        perror("slots");
+        exit(1);
+    }
+    slots->max_slots = nr_clients;
+
+    if (strcmp(slots_backend(slots), "select") == 0 &&
+            (nr_idle + nr_active) * 2 + 16 > FD_SETSIZE) {
+        // The fd_set cannot hold any more
+        close(slots->listen[0]);
+        slots_free(slots);
+        return;
+    }
+
+    struct bench b;
+    b.reply = sb_malloc(64);
+    sb_printf(b.reply, "Hello World\n");
+
+    struct sockaddr_in6 addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(slots->listen[0], (struct sockaddr *)&addr, &addrlen);
+    int port = ntohs(addr.sin6_port);
+
+    // Wait for each client to be accepted, so they are all open
+    int *clients = calloc(nr_clients, sizeof(int));
+    if (!clients) {
+        perror("calloc");
+        exit(1);
+    }
+    int wakeups = 0;
+    for (int i = 0; i < nr_clients; i++) {
+        clients[i] = bench_connect(port);
+        while (slots->nr_open <= i) {
+            bench_wait(slots, &b, &wakeups);
+        }
+    }
+
+    // Only the last few clients are ever active, and they all send their
+    // requests at the same time
+    int *active = &clients[nr_idle];
+    size_t expected = 0;
+    char buf[256];
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    wakeups = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        b.done = 0;
+        for (int i = 0; i < nr_active; i++) {
+            write(active[i], request, sizeof(request) - 1);
+        }
+        while (b.done < nr_active) {
+            bench_wait(slots, &b, &wakeups);
+        }
+
+        for (int i = 0; i < nr_active; i++) {
+            ssize_t got = read(active[i], buf, sizeof(buf));
+            if (got <= 0 || (expected && (size_t)got != expected)) {
+                printf("bad reply\n");
+                exit(1);
+            }
+            expected = got;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%-8s %6i idle %3i active %8i wakeups %9.0f ns/wakeup %9.0f ns/request\n",
+            slots_backend(slots), nr_idle, nr_active, wakeups, ns / wakeups,
+            ns / ROUNDS / nr_active);
+
+    for (int i = 0; i < nr_clients; i++) {
+        close(clients[i]);
+    }
+    for (int i = 0; i < slots->nr_slots; i++) {
+        if (slots->conn[i].fd != -1) {
+            slots->conn[i].reply = NULL;
+            conn_close(&slots->conn[i]);
+        }
+    }
+    close(slots->listen[0]);
+    slots_free(slots);
+    free(clients);
+    free(b.reply);
+}
+
+int main(int argc, char **argv) {
+    int sizes[] = { 16, 64, 256, 448, 1024, 4096 };
+    int actives[] = { 1, 16 };
+
+    // Each idle connection needs an fd for both ends
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int nr_idle = sizes[i];
+        if (argc > 1) {
+            nr_idle = atoi(argv[1]) << i;
+        }
+
+        unsigned int fds = nr_idle * 2 + 64;
+        if (fds > rl.rlim_cur) {
+            continue;
+        }
+        for (unsigned int j = 0; j < sizeof(actives) / sizeof(actives[0]); j++) {
+            bench(nr_idle, actives[j]);
+        }
+    }
+}
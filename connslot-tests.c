@@ -5,32 +5,595 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "connslot.h"
 
+// Named for each run, so that the builds of these tests for the different
+// engines can run at the same time
+char sock_path[64];
+
 // Tests are silent and return if everything is OK, or abort if issues
 void connslot_tests() {
     slots_t *p = slots_malloc(5);
     assert(p);
     assert(p->nr_slots==5);
+    assert(p->max_slots==5);
     assert(p->nr_open==0);
     assert(p->listen[0]==-1);
     assert(p->listen[1]==-1);
     assert(p->timeout==60);
+    assert(p->watch[0].fd==-1);
+
+    slots_free(p);
+}
+
+void connslot_watch_tests() {
+    slots_t *p = slots_malloc(1);
+    assert(p);
+
+    int fds[2];
+    assert(pipe(fds)==0);
+
+    int ready = 1;
+    assert(slots_watch(p, fds[0], &ready)==0);
+    assert(ready==0);
+
+    // Nothing to read, so times out
+    assert(slots_wait(p, 0, NULL, NULL)==0);
+    assert(ready==0);
+
+    assert(write(fds[1], "x", 1)==1);
+    assert(slots_wait(p, 1000, NULL, NULL)==1);
+    assert(ready==1);
+
+    slots_unwatch(p, fds[0]);
+    assert(p->watch[0].fd==-1);
+
+    close(fds[0]);
+    close(fds[1]);
+    slots_free(p);
+}
+
+// Feed the request in one byte at a time, as the parser must resume
+void parse_bytes(conn_t *conn, char *request) {
+    for (int i=0; request[i] && conn->state == CONN_READING; i++) {
+        assert(sb_reappend(&conn->request, &request[i], 1));
+        conn_received(conn);
+    }
+}
+
+void connslot_parse_tests() {
+    conn_t conn;
+    conn.request = NULL;
+    assert(conn_init(&conn)==0);
+    conn.state = CONN_READING;
+
+    char request[] =
+        "\r\n"
+        "POST /echo?x=1 HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "content-length:  4 \r\n"
+        "X-Empty:\n"
+        "\r\n"
+        "body";
+    parse_bytes(&conn, request);
+    assert(conn.state == CONN_READY);
+    assert(conn.keepalive == 1);
+    assert(conn.request_len == sizeof(request) - 1);
+
+    // Pipelined behind the first, so not looked at yet
+    assert(sb_reappend(&conn.request, "GET /next HTTP/1.0\r\n\r\n", 22));
+    conn_received(&conn);
+    assert(conn.state == CONN_READY);
+
+    conn_http_t *http = conn.http;
+    assert(conn_slice_is(&conn, http->method, "POST"));
+    assert(conn_slice_is(&conn, http->path, "/echo?x=1"));
+    assert(conn_slice_is(&conn, http->version, "HTTP/1.1"));
+    assert(conn_slice_is(&conn, http->body, "body"));
+    assert(http->nr_headers == 3);
+    assert(conn_slice_is(&conn, *conn_header(&conn, "HOST"), "localhost"));
+    assert(conn_slice_is(&conn, *conn_header(&conn, "Content-Length"), "4"));
+    assert(conn_header(&conn, "x-empty")->len == 0);
+    assert(conn_header(&conn, "Connection") == NULL);
+
+    // Once the reply is sent, the pipelined request is parsed
+    conn.fd = -1;
+    conn.reply = NULL;
+    sb_reprintf(&conn.reply_header, "HTTP/1.1 200 OK\r\n\r\n");
+    conn.state = CONN_SENDING;
+    conn_sent(&conn, sb_len(conn.reply_header));
+    assert(conn.state == CONN_READY);
+    assert(conn.keepalive == 0);
+    assert(conn_slice_is(&conn, conn.http->path, "/next"));
+    assert(conn.http->body.len == 0);
+
+    // The quality of each token in a list
+    conn_zero(&conn);
+    conn.state = CONN_READING;
+    parse_bytes(&conn,
+        "GET / HTTP/1.1\r\n"
+        "Accept-Encoding: deflate;q=0.5, GZIP , br;q=0, x;q=0.25\r\n"
+        "Accept: a/b;seq=9;q=0.7,c/d; v=1 ;Q=0.3\r\n"
+        "\r\n");
+    assert(conn.state == CONN_READY);
+    assert(conn_header_q(&conn, "Accept-Encoding", "gzip") == 1000);
+    assert(conn_header_q(&conn, "Accept-Encoding", "deflate") == 500);
+    assert(conn_header_q(&conn, "Accept-Encoding", "br") == 0);
+    assert(conn_header_q(&conn, "Accept-Encoding", "x") == 250);
+    assert(conn_header_q(&conn, "Accept-Encoding", "zstd") == -1);
+    assert(conn_header_q(&conn, "Accept", "gzip") == -1);
+    assert(conn_header_q(&conn, "Accept", "a/b") == 700);
+    assert(conn_header_q(&conn, "Accept", "c/d") == 300);
+
+    // Bad requests are answered, and then closed
+    char *bad[] = {
+        "GET /\r\n\r\n",
+        "GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: 99999999999\r\n\r\n",
+    };
+    char *status[] = { "400", "400", "400", "413" };
+    for (unsigned int i=0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        conn_zero(&conn);
+        conn.state = CONN_READING;
+        parse_bytes(&conn, bad[i]);
+        assert(conn.state == CONN_SENDING);
+        assert(conn.keepalive == 0);
+        assert(memcmp(&conn.reply_header->str[9], status[i], 3) == 0);
+    }
+
+    // Too many header fields are rejected as soon as they are seen
+    conn_zero(&conn);
+    conn.state = CONN_READING;
+    parse_bytes(&conn, "GET / HTTP/1.1\r\n");
+    for (int i=0; i < CONN_HEADERS; i++) {
+        parse_bytes(&conn, "A: b\r\n");
+    }
+    assert(sb_reappend(&conn.request, "A: b\r\n", 6));
+    conn_received(&conn);
+    assert(conn.state == CONN_SENDING);
+    assert(memcmp(&conn.reply_header->str[9], "431", 3) == 0);
+
+    // The buffer doubles as it grows, and a header that does not fit is
+    // rejected
+    int fds[2];
+    char buf[1000];
+    memset(buf, 'a', sizeof(buf));
+    assert(pipe(fds)==0);
+    assert(write(fds[1], buf, 600)==600);
+    free(conn.request);
+    conn.request = sb_malloc(48);
+    conn.request->capacity_max = 1000;
+    conn_zero(&conn);
+    conn.state = CONN_READING;
+    conn.fd = fds[0];
+    while (sb_len(conn.request) < 600) {
+        conn_read(&conn);
+    }
+    assert(conn.request->capacity == 768);
+    assert(conn.state == CONN_READING);
 
+    assert(write(fds[1], buf, 400)==400);
+    while (conn.state == CONN_READING) {
+        conn_read(&conn);
+    }
+    assert(conn.request->capacity == 1000);
+    assert(conn.state == CONN_SENDING);
+    assert(memcmp(&conn.reply_header->str[9], "431", 3) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    free(conn.request);
+    free(conn.http);
+    free(conn.reply_header);
+}
+
+int connect_unix(char *path) {
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd != -1);
+    assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr))==0);
+    return fd;
+}
+
+void connslot_grow_tests() {
+    char *path = sock_path;
+    int clients[6];
+
+    slots_t *p = slots_malloc(2);
+    assert(p);
+    p->max_slots = 5;
+    assert(slots_listen_unix(p, path)==0);
+
+    // The backlog holds more connections than there are slots
+    for (int i=0; i<6; i++) {
+        clients[i] = connect_unix(path);
+    }
+
+    // The pool doubles, but not past the max
+    assert(slots_accept(p, 0)==0);
+    assert(slots_accept(p, 0)==1);
+    assert(p->nr_slots==2);
+    assert(slots_accept(p, 0)==2);
+    assert(p->nr_slots==4);
+    assert(slots_accept(p, 0)==3);
+    assert(slots_accept(p, 0)==4);
+    assert(p->nr_slots==5);
+    assert(p->nr_open==5);
+    assert(slots_accept(p, 0)==-2);
+
+    // Everything is idle
+    p->timeout = -10;
+    assert(slots_closeidle(p)==5);
+    assert(p->nr_open==0);
+
+    // The free slots are reused, and are all still there
+    assert(slots_accept(p, 0)>=0);
+    assert(p->nr_open==1);
+    assert(p->nr_slots==5);
+
+    p->timeout = -10;
+    assert(slots_closeidle(p)==1);
+
+    for (int i=0; i<6; i++) {
+        close(clients[i]);
+    }
+    close(p->listen[0]);
+    unlink(path);
     slots_free(p);
 }
 
+// Tests are silent and return if everything is OK, or abort if issues
+void connslot_reply_tests() {
+    conn_t conn;
+    struct iovec vecs[CONN_IOVECS];
+    memset(&conn, 0, sizeof(conn));
+    assert(conn_init(&conn)==0);
+
+    // The same header and body can be shared by many connections
+    strbuf_t *shared = sb_malloc(64);
+    strbuf_t *body = sb_malloc(64);
+    sb_printf(shared, "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n");
+    sb_printf(body, "body");
+    sb_reprintf(&conn.reply_header, "Connection: close\r\n\r\n");
+    conn.shared_header = shared;
+    conn.reply = body;
+    conn.state = CONN_SENDING;
+
+    assert(conn_iovec(&conn, vecs)==3);
+    assert(vecs[0].iov_base==shared->str);
+    assert(vecs[1].iov_base==conn.reply_header->str);
+    assert(vecs[2].iov_len==4);
+
+    // Short writes resume part way through each of them
+    conn_sent(&conn, 5);
+    assert(conn_iovec(&conn, vecs)==3);
+    assert(vecs[0].iov_base==&shared->str[5]);
+    conn_sent(&conn, sb_len(shared) - 5 + 3);
+    assert(conn_iovec(&conn, vecs)==2);
+    assert(vecs[0].iov_base==&conn.reply_header->str[3]);
+    conn_sent(&conn, sb_len(conn.reply_header) - 3 + 1);
+    assert(conn_iovec(&conn, vecs)==1);
+    assert(vecs[0].iov_base==&body->str[1]);
+    assert(conn.state==CONN_SENDING);
+
+    // Once it is all sent, only the unshared parts are reset
+    conn_sent(&conn, 3);
+    assert(conn.state==CONN_EMPTY);
+    assert(conn.shared_header==NULL);
+    assert(conn.reply==NULL);
+    assert(sb_len(conn.reply_header)==0);
+    assert(sb_len(shared)==36);
+    assert(sb_len(body)==4);
+
+    // A body in more pieces than fit in one write is sent in turns
+    struct iovec pieces[CONN_IOVECS + 4];
+    for (int i = 0; i < CONN_IOVECS + 4; i++) {
+        pieces[i].iov_base = body->str;
+        pieces[i].iov_len = sb_len(body);
+    }
+    conn.shared_header = shared;
+    conn.reply_vecs = pieces;
+    conn.reply_nr_vecs = CONN_IOVECS + 4;
+    conn.state = CONN_SENDING;
+    assert(conn_iovec(&conn, vecs)==CONN_IOVECS);
+    assert(vecs[0].iov_base==shared->str);
+    assert(vecs[1].iov_base==body->str);
+
+    conn_sent(&conn, sb_len(shared) + 4 * (CONN_IOVECS - 1) + 2);
+    assert(conn_iovec(&conn, vecs)==5);
+    assert(vecs[0].iov_base==&body->str[2]);
+    assert(vecs[0].iov_len==2);
+    assert(vecs[4].iov_len==4);
+    conn_sent(&conn, 2 + 4 * 4);
+    assert(conn.state==CONN_EMPTY);
+    assert(conn.reply_vecs==NULL);
+    assert(conn.reply_nr_vecs==0);
+
+    free(shared);
+    free(body);
+    free(conn.request);
+    free(conn.http);
+    free(conn.reply_header);
+}
+
+// Reply with the request line, so the order of the replies can be checked
+void keepalive_request(conn_t *conn, void *arg) {
+    int *nr = arg;
+    char *eol = memmem(conn->request->str, conn->request_len, "\r\n", 2);
+    assert(eol);
+    (*nr)++;
+    sb_reprintf(
+        &conn->reply_header,
+        "%i %.*s\n",
+        *nr,
+        (int)(eol - conn->request->str),
+        conn->request->str
+    );
+    conn_write(conn);
+}
+
+void connslot_keepalive_tests() {
+    char *path = sock_path;
+    char buf[200];
+    int nr = 0;
+
+    slots_t *p = slots_malloc(1);
+    assert(p);
+    assert(slots_listen_unix(p, path)==0);
+    int client = connect_unix(path);
+
+    // All sent at once, so the later requests are queued behind the first
+    char requests[] =
+        "GET /a HTTP/1.1\r\n\r\n"
+        "POST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nxyz"
+        "GET /c HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+        "GET /d HTTP/1.1\r\nconnection: Close\r\n\r\n"
+        "GET /e HTTP/1.1\r\n\r\n";
+    assert(write(client, requests, sizeof(requests) - 1)==sizeof(requests) - 1);
+
+    for (int i=0; i<100 && !(nr && p->nr_open==0); i++) {
+        assert(slots_wait(p, 100, keepalive_request, &nr)>=0);
+    }
+
+    // Answered in order, and closed after the one that asked for it
+    char expected[] =
+        "1 GET /a HTTP/1.1\n"
+        "2 POST /b HTTP/1.1\n"
+        "3 GET /c HTTP/1.0\n"
+        "4 GET /d HTTP/1.1\n";
+    size_t got = 0;
+    ssize_t size;
+    while ((size = read(client, &buf[got], sizeof(buf) - got)) > 0) {
+        got += size;
+    }
+    assert(got==sizeof(expected) - 1);
+    assert(memcmp(buf, expected, got)==0);
+    close(client);
+
+    // HTTP/1.0 closes after one reply
+    client = connect_unix(path);
+    assert(write(client, "GET /f HTTP/1.0\r\n\r\n", 19)==19);
+    nr = 0;
+    for (int i=0; i<100 && !(nr && p->nr_open==0); i++) {
+        assert(slots_wait(p, 100, keepalive_request, &nr)>=0);
+    }
+    assert(read(client, buf, sizeof(buf))==18);
+    assert(memcmp(buf, "1 GET /f HTTP/1.0\n", 18)==0);
+    assert(read(client, buf, sizeof(buf))==0);
+    close(client);
+
+    close(p->listen[0]);
+    unlink(path);
+    slots_free(p);
+}
+
+#define FILE_SIZE (1024*1024)
+
+int released = 0;
+
+void file_release(void *arg) {
+    assert(arg==&released);
+    released++;
+}
+
+// Reply with a new reference to the file, which the connection closes
+void file_request(conn_t *conn, void *arg) {
+    int *fd = arg;
+    sb_reprintf(&conn->reply_header, "header\n");
+    conn->reply_file = dup(fd[0]);
+    fd[1] = conn->reply_file;
+    conn->reply_file_len = FILE_SIZE;
+    conn->reply_release = file_release;
+    conn->reply_owner = &released;
+    conn_write(conn);
+}
+
+void connslot_file_tests() {
+    char *path = sock_path;
+    int fd[2] = { memfd_create("connslot-tests", 0), -1 };
+    assert(fd[0] != -1);
+    char *buf = malloc(FILE_SIZE);
+    assert(buf);
+    for (int i = 0; i < FILE_SIZE; i++) {
+        buf[i] = i % 251;
+    }
+    assert(write(fd[0], buf, FILE_SIZE)==FILE_SIZE);
+
+    slots_t *p = slots_malloc(1);
+    assert(p);
+    assert(slots_listen_unix(p, path)==0);
+    int client = connect_unix(path);
+    fcntl(client, F_SETFL, O_NONBLOCK);
+
+    // Much more than the socket can hold, so it is sent in many parts
+    char requests[] =
+        "GET /a HTTP/1.1\r\n\r\n"
+        "GET /b HTTP/1.1\r\nConnection: close\r\n\r\n";
+    assert(write(client, requests, sizeof(requests) - 1)==sizeof(requests) - 1);
+
+    size_t want = (7 + FILE_SIZE) * 2;
+    char *got = malloc(want + 1);
+    size_t len = 0;
+    ssize_t size = 1;
+    while (size) {
+        assert(slots_wait(p, 100, file_request, fd)>=0);
+        while ((size = read(client, &got[len], want + 1 - len)) > 0) {
+            len += size;
+        }
+    }
+    assert(len==want);
+    for (int i = 0; i < 2; i++) {
+        char *reply = &got[i * (7 + FILE_SIZE)];
+        assert(memcmp(reply, "header\n", 7)==0);
+        assert(memcmp(&reply[7], buf, FILE_SIZE)==0);
+    }
+
+    // The last reply closed its own reference, leaving ours
+    assert(p->nr_open==0);
+    assert(released==2);
+    assert(fcntl(fd[1], F_GETFD)==-1);
+    assert(fcntl(fd[0], F_GETFD)!=-1);
+
+    close(client);
+    close(fd[0]);
+    close(p->listen[0]);
+    unlink(path);
+    slots_free(p);
+    free(got);
+    free(buf);
+}
+
+strbuf_t *parts[3];
+int parts_ready;
+
+// Reply in parts, waiting for each part until it is ready
+void parts_request(conn_t *conn, void *arg) {
+    (void)arg;
+    strbuf_t **next = conn->reply_more;
+    if (!next) {
+        // A new request, which gets the header straight away
+        sb_reprintf(&conn->reply_header, "header\n");
+        conn->reply_more = &parts[0];
+        conn_write(conn);
+        return;
+    }
+    if (next - parts >= parts_ready) {
+        conn->state = CONN_WAITING;
+        return;
+    }
+    conn->reply = *next;
+    conn->reply_more = (next == &parts[2]) ? NULL : next + 1;
+    conn_write(conn);
+}
+
+// Tests are silent and return if everything is OK, or abort if issues
+void connslot_parts_tests() {
+    char *path = sock_path;
+    char buf[100];
+    char *text[] = { "one,", "two,", "three\n" };
+    for (int i = 0; i < 3; i++) {
+        parts[i] = sb_malloc(16);
+        sb_printf(parts[i], "%s", text[i]);
+    }
+
+    slots_t *p = slots_malloc(1);
+    assert(p);
+    assert(slots_listen_unix(p, path)==0);
+    int client = connect_unix(path);
+    fcntl(client, F_SETFL, O_NONBLOCK);
+
+    char requests[] =
+        "GET /a HTTP/1.1\r\n\r\n"
+        "GET /b HTTP/1.1\r\nConnection: close\r\n\r\n";
+    assert(write(client, requests, sizeof(requests) - 1)==sizeof(requests) - 1);
+
+    // Only the first part is ready
+    parts_ready = 1;
+    size_t got = 0;
+    ssize_t size;
+    for (int i = 0; i < 10; i++) {
+        assert(slots_wait(p, 10, parts_request, NULL)>=0);
+        while ((size = read(client, &buf[got], sizeof(buf) - got)) > 0) {
+            got += size;
+        }
+    }
+    assert(got==11);
+    assert(memcmp(buf, "header\none,", got)==0);
+    assert(p->conn[0].state==CONN_WAITING);
+
+    // The rest of the first reply, and then all of the pipelined one
+    parts_ready = 3;
+    slots_foreach(p, CONN_WAITING, parts_request, NULL);
+    size = 1;
+    while (size) {
+        assert(slots_wait(p, 10, parts_request, NULL)>=0);
+        while ((size = read(client, &buf[got], sizeof(buf) - got)) > 0) {
+            got += size;
+        }
+    }
+    char expected[] = "header\none,two,three\nheader\none,two,three\n";
+    assert(got==sizeof(expected) - 1);
+    assert(memcmp(buf, expected, got)==0);
+    assert(p->nr_open==0);
+
+    close(client);
+    close(p->listen[0]);
+    unlink(path);
+    slots_free(p);
+    for (int i = 0; i < 3; i++) {
+        free(parts[i]);
+    }
+}
+
+// Tests are silent and return if everything is OK, or abort if issues
+void connslot_reuseport_tests() {
+    slots_t *a = slots_malloc(1);
+    slots_t *b = slots_malloc(1);
+    assert(a && b);
+
+    // Only listeners that all ask for it can share the port
+    a->reuseport = 1;
+    assert(slots_listen_tcp(a, 18091)==0);
+    assert(slots_listen_tcp(b, 18091)==-1);
+    b->reuseport = 1;
+    assert(slots_listen_tcp(b, 18091)==0);
+
+    close(a->listen[0]);
+    close(b->listen[0]);
+    slots_free(a);
+    slots_free(b);
+}
+
 int main() {
     printf("Running conslot tests\n");
+    snprintf(sock_path, sizeof(sock_path), "connslot-tests.%i.sock", getpid());
 
     // Many sizes are acceptable, so this is informational only
     printf("sizeof(conn_t) = %li\n", sizeof(conn_t));
     printf("sizeof(slots_t) = %li\n", sizeof(slots_t));
 
     connslot_tests();
+    connslot_watch_tests();
+    connslot_parse_tests();
+    connslot_grow_tests();
+    connslot_reply_tests();
+    connslot_keepalive_tests();
+    connslot_file_tests();
+    connslot_parts_tests();
+    connslot_reuseport_tests();
 }
@@ -8,11 +8,16 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#ifndef CONNSLOT_SELECT
+#include <sys/epoll.h>
+#endif
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <time.h>
@@ -20,176 +25,617 @@
 
 #include "connslot.h"
 
+#ifdef CONNSLOT_URING
+#ifdef CONNSLOT_SELECT
+#error "CONNSLOT_URING falls back to epoll, so cannot be used with CONNSLOT_SELECT"
+#endif
+#include "uring.h"
+
+struct slots_uring *_uring_malloc(slots_t *, int);
+int _uring_grow(slots_t *, int);
+void _uring_free(struct slots_uring *);
+ssize_t _uring_write(conn_t *);
+void _uring_close(slots_t *, int);
+int _uring_watch(slots_t *, int);
+void _uring_unwatch(slots_t *, int);
+int _uring_wait(slots_t *, int, slots_cb_t, void *);
+#endif
+
 void conn_zero(conn_t *conn) {
     conn->fd = -1;
+    conn->events = 0;
+    conn->uring = NULL;
     conn->state = CONN_EMPTY;
+    conn->keepalive = 0;
+    conn->shared_header = NULL;
     conn->reply = NULL;
+    conn->reply_vecs = NULL;
+    conn->reply_nr_vecs = 0;
+    conn->reply_file = -1;
+    conn->reply_file_len = 0;
+    conn->reply_release = NULL;
+    conn->reply_owner = NULL;
+    conn->reply_more = NULL;
     conn->reply_sendpos = 0;
+    conn->request_len = 0;
     conn->activity = 0;
 
     if (conn->request) {
         sb_zero(conn->request);
     }
+    if (conn->http) {
+        memset(conn->http, 0, sizeof(conn_http_t));
+    }
     if (conn->reply_header) {
         sb_zero(conn->reply_header);
     }
 }
 
+/*
+ * Allocate the buffers for a new conn.  The conn is made up locally and
+ * then stored in one go, so it either owns all of the buffers or, on error,
+ * is left untouched with none of them allocated.
+ */
 int conn_init(conn_t *conn) {
+    conn_t new = { 0 };
+
     // TODO: make capacity flexible
-    conn->request = sb_malloc(48);
-    conn->request->capacity_max = 1000;
-    conn->reply_header = sb_malloc(48);
-    conn->reply_header->capacity_max = 1000;
+    new.request = sb_malloc(48);
+    new.http = malloc(sizeof(conn_http_t));
+    new.reply_header = sb_malloc(48);
+    if (!new.request || !new.http || !new.reply_header) {
+        free(new.request);
+        free(new.http);
+        free(new.reply_header);
+        return -1;
+    }
+    new.request->capacity_max = 1000;
+    new.reply_header->capacity_max = 1000;
 
-    conn_zero(conn);
+    conn_zero(&new);
+    *conn = new;
+    return 0;
+}
+
+/*
+ * Make room for size more bytes of request, doubling the buffer each time
+ * so that a large request does not need a realloc for every read
+ */
+int _conn_reserve(conn_t *conn, size_t size) {
+    strbuf_t *p = conn->request;
+    size_t needed = p->wr_pos + size;
+    if (needed <= p->capacity) {
+        return 0;
+    }
+    if (needed > p->capacity_max) {
+        return -1;
+    }
 
-    if (!conn->request || !conn->reply_header) {
+    size_t capacity = p->capacity * 2;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    if (!sb_realloc(&conn->request, capacity)) {
         return -1;
     }
     return 0;
 }
 
 void conn_read(conn_t *conn) {
-    conn->state = CONN_READING;
-
     // If no space available, try increasing our capacity
-    if (!sb_avail(conn->request)) {
-        strbuf_t *p = sb_realloc(&conn->request, conn->request->capacity + 16);
-        if (!p) {
-            abort(); // FIXME: do something smarter?
-        }
+    if (!sb_avail(conn->request) && _conn_reserve(conn, 1) != 0) {
+        // Too large for the request buffer, so give up on it
+        conn->state = CONN_EMPTY;
+        return;
     }
 
     ssize_t size = sb_read(conn->fd, conn->request);
 
+    if (size == -1) {
+        // Nothing to read after all, or an error that the next read finds
+        return;
+    }
     if (size == 0) {
         // TODO: confirm what other times we can get zero on a ready fd
         conn->state = CONN_EMPTY;
         return;
     }
 
-    conn->activity = time(NULL);
+    conn_received(conn);
+}
 
-    // case protocol==HTTP
+// The start of the slice, which is not zero terminated
+char *conn_slice_ptr(conn_t *conn, conn_slice_t slice) {
+    return &conn->request->str[slice.pos];
+}
 
-    if (sb_len(conn->request)<4) {
-        // Not enough bytes to match the end of header check
-        return;
+// Check if the slice is exactly the given string
+int conn_slice_is(conn_t *conn, conn_slice_t slice, const char *s) {
+    return strlen(s) == slice.len &&
+        memcmp(conn_slice_ptr(conn, slice), s, slice.len) == 0;
+}
+
+int _conn_slice_casecmp(conn_t *conn, conn_slice_t slice, const char *s) {
+    if (strlen(s) != slice.len) {
+        return 1;
     }
+    return strncasecmp(conn_slice_ptr(conn, slice), s, slice.len);
+}
 
-    // retrieve the cached expected length, if any
-    unsigned int expected_length = conn->request->rd_pos;
+// Find the value of a header field, or NULL if the request has none
+conn_slice_t *conn_header(conn_t *conn, const char *name) {
+    conn_http_t *http = conn->http;
+    for (int i=0; i < http->nr_headers; i++) {
+        if (_conn_slice_casecmp(conn, http->header[i].name, name) == 0) {
+            return &http->header[i].value;
+        }
+    }
+    return NULL;
+}
 
-    if (expected_length == 0) {
-        char *p = memmem(conn->request->str, sb_len(conn->request), "\r\n\r\n", 4);
-        if (!p) {
-            // As yet, we dont have an entire header
-            return;
+/*
+ * Look for a token in a comma separated header field, like the "gzip" in
+ * "Accept-Encoding: deflate, gzip;q=0.5".  Returns its quality value from
+ * 0 to 1000, or -1 if it is not listed
+ */
+int conn_header_q(conn_t *conn, const char *name, const char *token) {
+    conn_slice_t *value = conn_header(conn, name);
+    if (!value) {
+        return -1;
+    }
+
+    char *p = conn_slice_ptr(conn, *value);
+    char *end = p + value->len;
+    size_t token_len = strlen(token);
+
+    while (p < end) {
+        char *next = memchr(p, ',', end - p);
+        if (!next) {
+            next = end;
+        }
+        while (p < next && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        // Never negative, but gcc -O2 cannot tell that for the memchr()
+        size_t field_len = next > p ? (size_t)(next - p) : 0;
+        char *param = memchr(p, ';', field_len);
+        char *token_end = param ? param : next;
+        while (token_end > p && (token_end[-1] == ' ' || token_end[-1] == '\t')) {
+            token_end--;
+        }
+
+        if ((size_t)(token_end - p) == token_len &&
+                strncasecmp(p, token, token_len) == 0) {
+            // Only the q parameter is looked at, as "q=0.5" is 500
+            int q = 1000;
+            char *qp = NULL;
+            while (param && param < next) {
+                param++;
+                while (param < next && (*param == ' ' || *param == '\t')) {
+                    param++;
+                }
+                if (next - param >= 2 && strncasecmp(param, "q=", 2) == 0) {
+                    qp = param;
+                    break;
+                }
+                param = memchr(param, ';', next - param);
+            }
+            if (qp) {
+                qp += 2;
+                q = (qp < next && *qp == '1') ? 1000 : 0;
+                if (qp + 1 < next && qp[1] == '.') {
+                    int scale = 100;
+                    for (qp += 2; qp < next && *qp >= '0' && *qp <= '9' && scale; qp++) {
+                        q += (*qp - '0') * scale;
+                        scale /= 10;
+                    }
+                }
+                q = (q > 1000) ? 1000 : q;
+            }
+            return q;
         }
+        p = next + 1;
+    }
+    return -1;
+}
 
-        int body_pos = p - conn->request->str + 4;
+conn_slice_t _conn_slice(char *str, char *start, char *end) {
+    conn_slice_t slice = {
+        .pos = start - str,
+        .len = end - start,
+    };
+    return slice;
+}
 
-        // Determine if we need to read a body
-        p = memmem(
-                conn->request->str,
-                body_pos,
-                "Content-Length:",
-                15
-        );
+// Answer a request that cannot be served, and close once that is sent
+void _conn_reject(conn_t *conn, const char *status) {
+    conn->keepalive = 0;
+    conn->shared_header = NULL;
+    conn->reply = NULL;
+    sb_zero(conn->reply_header);
+    sb_reprintf(&conn->reply_header, "HTTP/1.1 %s\r\n", status);
+    sb_reprintf(&conn->reply_header, "Content-Length: 0\r\n");
+    sb_reprintf(&conn->reply_header, "Connection: close\r\n\r\n");
+    conn_write(conn);
+}
 
-        if (!p) {
-            // We have an end of header, and the header has no content length field
-            // so assume there is no body to read
-            conn->state = CONN_READY;
-            return;
+// "GET /path HTTP/1.1", returning an error status if it is not like that
+const char *_conn_request_line(conn_http_t *http, char *str, char *start, char *end) {
+    char *sp1 = memchr(start, ' ', end - start);
+    if (!sp1 || sp1 == start) {
+        return "400 Bad Request";
+    }
+    char *path = sp1 + 1;
+    char *sp2 = memchr(path, ' ', end - path);
+    if (!sp2 || sp2 == path) {
+        return "400 Bad Request";
+    }
+    char *version = sp2 + 1;
+    if (end - version < 5 || memcmp(version, "HTTP/", 5) != 0) {
+        return "400 Bad Request";
+    }
+
+    http->method = _conn_slice(str, start, sp1);
+    http->path = _conn_slice(str, path, sp2);
+    http->version = _conn_slice(str, version, end);
+    return NULL;
+}
+
+// "Name: value", returning an error status if it cannot be used
+const char *_conn_header_line(conn_http_t *http, char *str, char *start, char *end) {
+    if (*start == ' ' || *start == '\t') {
+        // The obsolete line folding
+        return "400 Bad Request";
+    }
+    char *colon = memchr(start, ':', end - start);
+    if (!colon || colon == start) {
+        return "400 Bad Request";
+    }
+    if (http->nr_headers == CONN_HEADERS) {
+        return "431 Request Header Fields Too Large";
+    }
+
+    char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    conn_header_t *header = &http->header[http->nr_headers++];
+    header->name = _conn_slice(str, start, colon);
+    header->value = _conn_slice(str, value, end);
+    return NULL;
+}
+
+// The whole header has arrived, so work out what to do with the body
+const char *_conn_header_end(conn_t *conn, unsigned int body_pos) {
+    conn_http_t *http = conn->http;
+    http->body_pos = body_pos;
+
+    // HTTP/1.1 keeps the connection open unless asked not to
+    conn->keepalive = conn_slice_is(conn, http->version, "HTTP/1.1");
+    conn_slice_t *value = conn_header(conn, "Connection");
+    if (value && _conn_slice_casecmp(conn, *value, "close") == 0) {
+        conn->keepalive = 0;
+    } else if (value && _conn_slice_casecmp(conn, *value, "keep-alive") == 0) {
+        conn->keepalive = 1;
+    }
+
+    value = conn_header(conn, "Content-Length");
+    if (!value) {
+        // Assume there is no body to read
+        return NULL;
+    }
+    if (!value->len) {
+        return "400 Bad Request";
+    }
+
+    // Once the body cannot fit, there is no point reading any more of it
+    unsigned int max = conn->request->capacity_max - body_pos;
+    char *p = conn_slice_ptr(conn, *value);
+    unsigned int content_length = 0;
+    for (unsigned int i=0; i < value->len; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return "400 Bad Request";
+        }
+        content_length = content_length * 10 + p[i] - '0';
+        if (content_length > max) {
+            return "413 Content Too Large";
         }
+    }
+    http->content_length = content_length;
+    return NULL;
+}
 
-        p+=15; // Skip the field name
-        unsigned int content_length = strtoul(p, NULL, 10);
-        expected_length = body_pos + content_length;
+/*
+ * Check if the bytes added to the request have completed it.
+ *
+ * The request line and each header field are parsed once, as soon as their
+ * line is complete, and the parsing resumes from where it stopped on the
+ * next call, so a slowly arriving request is not scanned again each time
+ */
+void conn_received(conn_t *conn) {
+    conn->activity = time(NULL);
+
+    switch (conn->state) {
+        case CONN_READY:
+        case CONN_WAITING:
+        case CONN_SENDING:
+            // A pipelined request, which is looked at once the reply to the
+            // one before it has been sent
+            return;
+        default:
+            break;
     }
+    conn->state = CONN_READING;
+
+    // case protocol==HTTP
+
+    conn_http_t *http = conn->http;
+    while (!http->body_pos) {
+        char *str = conn->request->str;
+        char *start = &str[http->scan_pos];
+        char *nl = memchr(start, '\n', sb_len(conn->request) - http->scan_pos);
+        if (!nl) {
+            // As yet, we dont have an entire line
+            http->scan_pos = sb_len(conn->request);
+            if (sb_len(conn->request) >= conn->request->capacity_max) {
+                _conn_reject(conn, "431 Request Header Fields Too Large");
+            }
+            return;
+        }
 
-    // By this point we must have an expected_length
+        char *line = &str[http->line_pos];
+        char *end = nl;
+        if (end > line && end[-1] == '\r') {
+            end--;
+        }
+        http->scan_pos = nl - str + 1;
+        http->line_pos = http->scan_pos;
+
+        const char *error;
+        if (!http->method.len) {
+            if (end == line) {
+                // Ignore any empty lines before the request
+                continue;
+            }
+            error = _conn_request_line(http, str, line, end);
+        } else if (end == line) {
+            error = _conn_header_end(conn, http->scan_pos);
+        } else {
+            error = _conn_header_line(http, str, line, end);
+        }
 
-    // cache the calculated total length in the conn
-    conn->request->rd_pos = expected_length;
+        if (error) {
+            _conn_reject(conn, error);
+            return;
+        }
+    }
 
+    unsigned int expected_length = http->body_pos + http->content_length;
     if (sb_len(conn->request) < expected_length) {
         // Dont have enough length
         return;
     }
 
-    // Do have enough length
+    // Do have enough length, and anything after it is the next request
+    http->body = (conn_slice_t){ http->body_pos, http->content_length };
     conn->state = CONN_READY;
-    conn->request->rd_pos = 0;
+    conn->request_len = expected_length;
     return;
 }
 
-ssize_t conn_write(conn_t *conn) {
-    ssize_t sent;
+// Fill in the vectors for the rest of the reply, returning how many.  A
+// long reply_vecs may need more than CONN_IOVECS, and the rest of them are
+// looked at again once the first ones have been sent
+int conn_iovec(conn_t *conn, struct iovec *vecs) {
+    strbuf_t *parts[3] = {
+        conn->shared_header,
+        conn->reply_header,
+        conn->reply,
+    };
+    unsigned int pos = conn->reply_sendpos;
     int nr = 0;
-    unsigned int reply_pos = 0;
-    unsigned int end_pos = 0;
 
-    conn->state = CONN_SENDING;
+    for (int i = 0; i < 3; i++) {
+        if (!parts[i]) {
+            continue;
+        }
+        unsigned int len = sb_len(parts[i]);
+        if (pos >= len) {
+            // Already sent
+            pos -= len;
+            continue;
+        }
+        vecs[nr].iov_base = &parts[i]->str[pos];
+        vecs[nr].iov_len = len - pos;
+        pos = 0;
+        nr++;
+    }
+    for (unsigned int i = 0; i < conn->reply_nr_vecs && nr < CONN_IOVECS; i++) {
+        unsigned int len = conn->reply_vecs[i].iov_len;
+        if (pos >= len) {
+            pos -= len;
+            continue;
+        }
+        vecs[nr].iov_base = (char *)conn->reply_vecs[i].iov_base + pos;
+        vecs[nr].iov_len = len - pos;
+        pos = 0;
+        nr++;
+    }
+    return nr;
+}
 
-    struct iovec vecs[2];
+// The length of the parts of the reply that are sent from memory
+unsigned int _conn_buffered_len(conn_t *conn) {
+    unsigned int len = 0;
 
+    if (conn->shared_header) {
+        len += sb_len(conn->shared_header);
+    }
     if (conn->reply_header) {
-        end_pos += sb_len(conn->reply_header);
-        if (conn->reply_sendpos < sb_len(conn->reply_header)) {
-            size_t size = sb_len(conn->reply_header) - conn->reply_sendpos;
-            vecs[nr].iov_base = &conn->reply_header->str[conn->reply_sendpos];
-            vecs[nr].iov_len = size;
-            nr++;
-        } else {
-            reply_pos = conn->reply_sendpos - sb_len(conn->reply_header);
-        }
+        len += sb_len(conn->reply_header);
     }
-
     if (conn->reply) {
-        end_pos += sb_len(conn->reply);
-        vecs[nr].iov_base = &conn->reply->str[reply_pos];
-        vecs[nr].iov_len = sb_len(conn->reply) - reply_pos;
-        nr++;
+        len += sb_len(conn->reply);
+    }
+    for (unsigned int i = 0; i < conn->reply_nr_vecs; i++) {
+        len += conn->reply_vecs[i].iov_len;
     }
+    return len;
+}
 
-    sent = writev(conn->fd, &vecs[0], nr);
+// Let go of the parts of the reply that have been sent
+void _conn_release_parts(conn_t *conn) {
+    conn->shared_header = NULL;
+    conn->reply = NULL;
+    conn->reply_vecs = NULL;
+    conn->reply_nr_vecs = 0;
+    if (conn->reply_file != -1) {
+        close(conn->reply_file);
+        conn->reply_file = -1;
+    }
+    conn->reply_sendpos = 0;
+    if (conn->reply_header) {
+        sb_zero(conn->reply_header);
+    }
+}
 
-#if NOVEC
-    if (conn->reply_sendpos < sb_len(conn->reply_header)) {
-        sent = sb_write(
-                conn->fd,
-                conn->reply_header,
-                conn->reply_sendpos,
-                -1
-        );
-    } else {
-        sent = sb_write(
-                conn->fd,
-                conn->reply,
-                conn->reply_sendpos - sb_len(conn->reply_header),
-                -1
-        );
+// Let go of the shared parts of the reply
+void _conn_release(conn_t *conn) {
+    _conn_release_parts(conn);
+    if (conn->reply_release) {
+        conn->reply_release(conn->reply_owner);
+        conn->reply_release = NULL;
+        conn->reply_owner = NULL;
+    }
+}
+
+// Account for some of the reply having been sent
+void conn_sent(conn_t *conn, ssize_t sent) {
+    unsigned int end_pos = _conn_buffered_len(conn);
+    if (conn->reply_file != -1) {
+        end_pos += conn->reply_file_len;
+    }
+
+    if (sent > 0) {
+        conn->reply_sendpos += sent;
+    }
+
+    conn->activity = time(NULL);
+
+    if (conn->reply_sendpos < end_pos) {
+        return;
     }
-    unsigned int end_pos = sb_len(conn->reply_header) + sb_len(conn->reply);
-#endif
 
-    conn->reply_sendpos += sent;
+    if (conn->reply_more) {
+        // Ask the application for the next part of the reply
+        _conn_release_parts(conn);
+        conn->state = CONN_READY;
+        return;
+    }
 
-    if (conn->reply_sendpos >= end_pos) {
-        // We have sent the last bytes of this reply
+    // We have sent the last bytes of this reply
+    _conn_release(conn);
+
+    if (!conn->keepalive) {
         conn->state = CONN_EMPTY;
-        conn->reply_sendpos = 0;
-        sb_zero(conn->reply_header);
         sb_zero(conn->request);
+        return;
     }
 
-    conn->activity = time(NULL);
+    // Only forget this request, keeping any pipelined ones behind it
+    strbuf_t *p = conn->request;
+    unsigned int len = conn->request_len;
+    memmove(p->str, &p->str[len], p->wr_pos - len);
+    p->wr_pos -= len;
+    memset(conn->http, 0, sizeof(conn_http_t));
+    conn->request_len = 0;
+    conn->state = CONN_READING;
+    conn_received(conn);
+}
+
+/*
+ * Send some more of the reply_file, which comes after all the other parts
+ * @return the number sent, or -1 with errno EAGAIN if the socket is full.
+ * Any other error cannot be recovered from, so the connection is left
+ * CONN_EMPTY to be closed.
+ */
+ssize_t _conn_sendfile(conn_t *conn) {
+    off_t offset = conn->reply_sendpos - _conn_buffered_len(conn);
+    ssize_t sent = sendfile(
+        conn->fd,
+        conn->reply_file,
+        &offset,
+        conn->reply_file_len - offset
+    );
+    if (sent == -1 && errno != EAGAIN) {
+        conn->state = CONN_EMPTY;
+        return -1;
+    }
+    conn_sent(conn, sent);
+    return sent;
+}
+
+// Send as much as possible of a reply that ends with the reply_file
+ssize_t _conn_write_file(conn_t *conn, struct iovec *vecs, int nr) {
+    if (nr) {
+        size_t size = 0;
+        for (int i = 0; i < nr; i++) {
+            size += vecs[i].iov_len;
+        }
+
+        // The headers can wait to go out along with the start of the file
+        struct msghdr msg = {
+            .msg_iov = vecs,
+            .msg_iovlen = nr,
+        };
+        ssize_t sent = sendmsg(conn->fd, &msg, MSG_MORE);
+        conn_sent(conn, sent);
+        if (sent != (ssize_t)size) {
+            return sent;
+        }
+    }
+    return _conn_sendfile(conn);
+}
+
+ssize_t conn_write(conn_t *conn) {
+    ssize_t sent;
+
+    conn->state = CONN_SENDING;
+
+#ifdef CONNSLOT_URING
+    if (conn->uring) {
+        // Queued to be sent along with everything else at the next wait
+        return _uring_write(conn);
+    }
+#endif
+
+    struct iovec vecs[CONN_IOVECS];
+    int nr = conn_iovec(conn, vecs);
+
+    if (conn->reply_file != -1) {
+        return _conn_write_file(conn, vecs, nr);
+    }
+
+    sent = writev(conn->fd, &vecs[0], nr);
+
+    conn_sent(conn, sent);
     return sent;
 }
 
+// Only read while working on a request, so pipelined ones wait their turn
+int conn_isreader(conn_t *conn) {
+    switch (conn->state) {
+        case CONN_READING:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
 int conn_iswriter(conn_t *conn) {
     switch (conn->state) {
         case CONN_SENDING:
@@ -201,6 +647,7 @@ int conn_iswriter(conn_t *conn) {
 
 void conn_close(conn_t *conn) {
     close(conn->fd);
+    _conn_release(conn);
     conn_zero(conn);
 }
 
@@ -209,36 +656,124 @@ void slots_free(slots_t *slots) {
         conn_t *conn = &slots->conn[i];
         free(conn->request);
         conn->request = NULL;
+        free(conn->http);
+        conn->http = NULL;
         free(conn->reply_header);
         conn->reply_header = NULL;
         // TODO: the application usually owns conn->reply, should we free?
         free(conn->reply);
         conn->reply = NULL;
     }
+    if (slots->epfd != -1) {
+        close(slots->epfd);
+    }
+#ifdef CONNSLOT_URING
+    _uring_free(slots->uring);
+#endif
+    free(slots->open);
+    free(slots->open_pos);
+    free(slots->conn);
     free(slots);
 }
 
+/*
+ * Initialise the new conn from nr_slots up to nr, updating nr_slots as we
+ * go so that only working conn are ever counted
+ */
+int _slots_init(slots_t *slots, int nr) {
+    for (int i=slots->nr_slots; i < nr; i++) {
+        if (conn_init(&slots->conn[i]) != 0) {
+            return -1;
+        }
+        // The new slot numbers are all free
+        slots->open[i] = i;
+        slots->open_pos[i] = i;
+        slots->nr_slots = i + 1;
+    }
+    return 0;
+}
+
+// Make room for more connections, up to max_slots
+int _slots_grow(slots_t *slots) {
+    int nr = slots->nr_slots * 2;
+    if (nr > slots->max_slots) {
+        nr = slots->max_slots;
+    }
+    if (nr <= slots->nr_slots) {
+        return -1;
+    }
+
+    conn_t *conn = realloc(slots->conn, nr * sizeof(conn_t));
+    if (!conn) {
+        return -1;
+    }
+    slots->conn = conn;
+
+    int *open = realloc(slots->open, nr * sizeof(int));
+    if (!open) {
+        return -1;
+    }
+    slots->open = open;
+
+    int *open_pos = realloc(slots->open_pos, nr * sizeof(int));
+    if (!open_pos) {
+        return -1;
+    }
+    slots->open_pos = open_pos;
+
+#ifdef CONNSLOT_URING
+    if (slots->uring && _uring_grow(slots, nr) != 0) {
+        return -1;
+    }
+#endif
+    return _slots_init(slots, nr);
+}
+
 slots_t *slots_malloc(int nr_slots) {
-    size_t bytes = sizeof(slots_t) + nr_slots * sizeof(conn_t);
-    slots_t *slots = malloc(bytes);
+    slots_t *slots = calloc(1, sizeof(slots_t));
     if (!slots) {
         return NULL;
     }
 
-    slots->nr_slots = nr_slots;
-
     // Set any defaults
+    slots->max_slots = nr_slots;
     slots->timeout = 60;
     slots->nr_open = 0;
+    slots->reaped = 0;
+    slots->listening = 1;
+    slots->epfd = -1;
+    slots->uring = NULL;
 
     for (int i=0; i < SLOTS_LISTEN; i++) {
         slots->listen[i] = -1;
     }
+    for (int i=0; i < SLOTS_WATCH; i++) {
+        slots->watch[i].fd = -1;
+        slots->watch[i].ready = NULL;
+    }
 
     int r = 0;
-    for (int i=0; i < nr_slots; i++) {
-        r += conn_init(&slots->conn[i]);
+    slots->conn = malloc(nr_slots * sizeof(conn_t));
+    slots->open = malloc(nr_slots * sizeof(int));
+    slots->open_pos = malloc(nr_slots * sizeof(int));
+    if (!slots->conn || !slots->open || !slots->open_pos) {
+        slots_free(slots);
+        return NULL;
+    }
+
+#ifdef CONNSLOT_URING
+    // Without a usable io_uring, this falls back to epoll
+    slots->uring = _uring_malloc(slots, nr_slots);
+#endif
+#ifndef CONNSLOT_SELECT
+    if (!slots->uring) {
+        slots->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (slots->epfd == -1) {
+            r = -1;
+        }
     }
+#endif
+    r += _slots_init(slots, nr_slots);
 
     if (r!=0) {
         slots_free(slots);
@@ -247,6 +782,28 @@ slots_t *slots_malloc(int nr_slots) {
     return slots;
 }
 
+#ifndef CONNSLOT_SELECT
+/*
+ * Each fd in the epoll set is tagged with what it is and its index, so the
+ * events can be dispatched straight to the right slot without a search
+ */
+#define SLOTS_EV_CONN 0
+#define SLOTS_EV_LISTEN 1
+#define SLOTS_EV_WATCH 2
+
+int _slots_epoll(slots_t *slots, int op, int fd, int type, int nr, uint32_t events) {
+    if (slots->epfd == -1) {
+        // Using io_uring instead
+        return 0;
+    }
+    struct epoll_event ev = {
+        .events = events,
+        .data.u64 = (uint64_t)type << 32 | (uint32_t)nr,
+    };
+    return epoll_ctl(slots->epfd, op, fd, &ev);
+}
+#endif
+
 int _slots_listen_find_empty(slots_t *slots) {
     int listen_nr;
     for (listen_nr=0; listen_nr < SLOTS_LISTEN; listen_nr++) {
@@ -261,6 +818,17 @@ int _slots_listen_find_empty(slots_t *slots) {
     return listen_nr;
 }
 
+int _slots_listen_add(slots_t *slots, int listen_nr, int server) {
+    slots->listen[listen_nr] = server;
+#ifndef CONNSLOT_SELECT
+    uint32_t events = slots->listening ? EPOLLIN : 0;
+    if (_slots_epoll(slots, EPOLL_CTL_ADD, server, SLOTS_EV_LISTEN, listen_nr, events) == -1) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
 int slots_listen_tcp(slots_t *slots, int port) {
     int listen_nr = _slots_listen_find_empty(slots);
     if (listen_nr <0) {
@@ -276,23 +844,25 @@ int slots_listen_tcp(slots_t *slots, int port) {
         .sin6_addr = IN6ADDR_ANY_INIT,
     };
 
-    if ((server = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
+    if ((server = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
         return -1;
     }
     setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
-
-    if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    if (slots->reuseport &&
+            setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        close(server);
         return -1;
     }
+    setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
 
-    // backlog of 1 - low, but sheds load quickly when we run out of slots
-    if (listen(server, 1) < 0) {
+    // Once all the slots are used, we stop accepting and the backlog fills
+    if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(server, SOMAXCONN) < 0) {
+        close(server);
         return -1;
     }
 
-    slots->listen[listen_nr] = server;
-    return 0;
+    return _slots_listen_add(slots, listen_nr, server);
 }
 
 int slots_listen_unix(slots_t *slots, char *path) {
@@ -309,7 +879,7 @@ int slots_listen_unix(slots_t *slots, char *path) {
 
     int server;
 
-    if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    if ((server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
         return -1;
     }
 
@@ -324,25 +894,24 @@ int slots_listen_unix(slots_t *slots, char *path) {
         return -1;
     }
 
-    // backlog of 1 - low, but sheds load quickly when we run out of slots
-    if (listen(server, 1) < 0) {
+    // Once all the slots are used, we stop accepting and the backlog fills
+    if (listen(server, SOMAXCONN) < 0) {
         return -1;
     }
 
-    slots->listen[listen_nr] = server;
-    return 0;
+    return _slots_listen_add(slots, listen_nr, server);
 }
 
 int slots_fdset(slots_t *slots, fd_set *readers, fd_set *writers) {
     int i;
     int fdmax = 0;
 
-    for (i=0; i<slots->nr_slots; i++) {
-        if (slots->conn[i].fd == -1) {
-            continue;
-        }
+    for (int n=0; n<slots->nr_open; n++) {
+        i = slots->open[n];
         int fd = slots->conn[i].fd;
-        FD_SET(fd, readers);
+        if (conn_isreader(&slots->conn[i])) {
+            FD_SET(fd, readers);
+        }
         if (conn_iswriter(&slots->conn[i])) {
             FD_SET(fd, writers);
         }
@@ -350,7 +919,7 @@ int slots_fdset(slots_t *slots, fd_set *readers, fd_set *writers) {
     }
 
     // If we have room for more connections, we listen on the server socket(s)
-    if (slots->listen[0] && slots->nr_open < slots->nr_slots) {
+    if (slots->nr_open < slots->max_slots) {
         for (i=0; i<SLOTS_LISTEN; i++) {
             if (slots->listen[i] == -1) {
                 continue;
@@ -364,57 +933,115 @@ int slots_fdset(slots_t *slots, fd_set *readers, fd_set *writers) {
     return fdmax;
 }
 
-int slots_accept(slots_t *slots, int listen_nr) {
-    int i;
+// Put a new connection into a free slot, growing the pool if needed
+int _slots_open(slots_t *slots, int fd) {
+    if (slots->nr_open == slots->nr_slots && _slots_grow(slots) != 0) {
+        return -1;
+    }
 
-    // TODO: remember previous checked slot and dont start at zero
-    for (i=0; i<slots->nr_slots; i++) {
-        if (slots->conn[i].fd == -1) {
-            break;
-        }
-    }
+    // The most recently closed slot is reused first
+    int i = slots->open[slots->nr_open];
+    slots->nr_open++;
+
+    slots->conn[i].activity = time(NULL);
+    slots->conn[i].fd = fd;
+    slots->conn[i].state = CONN_READING;
+    return i;
+}
+
+// Return a slot to the free part of open[]
+void _slots_release(slots_t *slots, int i) {
+    int pos = slots->open_pos[i];
+    int last = slots->nr_open - 1;
+    int j = slots->open[last];
+
+    slots->open[pos] = j;
+    slots->open_pos[j] = pos;
+    slots->open[last] = i;
+    slots->open_pos[i] = last;
+    slots->nr_open--;
+}
 
-    if (i == slots->nr_slots) {
+int slots_accept(slots_t *slots, int listen_nr) {
+    if (slots->nr_open == slots->max_slots) {
         // No room, inform the caller
         return -2;
     }
 
-    int client = accept(slots->listen[listen_nr], NULL, 0);
+    // Dont let any children that we spawn inherit the connection
+    int client = accept4(
+            slots->listen[listen_nr],
+            NULL,
+            0,
+            SOCK_NONBLOCK | SOCK_CLOEXEC
+    );
     if (client == -1) {
         return -1;
     }
 
-    fcntl(client, F_SETFL, O_NONBLOCK);
+    int i = _slots_open(slots, client);
+    if (i == -1) {
+        close(client);
+        return -2;
+    }
 
-    slots->nr_open++;
-    slots->conn[i].activity = time(NULL);
-    slots->conn[i].fd = client;
+#ifndef CONNSLOT_SELECT
+    if (_slots_epoll(slots, EPOLL_CTL_ADD, client, SLOTS_EV_CONN, i, EPOLLIN) == -1) {
+        conn_close(&slots->conn[i]);
+        _slots_release(slots, i);
+        return -1;
+    }
+    slots->conn[i].events = EPOLLIN;
+#endif
     return i;
 }
 
+void _slots_close(slots_t *slots, int i) {
+#ifdef CONNSLOT_URING
+    if (slots->uring) {
+        _uring_close(slots, i);
+    }
+#endif
+#ifndef CONNSLOT_SELECT
+    // The fd is only removed from the epoll set by close() once nothing
+    // else has it open, so remove it explicitly
+    _slots_epoll(slots, EPOLL_CTL_DEL, slots->conn[i].fd, SLOTS_EV_CONN, i, 0);
+#endif
+    conn_close(&slots->conn[i]);
+    _slots_release(slots, i);
+}
+
 int slots_closeidle(slots_t *slots) {
     int i;
     int nr_closed = 0;
     int min_activity = time(NULL) - slots->timeout;
 
-    for (i=0; i<slots->nr_slots; i++) {
-        if (slots->conn[i].fd == -1) {
-            continue;
-        }
+    // Backwards, as closing a slot moves the last open one into its place
+    for (int n=slots->nr_open - 1; n >= 0; n--) {
+        i = slots->open[n];
         if (slots->conn[i].activity < min_activity) {
-            conn_close(&slots->conn[i]);
+            _slots_close(slots, i);
             nr_closed++;
         }
     }
-    slots->nr_open -= nr_closed;
-    if (slots->nr_open < 0) {
-        slots->nr_open = 0;
-        // should not happen
-    }
 
     return nr_closed;
 }
 
+/*
+ * Close the idle connections, including the ones being kept open between
+ * requests.  This is done at most once a second, so that a busy service
+ * does not need to scan all the slots on every wakeup
+ */
+void _slots_reap(slots_t *slots) {
+    time_t now = time(NULL);
+    if (now == slots->reaped) {
+        return;
+    }
+    slots->reaped = now;
+    slots_closeidle(slots);
+}
+
 int slots_fdset_loop(slots_t *slots, fd_set *readers, fd_set *writers) {
     for (int i=0; i<SLOTS_LISTEN; i++) {
         if (FD_ISSET(slots->listen[i], readers)) {
@@ -436,10 +1063,9 @@ int slots_fdset_loop(slots_t *slots, fd_set *readers, fd_set *writers) {
 
     int nr_ready = 0;
 
-    for (int i=0; i<slots->nr_slots; i++) {
-        if (slots->conn[i].fd == -1) {
-            continue;
-        }
+    // Backwards, as closing a slot moves the last open one into its place
+    for (int n=slots->nr_open - 1; n >= 0; n--) {
+        int i = slots->open[n];
 
         if (FD_ISSET(slots->conn[i].fd, readers)) {
             conn_read(&slots->conn[i]);
@@ -458,8 +1084,7 @@ int slots_fdset_loop(slots_t *slots, fd_set *readers, fd_set *writers) {
         // We cannot have got here if it started as an empty slot, so
         // it must have transitioned to empty - close the slot
         if (slots->conn[i].state == CONN_EMPTY) {
-            slots->nr_open--;
-            conn_close(&slots->conn[i]);
+            _slots_close(slots, i);
             continue;
         }
 
@@ -470,3 +1095,755 @@ int slots_fdset_loop(slots_t *slots, fd_set *readers, fd_set *writers) {
 
     return nr_ready;
 }
+
+const char *slots_backend(slots_t *slots) {
+#ifdef CONNSLOT_URING
+    if (slots->uring) {
+        return "io_uring";
+    }
+#else
+    (void)slots;
+#endif
+#ifndef CONNSLOT_SELECT
+    return "epoll";
+#else
+    return "select";
+#endif
+}
+
+/*
+ * Wait for an application fd to be readable along with the connections.
+ * The fd must be unwatched before it is closed.
+ */
+int slots_watch(slots_t *slots, int fd, int *ready) {
+    int i;
+    for (i=0; i<SLOTS_WATCH; i++) {
+        if (slots->watch[i].fd == -1) {
+            break;
+        }
+    }
+    if (i == SLOTS_WATCH) {
+        return -2;
+    }
+
+#ifndef CONNSLOT_SELECT
+    if (_slots_epoll(slots, EPOLL_CTL_ADD, fd, SLOTS_EV_WATCH, i, EPOLLIN) == -1) {
+        return -1;
+    }
+#endif
+    slots->watch[i].fd = fd;
+    slots->watch[i].ready = ready;
+    *ready = 0;
+#ifdef CONNSLOT_URING
+    if (slots->uring) {
+        return _uring_watch(slots, i);
+    }
+#endif
+    return 0;
+}
+
+void slots_unwatch(slots_t *slots, int fd) {
+    for (int i=0; i<SLOTS_WATCH; i++) {
+        if (slots->watch[i].fd != fd) {
+            continue;
+        }
+#ifdef CONNSLOT_URING
+        if (slots->uring) {
+            _uring_unwatch(slots, i);
+        }
+#endif
+#ifndef CONNSLOT_SELECT
+        _slots_epoll(slots, EPOLL_CTL_DEL, fd, SLOTS_EV_WATCH, i, 0);
+#endif
+        slots->watch[i].fd = -1;
+        slots->watch[i].ready = NULL;
+    }
+}
+
+// Keep the events registered for the slot in step with its state
+void _slots_update(slots_t *slots, int i) {
+#ifndef CONNSLOT_SELECT
+    conn_t *conn = &slots->conn[i];
+    if (conn->fd == -1 || slots->epfd == -1) {
+        return;
+    }
+    uint32_t events = 0;
+    if (conn_isreader(conn)) {
+        events |= EPOLLIN;
+    }
+    if (conn_iswriter(conn)) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) {
+        return;
+    }
+    _slots_epoll(slots, EPOLL_CTL_MOD, conn->fd, SLOTS_EV_CONN, i, events);
+    conn->events = events;
+#else
+    (void)slots;
+    (void)i;
+#endif
+}
+
+/*
+ * Answer the requests that are ready, in order.  Sending a reply can make
+ * the next pipelined request ready straight away.  Once the connection has
+ * nothing more to do, the slot is closed
+ */
+void _slots_serve(slots_t *slots, int i, slots_cb_t cb, void *arg) {
+    conn_t *conn = &slots->conn[i];
+
+    while (conn->state == CONN_READY) {
+        cb(conn, arg);
+    }
+
+    // We cannot have got here if it started as an empty slot, so
+    // it must have transitioned to empty - close the slot
+    if (conn->state == CONN_EMPTY) {
+        _slots_close(slots, i);
+        return;
+    }
+
+    _slots_update(slots, i);
+}
+
+// Handle the events for one slot
+void _slots_dispatch(slots_t *slots, int i, int readable, int writable, slots_cb_t cb, void *arg) {
+    conn_t *conn = &slots->conn[i];
+
+    if (readable) {
+        conn_read(conn);
+    }
+    if (writable && conn_iswriter(conn)) {
+        conn_write(conn);
+    }
+
+    _slots_serve(slots, i, cb, arg);
+}
+
+#ifdef CONNSLOT_URING
+/*
+ * The io_uring engine.  Each listen socket has a multishot accept, and each
+ * connection has a multishot receive into the provided buffers, so there
+ * is no system call per event.  Writes are queued by conn_write() and are
+ * submitted together with everything else when waiting for completions.
+ */
+#define URING_ENTRIES 256
+#define URING_BUFS 256
+#define URING_BUF_SIZE 2048
+
+// What a completion is for, kept in the top byte of the user_data
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_WRITE 3
+#define URING_WATCH 4
+#define URING_CANCEL 5
+#define URING_POLLOUT 6
+
+/*
+ * The arrays for each slot are kept in the same allocation, after the
+ * struct, so that growing them only moves the one pointer in slots_t
+ */
+struct slots_uring {
+    uring_t *ring;
+    conn_t *conn;           // the slots, to find the slot number of a conn
+    uint32_t seq;           // the next tag
+    uint32_t *tag;          // tag of each slot, to ignore stale completions
+    struct iovec *iov;      // CONN_IOVECS for each slot, for the queued writes
+    uint32_t watch_tag[SLOTS_WATCH];
+    uint32_t accept_tag;    // zero when the accepts are not armed
+    int multishot;          // cleared if the kernel cannot do multishot
+};
+
+size_t _uring_size(int nr_slots) {
+    return sizeof(struct slots_uring) +
+        nr_slots * CONN_IOVECS * sizeof(struct iovec) +
+        nr_slots * sizeof(uint32_t);
+}
+
+// Point at the arrays, which need to be found again after a realloc
+void _uring_arrays(struct slots_uring *su, int nr_slots) {
+    su->iov = (struct iovec *)&su[1];
+    su->tag = (uint32_t *)&su->iov[nr_slots * CONN_IOVECS];
+}
+
+uint64_t _uring_data(int type, int i, uint32_t tag) {
+    return (uint64_t)type << 56 | (uint64_t)i << 32 | tag;
+}
+
+struct slots_uring *_uring_malloc(slots_t *slots, int nr_slots) {
+    struct slots_uring *su = calloc(1, _uring_size(nr_slots));
+    if (!su) {
+        return NULL;
+    }
+    su->ring = uring_malloc(URING_ENTRIES, URING_BUFS, URING_BUF_SIZE);
+    if (!su->ring) {
+        free(su);
+        return NULL;
+    }
+    _uring_arrays(su, nr_slots);
+    su->conn = slots->conn;
+    su->seq = 1;
+    su->multishot = 1;
+    return su;
+}
+
+/*
+ * The slots have moved, and there are more of them.  This moves the
+ * slots_uring too, so it must be found again from the slots_t afterwards
+ */
+int _uring_grow(slots_t *slots, int nr_slots) {
+    struct slots_uring *su = slots->uring;
+    su->conn = slots->conn;
+
+    // Submit the queued writes, so the kernel has its own copy of their
+    // vectors before they move
+    if (su->ring->to_submit && uring_enter(su->ring, 0) == -1) {
+        return -1;
+    }
+
+    su = realloc(su, _uring_size(nr_slots));
+    if (!su) {
+        return -1;
+    }
+    slots->uring = su;
+
+    // The tags move up, as they were after the old number of vectors
+    _uring_arrays(su, nr_slots);
+    uint32_t *tag = (uint32_t *)&su->iov[slots->nr_slots * CONN_IOVECS];
+    memmove(su->tag, tag, slots->nr_slots * sizeof(*tag));
+    for (int i=slots->nr_slots; i<nr_slots; i++) {
+        su->tag[i] = 0;
+    }
+
+    for (int i=0; i<slots->nr_slots; i++) {
+        if (slots->conn[i].uring) {
+            slots->conn[i].uring = su;
+        }
+    }
+    return 0;
+}
+
+void _uring_free(struct slots_uring *su) {
+    if (!su) {
+        return;
+    }
+    uring_free(su->ring);
+    free(su);
+}
+
+void _uring_cancel(struct slots_uring *su, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(su->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->user_data = _uring_data(URING_CANCEL, 0, 0);
+}
+
+void _uring_accept(slots_t *slots, int listen_nr) {
+    struct slots_uring *su = slots->uring;
+    struct io_uring_sqe *sqe = uring_sqe(su->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = slots->listen[listen_nr];
+    // Dont let any children that we spawn inherit the connection
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (su->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = _uring_data(URING_ACCEPT, listen_nr, su->accept_tag);
+}
+
+// Only take new connections while there are free slots to put them in
+void _uring_listen_update(slots_t *slots) {
+    struct slots_uring *su = slots->uring;
+    int listening = slots->nr_open < slots->max_slots;
+
+    if (listening == (su->accept_tag != 0)) {
+        return;
+    }
+    uint32_t old_tag = su->accept_tag;
+    su->accept_tag = listening ? su->seq++ : 0;
+    for (int i=0; i<SLOTS_LISTEN; i++) {
+        if (slots->listen[i] == -1) {
+            continue;
+        }
+        if (listening) {
+            _uring_accept(slots, i);
+        } else {
+            _uring_cancel(su, _uring_data(URING_ACCEPT, i, old_tag));
+        }
+    }
+}
+
+void _uring_recv(slots_t *slots, int i) {
+    struct slots_uring *su = slots->uring;
+    struct io_uring_sqe *sqe = uring_sqe(su->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = slots->conn[i].fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    if (su->multishot) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    sqe->user_data = _uring_data(URING_RECV, i, su->tag[i]);
+}
+
+ssize_t _uring_write(conn_t *conn) {
+    struct slots_uring *su = conn->uring;
+    int i = conn - su->conn;
+    struct iovec *vecs = &su->iov[i * CONN_IOVECS];
+    int nr = conn_iovec(conn, vecs);
+    ssize_t sent = 0;
+
+    if (!nr && conn->reply_file == -1) {
+        // Nothing to send
+        conn_sent(conn, 0);
+        return 0;
+    }
+    if (!nr) {
+        // There is no sendfile for io_uring, so the file is sent directly
+        // and then again each time that the socket has room
+        sent = _conn_sendfile(conn);
+        if (!conn_iswriter(conn)) {
+            return sent;
+        }
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(su->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->fd = conn->fd;
+    if (!nr) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = _uring_data(URING_POLLOUT, i, su->tag[i]);
+        return sent;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->addr = (uintptr_t)vecs;
+    sqe->len = nr;
+    sqe->user_data = _uring_data(URING_WRITE, i, su->tag[i]);
+    return 0;
+}
+
+void _uring_close(slots_t *slots, int i) {
+    struct slots_uring *su = slots->uring;
+    _uring_cancel(su, _uring_data(URING_RECV, i, su->tag[i]));
+    _uring_cancel(su, _uring_data(URING_WRITE, i, su->tag[i]));
+    _uring_cancel(su, _uring_data(URING_POLLOUT, i, su->tag[i]));
+    su->tag[i] = 0;
+}
+
+int _uring_watch(slots_t *slots, int i) {
+    struct slots_uring *su = slots->uring;
+    struct io_uring_sqe *sqe = uring_sqe(su->ring);
+    if (!sqe) {
+        return -1;
+    }
+    if (!su->watch_tag[i]) {
+        su->watch_tag[i] = su->seq++;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = slots->watch[i].fd;
+    sqe->poll32_events = POLLIN;
+    if (su->multishot) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+    sqe->user_data = _uring_data(URING_WATCH, i, su->watch_tag[i]);
+    return 0;
+}
+
+void _uring_unwatch(slots_t *slots, int i) {
+    struct slots_uring *su = slots->uring;
+    struct io_uring_sqe *sqe = uring_sqe(su->ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = _uring_data(URING_WATCH, i, su->watch_tag[i]);
+        sqe->user_data = _uring_data(URING_CANCEL, 0, 0);
+    }
+    su->watch_tag[i] = 0;
+}
+
+// A new connection from a multishot accept
+void _uring_add(slots_t *slots, int client) {
+    int i = _slots_open(slots, client);
+    if (i == -1) {
+        // Arrived before the accepts were cancelled, so shed it
+        close(client);
+        return;
+    }
+
+    // Only found now, as opening the slot can move it
+    struct slots_uring *su = slots->uring;
+    conn_t *conn = &slots->conn[i];
+    conn->uring = su;
+    su->tag[i] = su->seq++;
+    _uring_recv(slots, i);
+}
+
+// The request bytes from a multishot receive
+void _uring_received(slots_t *slots, int i, char *buf, int len, slots_cb_t cb, void *arg) {
+    conn_t *conn = &slots->conn[i];
+
+    if (len == 0) {
+        // The remote has closed the connection
+        _slots_close(slots, i);
+        return;
+    }
+
+    // Keep what fits, as conn_read() does, so that a request too large
+    // for the buffer gets the same reply from conn_received()
+    strbuf_t *p = conn->request;
+    size_t room = p->capacity_max - p->wr_pos;
+    if ((size_t)len > room) {
+        len = room;
+    }
+    if (!len && conn_iswriter(conn) && !conn->keepalive) {
+        // The rest of a rejected request, which epoll would not even read
+        return;
+    }
+    if (!len || _conn_reserve(conn, len) != 0) {
+        // Too large for the request buffer
+        _slots_close(slots, i);
+        return;
+    }
+    sb_append(conn->request, buf, len);
+    conn_received(conn);
+    _slots_serve(slots, i, cb, arg);
+}
+
+/*
+ * Handle one completion.
+ * Returns -1 on an accept error or -2 if there were no free slots
+ */
+int _uring_complete(slots_t *slots, struct io_uring_cqe *cqe, slots_cb_t cb, void *arg) {
+    struct slots_uring *su = slots->uring;
+    int type = cqe->user_data >> 56;
+    int i = (cqe->user_data >> 32) & 0xffffff;
+    uint32_t tag = cqe->user_data;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int res = cqe->res;
+
+    if (res == -EINVAL && su->multishot &&
+            (type == URING_ACCEPT || type == URING_RECV || type == URING_WATCH)) {
+        // An older kernel, so carry on with single shot submissions
+        su->multishot = 0;
+        res = -ENOBUFS;
+    }
+
+    switch (type) {
+        case URING_ACCEPT:
+            if (tag != su->accept_tag) {
+                // Cancelled
+                if (res >= 0) {
+                    close(res);
+                }
+                return 0;
+            }
+            if (!more) {
+                _uring_accept(slots, i);
+            }
+            if (res == -ENOBUFS) {
+                return 0;
+            }
+            if (res < 0) {
+                errno = -res;
+                return -1;
+            }
+            _uring_add(slots, res);
+            return 0;
+
+        case URING_RECV: {
+            char *buf = NULL;
+            int bid = -1;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                buf = uring_buf(su->ring, bid);
+            }
+
+            if (tag == su->tag[i] && tag) {
+                if (res >= 0 && (res == 0 || buf)) {
+                    _uring_received(slots, i, buf, res, cb, arg);
+                } else if (res != -ENOBUFS) {
+                    _slots_close(slots, i);
+                }
+                if (!more && su->tag[i] == tag) {
+                    _uring_recv(slots, i);
+                }
+            }
+
+            if (bid != -1) {
+                uring_buf_recycle(su->ring, bid);
+            }
+            return 0;
+        }
+
+        case URING_WRITE:
+            if (tag != su->tag[i] || !tag) {
+                return 0;
+            }
+            if (res < 0) {
+                _slots_close(slots, i);
+                return 0;
+            }
+            conn_sent(&slots->conn[i], res);
+            if (conn_iswriter(&slots->conn[i])) {
+                // A short write, so send the rest
+                _uring_write(&slots->conn[i]);
+            }
+            _slots_serve(slots, i, cb, arg);
+            return 0;
+
+        case URING_POLLOUT:
+            if (tag != su->tag[i] || !tag) {
+                return 0;
+            }
+            if (res < 0) {
+                _slots_close(slots, i);
+                return 0;
+            }
+            _uring_write(&slots->conn[i]);
+            _slots_serve(slots, i, cb, arg);
+            return 0;
+
+        case URING_WATCH:
+            if (tag != su->watch_tag[i] || !tag) {
+                return 0;
+            }
+            if (res >= 0) {
+                *slots->watch[i].ready = 1;
+            }
+            if (!more) {
+                _uring_watch(slots, i);
+            }
+            return 0;
+    }
+
+    return 0;
+}
+
+int _uring_wait(slots_t *slots, int timeout_ms, slots_cb_t cb, void *arg) {
+    // The slots_uring can move while the completions are handled, but the
+    // ring stays where it is
+    uring_t *ring = slots->uring->ring;
+
+    _uring_listen_update(slots);
+
+    if (uring_enter(ring, timeout_ms) == -1) {
+        if (errno == ETIME || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+
+    int nr = 0;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(ring))) {
+        struct io_uring_cqe copy = *cqe;
+        uring_cqe_seen(ring);
+        nr++;
+
+        int r = _uring_complete(slots, &copy, cb, arg);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    // Send all the replies from this wakeup together, without waiting for
+    // the next one
+    if (ring->to_submit && uring_enter(ring, 0) == -1) {
+        return -1;
+    }
+    return nr;
+}
+#endif
+
+#ifndef CONNSLOT_SELECT
+#define SLOTS_EVENTS 64
+
+// Only take new connections while there are free slots to put them in
+void _slots_listen_update(slots_t *slots) {
+    int listening = slots->nr_open < slots->max_slots;
+    if (listening == slots->listening) {
+        return;
+    }
+    for (int i=0; i<SLOTS_LISTEN; i++) {
+        if (slots->listen[i] == -1) {
+            continue;
+        }
+        _slots_epoll(
+            slots,
+            EPOLL_CTL_MOD,
+            slots->listen[i],
+            SLOTS_EV_LISTEN,
+            i,
+            listening ? EPOLLIN : 0
+        );
+    }
+    slots->listening = listening;
+}
+
+/*
+ * Wait up to timeout_ms for events and handle them.  Only the slots with
+ * events are looked at, so the cost does not grow with the number of idle
+ * connections.
+ *
+ * Returns the number of events, 0 on timeout, -1 on a wait or accept error
+ * or -2 if there were no free slots
+ */
+int slots_wait(slots_t *slots, int timeout_ms, slots_cb_t cb, void *arg) {
+    struct epoll_event events[SLOTS_EVENTS];
+
+    _slots_reap(slots);
+
+#ifdef CONNSLOT_URING
+    if (slots->uring) {
+        return _uring_wait(slots, timeout_ms, cb, arg);
+    }
+#endif
+
+    _slots_listen_update(slots);
+
+    int nr = epoll_wait(slots->epfd, events, SLOTS_EVENTS, timeout_ms);
+    if (nr == -1) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (int n=0; n<nr; n++) {
+        int type = events[n].data.u64 >> 32;
+        int i = (uint32_t)events[n].data.u64;
+
+        switch (type) {
+            case SLOTS_EV_LISTEN:
+                // A new connection, which will be read once data arrives
+                i = slots_accept(slots, i);
+                if (i < 0) {
+                    return i;
+                }
+                continue;
+
+            case SLOTS_EV_WATCH:
+                if (slots->watch[i].ready) {
+                    *slots->watch[i].ready = 1;
+                }
+                continue;
+        }
+
+        if (slots->conn[i].fd == -1) {
+            // Closed by an earlier event in this batch
+            continue;
+        }
+
+        _slots_dispatch(
+            slots,
+            i,
+            events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR),
+            events[n].events & EPOLLOUT,
+            cb,
+            arg
+        );
+    }
+
+    return nr;
+}
+#else
+/*
+ * Wait up to timeout_ms for events and handle them.  This is the portable
+ * version, which needs to scan every slot on every wakeup.
+ *
+ * Returns the number of events, 0 on timeout, -1 on a wait or accept error
+ * or -2 if there were no free slots
+ */
+int slots_wait(slots_t *slots, int timeout_ms, slots_cb_t cb, void *arg) {
+    fd_set readers;
+    fd_set writers;
+
+    _slots_reap(slots);
+
+    FD_ZERO(&readers);
+    FD_ZERO(&writers);
+    int fdmax = slots_fdset(slots, &readers, &writers);
+
+    for (int i=0; i<SLOTS_WATCH; i++) {
+        int fd = slots->watch[i].fd;
+        if (fd == -1) {
+            continue;
+        }
+        FD_SET(fd, &readers);
+        fdmax = (fd > fdmax)? fd : fdmax;
+    }
+
+    struct timeval tv;
+    struct timeval *tvp = NULL;
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = timeout_ms % 1000 * 1000;
+        tvp = &tv;
+    }
+
+    int nr = select(fdmax+1, &readers, &writers, NULL, tvp);
+    if (nr == -1) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    if (nr == 0) {
+        return 0;
+    }
+
+    for (int i=0; i<SLOTS_WATCH; i++) {
+        int fd = slots->watch[i].fd;
+        if (fd != -1 && FD_ISSET(fd, &readers)) {
+            *slots->watch[i].ready = 1;
+        }
+    }
+
+    for (int i=0; i<SLOTS_LISTEN; i++) {
+        if (slots->listen[i] == -1 || !FD_ISSET(slots->listen[i], &readers)) {
+            continue;
+        }
+        // A new connection
+        int slotnr = slots_accept(slots, i);
+        if (slotnr < 0) {
+            return slotnr;
+        }
+        // Schedule slot for immediately reading
+        FD_SET(slots->conn[slotnr].fd, &readers);
+    }
+
+    // Backwards, as closing a slot moves the last open one into its place
+    for (int n=slots->nr_open - 1; n >= 0; n--) {
+        int i = slots->open[n];
+        int fd = slots->conn[i].fd;
+        _slots_dispatch(
+            slots,
+            i,
+            FD_ISSET(fd, &readers),
+            FD_ISSET(fd, &writers),
+            cb,
+            arg
+        );
+    }
+
+    return nr;
+}
+#endif
+
+// Call back for each connection in the given state
+void slots_foreach(slots_t *slots, enum conn_state state, slots_cb_t cb, void *arg) {
+    for (int n=slots->nr_open - 1; n >= 0; n--) {
+        int i = slots->open[n];
+        if (slots->conn[i].state != state) {
+            continue;
+        }
+        cb(&slots->conn[i], arg);
+        _slots_serve(slots, i, cb, arg);
+    }
+}
@@ -8,38 +8,119 @@
 #ifndef CONNSLOT_H
 #define CONNSLOT_H
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include "strbuf.h"
 
 enum __attribute__((__packed__)) conn_state {
     CONN_EMPTY,
     CONN_READING,
     CONN_READY,
+    CONN_WAITING,   // The application is not ready to reply yet
     CONN_SENDING,
 };
 
+struct slots_uring;
+
+// Part of the request, kept as an offset as the request buffer can move
+typedef struct conn_slice {
+    unsigned int pos;
+    unsigned int len;
+} conn_slice_t;
+
+typedef struct conn_header {
+    conn_slice_t name;
+    conn_slice_t value;
+} conn_header_t;
+
+#define CONN_HEADERS 16     // more header fields than this are rejected
+#define CONN_IOVECS 16      // the most vectors given to one write
+
+// The request as parsed so far, which resumes as more bytes arrive
+typedef struct conn_http {
+    unsigned int scan_pos;  // how far we have looked for the end of line
+    unsigned int line_pos;  // the start of the line being parsed
+    unsigned int body_pos;  // zero until the end of the header is found
+    unsigned int content_length;
+    conn_slice_t method;
+    conn_slice_t path;
+    conn_slice_t version;
+    conn_slice_t body;
+    int nr_headers;
+    conn_header_t header[CONN_HEADERS];
+} conn_http_t;
+
 typedef struct conn {
-    strbuf_t *request;      // Request from remote
-    strbuf_t *reply_header; // not shared reply data
-    strbuf_t *reply;        // shared reply data (const struct)
-    time_t activity;        // timestamp of last txn
+    // Looked at for every event on the connection
     int fd;
-    unsigned int reply_sendpos;
     enum conn_state state;
+    uint8_t keepalive;      // leave open for another request after the reply
+    uint32_t events;        // events registered with the poller
+    unsigned int reply_sendpos;
+    unsigned int request_len;   // length of the request being answered
+    time_t activity;        // timestamp of last txn
+    // Only used when there is data to move
+    strbuf_t *request;      // Request from remote
+    conn_http_t *http;      // the parsed request
+    strbuf_t *shared_header;    // shared reply header (const struct)
+    strbuf_t *reply_header; // not shared reply data, sent after the above
+    strbuf_t *reply;        // shared reply data (const struct)
+    const struct iovec *reply_vecs; // more shared reply data, sent after
+    unsigned int reply_nr_vecs;
+    int reply_file;         // or the reply data is in this file, owned here
+    unsigned int reply_file_len;
+    void (*reply_release)(void *);  // called once the reply is finished with
+    void *reply_owner;      // the argument for reply_release
+    void *reply_more;       // the application's place in a reply in parts
+    struct slots_uring *uring;  // queue writes here, if set
 } conn_t;
 
+// Other file descriptors that the application wants to wait on
+typedef struct slots_watch {
+    int fd;
+    int *ready;             // set true when the fd is readable
+} slots_watch_t;
+
+/*
+ * Called for each connection that has a complete request.  It must either
+ * start the reply with conn_write() or park the request as CONN_WAITING.
+ *
+ * If reply_more is set, the connection is CONN_READY again once the parts
+ * given so far have been sent, and this is called for the next part
+ */
+typedef void (*slots_cb_t)(conn_t *, void *);
+
 #define SLOTS_LISTEN 2
+#define SLOTS_WATCH 2
 typedef struct slots {
-    int nr_slots;
+    int nr_slots;           // The number of conn allocated
+    int max_slots;          // Grow on demand up to this many
     int nr_open;
     int listen[SLOTS_LISTEN];
-    int timeout;
-    conn_t conn[];
+    int listening;          // are the listen sockets enabled in the poller
+    int timeout;            // seconds before an idle connection is closed
+    int reuseport;          // share the TCP port with other listeners
+    time_t reaped;          // when the idle connections were last closed
+    int epfd;               // -1 when built with CONNSLOT_SELECT
+    struct slots_uring *uring;  // set when io_uring is in use
+    slots_watch_t watch[SLOTS_WATCH];
+    int *open;              // slot numbers, the first nr_open are in use
+    int *open_pos;          // where each slot number is in open[]
+    conn_t *conn;           // can move when the pool grows
 } slots_t;
 
 void conn_zero(conn_t *);
 int conn_init(conn_t *);
 void conn_read(conn_t *);
+void conn_received(conn_t *);
+char *conn_slice_ptr(conn_t *, conn_slice_t);
+int conn_slice_is(conn_t *, conn_slice_t, const char *);
+conn_slice_t *conn_header(conn_t *, const char *);
+int conn_header_q(conn_t *, const char *, const char *);
+int conn_iovec(conn_t *, struct iovec *);
+void conn_sent(conn_t *, ssize_t);
 ssize_t conn_write(conn_t *);
+int conn_isreader(conn_t *);
 int conn_iswriter(conn_t *);
 void conn_close(conn_t *);
 
@@ -51,4 +132,9 @@ int slots_fdset(slots_t *, fd_set *, fd_set *);
 int slots_accept(slots_t *, int);
 int slots_closeidle(slots_t *);
 int slots_fdset_loop(slots_t *, fd_set *, fd_set *);
+const char *slots_backend(slots_t *);
+int slots_watch(slots_t *, int, int *);
+void slots_unwatch(slots_t *, int);
+int slots_wait(slots_t *, int, slots_cb_t, void *);
+void slots_foreach(slots_t *, enum conn_state, slots_cb_t, void *);
 #endif
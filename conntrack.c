@@ -0,0 +1,411 @@
+/** @file
+ * Aggregate the per-flow counters from the conntrack table.
+ *
+ * The conntrack table is dumped using nfnetlink and each flow is added into
+ * a fixed size aggregation table as it arrives, so the whole dump is never
+ * held in memory.  The flow counters are only present when the
+ * nf_conntrack_acct sysctl is enabled.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "accounting.h"
+#include "conntrack.h"
+#include "nfnl.h"
+
+/**
+ * Parse a key specification string.
+ * The string is a comma separated list of the fields "src", "dst", "proto",
+ * "sport" and "dport".  The address fields can have prefix lengths added,
+ * for example "src/24" or "src/24/56" - the IPv6 prefix defaults to 64 when
+ * only the IPv4 prefix is given.
+ * @param spec is filled in from the string
+ * @param s is the string, which will be modified
+ * @return zero or -1 for a bad specification
+ */
+int ct_keyspec_parse(ct_keyspec_t *spec, char *s) {
+    char *saveptr;
+    char *field;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->src_prefix4 = 32;
+    spec->src_prefix6 = 128;
+    spec->dst_prefix4 = 32;
+    spec->dst_prefix6 = 128;
+
+    while ((field = strtok_r(s, ",", &saveptr)) != NULL) {
+        s = NULL;
+
+        char *prefix4 = strchr(field, '/');
+        char *prefix6 = NULL;
+        if (prefix4) {
+            *prefix4++ = 0;
+            prefix6 = strchr(prefix4, '/');
+            if (prefix6) {
+                *prefix6++ = 0;
+            }
+        }
+
+        uint8_t *p4 = NULL;
+        uint8_t *p6 = NULL;
+
+        if (strcmp(field, "src") == 0) {
+            spec->fields |= CT_KEY_SRC;
+            p4 = &spec->src_prefix4;
+            p6 = &spec->src_prefix6;
+        } else if (strcmp(field, "dst") == 0) {
+            spec->fields |= CT_KEY_DST;
+            p4 = &spec->dst_prefix4;
+            p6 = &spec->dst_prefix6;
+        } else if (strcmp(field, "proto") == 0) {
+            spec->fields |= CT_KEY_PROTO;
+        } else if (strcmp(field, "sport") == 0) {
+            spec->fields |= CT_KEY_SPORT;
+        } else if (strcmp(field, "dport") == 0) {
+            spec->fields |= CT_KEY_DPORT;
+        } else {
+            return -1;
+        }
+
+        if (!prefix4) {
+            continue;
+        }
+        if (!p4) {
+            // Only the addresses have a prefix
+            return -1;
+        }
+
+        int len = atoi(prefix4);
+        if (len < 0 || len > 32) {
+            return -1;
+        }
+        *p4 = len;
+        *p6 = 64;
+
+        if (prefix6) {
+            len = atoi(prefix6);
+            if (len < 0 || len > 128) {
+                return -1;
+            }
+            *p6 = len;
+        }
+    }
+
+    if (!spec->fields) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Allocate an aggregation table
+ * @param spec is the key specification to use
+ * @param nr_slots is the largest number of different keys to store, up to
+ * CT_SLOTS_MAX
+ * @return the table or NULL
+ */
+ct_agg_t *ct_agg_malloc(ct_keyspec_t *spec, unsigned int nr_slots) {
+    if (nr_slots < 1 || nr_slots > CT_SLOTS_MAX) {
+        return NULL;
+    }
+
+    // Keep the hash index at most half full
+    unsigned int size = 1;
+    while (size < nr_slots * 2) {
+        size *= 2;
+    }
+
+    ct_agg_t *agg = malloc(sizeof(ct_agg_t) + size * sizeof(agg->index[0]));
+    if (!agg) {
+        return NULL;
+    }
+    agg->spec = *spec;
+    agg->nr_slots = nr_slots;
+    agg->topk = NULL;
+    agg->mask = size - 1;
+    ct_agg_zero(agg);
+
+    // Only added once the index has been cleared, as -fanalyzer loses
+    // track of the other fields when it is
+    agg->entries = malloc(nr_slots * sizeof(ct_entry_t));
+    if (!agg->entries) {
+        free(agg);
+        return NULL;
+    }
+    return agg;
+}
+
+void ct_agg_free(ct_agg_t *agg) {
+    if (agg->topk) {
+        topk_free(agg->topk);
+    }
+    free(agg->entries);
+    free(agg);
+}
+
+/**
+ * Empty the table, ready for the next dump, without changing allocations
+ */
+void ct_agg_zero(ct_agg_t *agg) {
+    memset(agg->index, 0xff, (agg->mask + 1) * sizeof(agg->index[0]));
+    memset(&agg->overflow, 0, sizeof(agg->overflow));
+    agg->nr_used = 0;
+    agg->flows = 0;
+
+    if (agg->topk) {
+        topk_zero(agg->topk);
+    }
+}
+
+// FNV-1a
+static uint32_t ct_key_hash(ct_key_t *key) {
+    uint8_t *p = (uint8_t *)key;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(*key); i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void ct_entry_add(ct_entry_t *e, uint64_t packets, uint64_t bytes) {
+    e->flows++;
+    e->packets += packets;
+    e->bytes += bytes;
+}
+
+/**
+ * Add the counters from one flow to the totals for its key
+ */
+void ct_agg_add(ct_agg_t *agg, ct_key_t *key, uint64_t packets, uint64_t bytes) {
+    agg->flows++;
+
+    // The sketch sees every key, even those that end up as overflow
+    if (agg->topk) {
+        topk_add(agg->topk, key, bytes);
+    }
+
+    uint32_t slot = ct_key_hash(key) & agg->mask;
+    while (agg->index[slot] != -1) {
+        ct_entry_t *e = &agg->entries[agg->index[slot]];
+        if (memcmp(&e->key, key, sizeof(*key)) == 0) {
+            ct_entry_add(e, packets, bytes);
+            return;
+        }
+        slot = (slot + 1) & agg->mask;
+    }
+
+    if (agg->nr_used == agg->nr_slots) {
+        ct_entry_add(&agg->overflow, packets, bytes);
+        return;
+    }
+
+    ct_entry_t *e = &agg->entries[agg->nr_used];
+    agg->index[slot] = agg->nr_used;
+    agg->nr_used++;
+
+    e->key = *key;
+    e->flows = 0;
+    e->packets = 0;
+    e->bytes = 0;
+    ct_entry_add(e, packets, bytes);
+}
+
+static void ct_addr_label(strbuf_t *p, const char *name, uint8_t family,
+        uint8_t *addr, int prefix) {
+    char s[INET6_ADDRSTRLEN];
+    if (!inet_ntop(family, addr, s, sizeof(s))) {
+        s[0] = 0;
+    }
+    sb_printf(p, "%s%s=\"%s/%i\"", sb_len(p) ? "," : "", name, s, prefix);
+}
+
+/**
+ * Append the labels for a key, for use in a Prometheus series
+ * @param p is the strbuf to append to, which must start empty
+ */
+void ct_labels(ct_agg_t *agg, ct_key_t *key, strbuf_t *p) {
+    ct_keyspec_t *spec = &agg->spec;
+    int v6 = key->family == AF_INET6;
+
+    if (spec->fields & CT_KEY_SRC) {
+        ct_addr_label(p, "src", key->family, key->src,
+                v6 ? spec->src_prefix6 : spec->src_prefix4);
+    }
+    if (spec->fields & CT_KEY_DST) {
+        ct_addr_label(p, "dst", key->family, key->dst,
+                v6 ? spec->dst_prefix6 : spec->dst_prefix4);
+    }
+    if (spec->fields & CT_KEY_PROTO) {
+        char proto[8];
+        char *name = acct_proto_name(key->proto, proto, sizeof(proto));
+        sb_printf(p, "%sproto=\"%s\"", sb_len(p) ? "," : "", name ? name : "0");
+    }
+    if (spec->fields & CT_KEY_SPORT) {
+        sb_printf(p, "%ssport=\"%u\"", sb_len(p) ? "," : "", key->sport);
+    }
+    if (spec->fields & CT_KEY_DPORT) {
+        sb_printf(p, "%sdport=\"%u\"", sb_len(p) ? "," : "", key->dport);
+    }
+}
+
+/**
+ * Open a netlink socket and request a dump of the conntrack table.
+ * @return the socket to read the reply from, or -1 for error
+ */
+int conntrack_dump(void) {
+    int fd = nfnl_open();
+    if (fd == -1) {
+        return -1;
+    }
+
+    strbuf_t *msg = nfnl_msg(
+            (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET,
+            NLM_F_DUMP,
+            AF_UNSPEC
+    );
+    if (!msg) {
+        close(fd);
+        return -1;
+    }
+
+    int r = nfnl_send(fd, msg);
+    free(msg);
+    if (r == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void ct_addr_mask(uint8_t *dst, const void *src, size_t len, int prefix) {
+    memcpy(dst, src, len);
+    for (size_t i = 0; i < len; i++) {
+        if (prefix >= 8) {
+            prefix -= 8;
+            continue;
+        }
+        dst[i] &= (uint8_t)(0xff00 >> prefix);
+        prefix = 0;
+    }
+}
+
+static void ct_counters(const struct nlattr *nest, uint64_t *packets, uint64_t *bytes) {
+    const struct nlattr *tb[CTA_COUNTERS_MAX + 1];
+    nfnl_iter_t iter;
+
+    if (!nest) {
+        return;
+    }
+    nfnl_iter_nest(&iter, nest);
+    nfnl_attrs(&iter, tb, CTA_COUNTERS_MAX);
+
+    if (tb[CTA_COUNTERS_PACKETS]) {
+        *packets += nfnl_attr_be64(tb[CTA_COUNTERS_PACKETS]);
+    }
+    if (tb[CTA_COUNTERS_BYTES]) {
+        *bytes += nfnl_attr_be64(tb[CTA_COUNTERS_BYTES]);
+    }
+}
+
+static int conntrack_msg(struct nlmsghdr *nlh, void *arg) {
+    ct_agg_t *agg = arg;
+    ct_keyspec_t *spec = &agg->spec;
+
+    if (nlh->nlmsg_type != ((NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW)) {
+        return 0;
+    }
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg))) {
+        return 0;
+    }
+    struct nfgenmsg *nfg = NLMSG_DATA(nlh);
+
+    const struct nlattr *tb[CTA_MAX + 1];
+    const struct nlattr *tuple[CTA_TUPLE_MAX + 1];
+    const struct nlattr *ip[CTA_IP_MAX + 1];
+    const struct nlattr *proto[CTA_PROTO_MAX + 1];
+    nfnl_iter_t iter;
+
+    nfnl_iter_msg(&iter, nlh);
+    nfnl_attrs(&iter, tb, CTA_MAX);
+    if (!tb[CTA_TUPLE_ORIG]) {
+        return 0;
+    }
+
+    nfnl_iter_nest(&iter, tb[CTA_TUPLE_ORIG]);
+    nfnl_attrs(&iter, tuple, CTA_TUPLE_MAX);
+    if (!tuple[CTA_TUPLE_IP] || !tuple[CTA_TUPLE_PROTO]) {
+        return 0;
+    }
+    nfnl_iter_nest(&iter, tuple[CTA_TUPLE_IP]);
+    nfnl_attrs(&iter, ip, CTA_IP_MAX);
+    nfnl_iter_nest(&iter, tuple[CTA_TUPLE_PROTO]);
+    nfnl_attrs(&iter, proto, CTA_PROTO_MAX);
+
+    const struct nlattr *src;
+    const struct nlattr *dst;
+    size_t addrlen;
+    int prefix_src;
+    int prefix_dst;
+
+    if (nfg->nfgen_family == AF_INET6) {
+        src = ip[CTA_IP_V6_SRC];
+        dst = ip[CTA_IP_V6_DST];
+        addrlen = 16;
+        prefix_src = spec->src_prefix6;
+        prefix_dst = spec->dst_prefix6;
+    } else {
+        src = ip[CTA_IP_V4_SRC];
+        dst = ip[CTA_IP_V4_DST];
+        addrlen = 4;
+        prefix_src = spec->src_prefix4;
+        prefix_dst = spec->dst_prefix4;
+    }
+
+    ct_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.family = nfg->nfgen_family;
+
+    if ((spec->fields & CT_KEY_SRC) && src && nfnl_attr_len(src) >= addrlen) {
+        ct_addr_mask(key.src, nfnl_attr_data(src), addrlen, prefix_src);
+    }
+    if ((spec->fields & CT_KEY_DST) && dst && nfnl_attr_len(dst) >= addrlen) {
+        ct_addr_mask(key.dst, nfnl_attr_data(dst), addrlen, prefix_dst);
+    }
+    if ((spec->fields & CT_KEY_PROTO) && proto[CTA_PROTO_NUM]) {
+        key.proto = nfnl_attr_u8(proto[CTA_PROTO_NUM]);
+    }
+    if ((spec->fields & CT_KEY_SPORT) && proto[CTA_PROTO_SRC_PORT]) {
+        key.sport = nfnl_attr_be16(proto[CTA_PROTO_SRC_PORT]);
+    }
+    if ((spec->fields & CT_KEY_DPORT) && proto[CTA_PROTO_DST_PORT]) {
+        key.dport = nfnl_attr_be16(proto[CTA_PROTO_DST_PORT]);
+    }
+
+    // Both directions of the flow count towards its traffic
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    ct_counters(tb[CTA_COUNTERS_ORIG], &packets, &bytes);
+    ct_counters(tb[CTA_COUNTERS_REPLY], &packets, &bytes);
+
+    ct_agg_add(agg, &key, packets, bytes);
+    return 0;
+}
+
+/**
+ * Read the reply to conntrack_dump(), or a recording of it, adding every
+ * flow into the aggregation table.
+ * @return the number of flows read, or -1 for error (with errno set)
+ */
+int conntrack_read(int fd, ct_agg_t *agg) {
+    return nfnl_stream(fd, conntrack_msg, agg);
+}
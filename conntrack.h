@@ -0,0 +1,85 @@
+/** @file
+ * Internal interface definitions for the conntrack flow collector
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef CONNTRACK_H
+#define CONNTRACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "strbuf.h"
+#include "topk.h"
+
+#define CT_KEY_SRC 1
+#define CT_KEY_DST 2
+#define CT_KEY_PROTO 4
+#define CT_KEY_SPORT 8
+#define CT_KEY_DPORT 16
+
+/**
+ * Which flow fields are used to build the aggregation key
+ */
+typedef struct ct_keyspec {
+    int fields;             //!< bitmask of CT_KEY_* values
+    uint8_t src_prefix4;    //!< IPv4 source prefix length
+    uint8_t src_prefix6;    //!< IPv6 source prefix length
+    uint8_t dst_prefix4;    //!< IPv4 destination prefix length
+    uint8_t dst_prefix6;    //!< IPv6 destination prefix length
+} ct_keyspec_t;
+
+/**
+ * An aggregation key, with all the unused fields set to zero
+ */
+typedef struct ct_key {
+    uint8_t family;
+    uint8_t proto;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t src[16];
+    uint8_t dst[16];
+} ct_key_t;
+
+typedef struct ct_entry {
+    ct_key_t key;
+    uint32_t flows;
+    uint64_t packets;
+    uint64_t bytes;
+} ct_entry_t;
+
+/**
+ * A fixed size hash table of flow totals.
+ * Once nr_slots different keys have been seen, any further keys are added
+ * to the overflow entry, so the memory used and the size of the output do
+ * not depend on the number of flows.
+ */
+typedef struct ct_agg {
+    ct_keyspec_t spec;
+    unsigned int nr_slots;  //!< The largest number of keys to store
+    unsigned int nr_used;   //!< The number of keys stored
+    unsigned int mask;      //!< Size of the hash index, less one
+    uint64_t flows;         //!< The total number of flows seen
+    ct_entry_t overflow;    //!< Totals for flows that did not fit
+    ct_entry_t *entries;    //!< The stored keys, in arrival order
+    topk_t *topk;           //!< Optional sketch of the heaviest keys by bytes
+    int32_t index[];        //!< Open addressed hash index into entries
+} ct_agg_t;
+
+/**
+ * The most keys that an aggregation table may store
+ */
+#define CT_SLOTS_MAX (1 << 24)
+
+int ct_keyspec_parse(ct_keyspec_t *, char *);
+ct_agg_t *ct_agg_malloc(ct_keyspec_t *, unsigned int);
+void ct_agg_free(ct_agg_t *);
+void ct_agg_zero(ct_agg_t *);
+void ct_agg_add(ct_agg_t *, ct_key_t *, uint64_t, uint64_t);
+void ct_labels(ct_agg_t *, ct_key_t *, strbuf_t *);
+
+int conntrack_dump(void);
+int conntrack_read(int, ct_agg_t *);
+#endif
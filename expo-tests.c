@@ -0,0 +1,172 @@
+/*
+ * Tests for the OpenMetrics and protobuf exposition formats
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expo.h"
+
+static const char body1[] =
+    "# TYPE a_total counter\n"
+    "# TYPE b gauge\n"
+    "a_total{x=\"1\"} 5\n"
+    "b{x=\"1\"} 7\n"
+    "a_total{x=\"2\"} 6\n"
+    "b{x=\"2\"} 8\n"
+    "plain 1.5\n";
+
+// Also has a reset and a new series
+static const char body2[] =
+    "# TYPE a_total counter\n"
+    "# TYPE b gauge\n"
+    "a_total{x=\"1\"} 9\n"
+    "b{x=\"1\"} 7\n"
+    "a_total{x=\"2\"} 1\n"
+    "b{x=\"2\"} 8\n"
+    "a_total{x=\"3\"} 2\n"
+    "plain 1.5\n";
+
+static const char om1[] =
+    "# TYPE a counter\n"
+    "a_total{x=\"1\"} 5\n"
+    "a_total{x=\"2\"} 6\n"
+    "# TYPE b gauge\n"
+    "b{x=\"1\"} 7\n"
+    "b{x=\"2\"} 8\n"
+    "# TYPE plain unknown\n"
+    "plain 1.5\n"
+    "# EOF\n";
+
+static const char om2[] =
+    "# TYPE a counter\n"
+    "a_total{x=\"1\"} 9\n"
+    "a_total{x=\"2\"} 1\n"
+    "a_created{x=\"2\"} 1000\n"
+    "a_total{x=\"3\"} 2\n"
+    "a_created{x=\"3\"} 1000\n"
+    "# TYPE b gauge\n"
+    "b{x=\"1\"} 7\n"
+    "b{x=\"2\"} 8\n"
+    "# TYPE plain unknown\n"
+    "plain 1.5\n"
+    "# EOF\n";
+
+// Parse the text, split in two to check that the pieces are joined
+void parse(expo_t *expo, const char *text, int64_t now) {
+    size_t len = strlen(text);
+    struct iovec body[2] = {
+        { (char *)text, len / 2 },
+        { (char *)text + len / 2, len - len / 2 },
+    };
+    assert(expo_parse(expo, body, 2, now)==0);
+}
+
+// Tests are silent and return if everything is OK, or abort if issues
+void expo_openmetrics_tests() {
+    expo_t *expo = expo_malloc(200000);
+    strbuf_t *out = sb_malloc(16);
+    out->capacity_max = 1000;
+
+    // The first time, nothing is known about when the counters started
+    parse(expo, body1, 900);
+    assert(expo->nr_families==3);
+    assert(expo->nr_samples==5);
+    assert(expo_openmetrics(expo, &out)==0);
+    assert(strcmp(out->str, om1)==0);
+
+    parse(expo, body2, 1000);
+    assert(expo_openmetrics(expo, &out)==0);
+    assert(strcmp(out->str, om2)==0);
+
+    // The creation time is kept while the counter keeps going up
+    parse(expo, body2, 1100);
+    assert(expo_openmetrics(expo, &out)==0);
+    assert(strcmp(out->str, om2)==0);
+
+    // Too big to render
+    strbuf_t *small = sb_malloc(16);
+    small->capacity_max = 64;
+    assert(expo_openmetrics(expo, &small)==-1);
+    free(small);
+
+    // Any line that is not a sample is an error
+    char bad[] = "a{x=\"1\" 5\n";
+    struct iovec body = { bad, strlen(bad) };
+    assert(expo_parse(expo, &body, 1, 0)==-1);
+
+    // A body bigger than the limit is not parsed
+    expo_t *tiny = expo_malloc(2000);
+    char lines[3000];
+    memset(lines, '#', sizeof(lines));
+    struct iovec big = { lines, sizeof(lines) };
+    assert(expo_parse(tiny, &big, 1, 0)==-1);
+    big.iov_len = 1500;
+    assert(expo_parse(tiny, &big, 1, 0)==0);
+    expo_free(tiny);
+
+    free(out);
+    expo_free(expo);
+}
+
+// Read a varint from the protobuf
+uint64_t varint(const unsigned char **p) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (**p & 0x80) {
+        v |= (uint64_t)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= (uint64_t)*(*p)++ << shift;
+    return v;
+}
+
+// Tests are silent and return if everything is OK, or abort if issues
+void expo_protobuf_tests() {
+    expo_t *expo = expo_malloc(200000);
+    strbuf_t *out = sb_malloc(16);
+    out->capacity_max = 1000;
+
+    parse(expo, "# TYPE c_total counter\nc_total{l=\"q\\\"\"} 2\n", 1);
+    parse(expo, "# TYPE c_total counter\nc_total{l=\"q\\\"\"} 1\n", 300);
+    assert(expo_protobuf(expo, &out)==0);
+
+    static const unsigned char expected[] = {
+        // MetricFamily length, name, type COUNTER
+        0x26, 0x0a, 0x07, 'c', '_', 't', 'o', 't', 'a', 'l', 0x18, 0x00,
+        // Metric, LabelPair with the value unescaped
+        0x22, 0x19, 0x0a, 0x07, 0x0a, 0x01, 'l', 0x12, 0x02, 'q', '"',
+        // Counter, the value and a Timestamp for the reset
+        0x1a, 0x0e, 0x09, 0, 0, 0, 0, 0, 0, 0xf0, 0x3f,
+        0x1a, 0x03, 0x08, 0xac, 0x02,
+    };
+    assert(sb_len(out)==sizeof(expected));
+    assert(memcmp(out->str, expected, sizeof(expected))==0);
+
+    // Each family is a length delimited message
+    parse(expo, body2, 1000);
+    assert(expo_protobuf(expo, &out)==0);
+    const unsigned char *p = (unsigned char *)out->str;
+    const unsigned char *end = p + sb_len(out);
+    int families = 0;
+    while (p < end) {
+        p += varint(&p);
+        families++;
+    }
+    assert(p==end);
+    assert(families==3);
+
+    free(out);
+    expo_free(expo);
+}
+
+int main() {
+    printf("Running expo tests\n");
+    expo_openmetrics_tests();
+    expo_protobuf_tests();
+}
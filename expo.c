@@ -0,0 +1,606 @@
+/** @file
+ * Write a body of metrics out again in the other exposition formats
+ *
+ * The Prometheus text format is what the collectors render.  To serve the
+ * OpenMetrics text format or the delimited protobuf format, that body is
+ * parsed back into families and samples.  The text is kept, so the names,
+ * labels and values are copied through untouched where the formats agree.
+ *
+ * OpenMetrics also wants to know when each counter was created, so that a
+ * scraper can tell a reset from a counter that is new.  The collectors do
+ * not know that, so it is found here by remembering each counter from one
+ * parse to the next: one that is new, or whose value went backwards, was
+ * created at the time of the body it was first seen in.  The counters in
+ * the first body parsed have an unknown creation time.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expo.h"
+
+#define EXPO_SERIES_MIN 64
+
+/**
+ * Append to a strbuf, growing it geometrically
+ * @return 0 or -1 if it would not fit in the capacity_max
+ */
+static int _expo_append(strbuf_t **pp, const void *buf, size_t len) {
+    strbuf_t *p = *pp;
+    size_t needed = p->wr_pos + len + 1;
+    if (needed > p->capacity) {
+        size_t size = p->capacity * 2;
+        if (size < needed) {
+            size = needed;
+        }
+        if (needed > p->capacity_max || !sb_realloc(pp, size)) {
+            return -1;
+        }
+        p = *pp;
+    }
+    memcpy(&p->str[p->wr_pos], buf, len);
+    p->wr_pos += len;
+    p->str[p->wr_pos] = 0;
+    return 0;
+}
+
+static int _expo_puts(strbuf_t **pp, const char *s) {
+    return _expo_append(pp, s, strlen(s));
+}
+
+static uint64_t _expo_hash(const char *buf, size_t len, uint64_t hash) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)buf[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Allocate the state for converting the bodies
+ * @param len_max is the largest body, and the largest output, allowed
+ * @return the state or NULL
+ */
+expo_t *expo_malloc(size_t len_max) {
+    expo_t *expo = calloc(1, sizeof(expo_t));
+    if (!expo) {
+        return NULL;
+    }
+    expo->text = sb_malloc(1000);
+    expo->family = sb_malloc(1000);
+    expo->metric = sb_malloc(256);
+    expo->pair = sb_malloc(256);
+    expo->mask = EXPO_SERIES_MIN - 1;
+    expo->series = calloc(EXPO_SERIES_MIN, sizeof(expo_series_t));
+    if (!expo->text || !expo->family || !expo->metric || !expo->pair || !expo->series) {
+        expo_free(expo);
+        return NULL;
+    }
+    expo->text->capacity_max = len_max;
+    expo->family->capacity_max = len_max;
+    expo->metric->capacity_max = len_max;
+    expo->pair->capacity_max = len_max;
+    return expo;
+}
+
+void expo_free(expo_t *expo) {
+    if (!expo) {
+        return;
+    }
+    free(expo->text);
+    free(expo->families);
+    free(expo->samples);
+    free(expo->series);
+    free(expo->family);
+    free(expo->metric);
+    free(expo->pair);
+    free(expo);
+}
+
+/**
+ * Find the slot for a series in the table
+ * @return the slot, which is either unused or holds this series
+ */
+static expo_series_t *_expo_series_slot(expo_series_t *table, unsigned int mask,
+        uint64_t hash) {
+    unsigned int i = hash & mask;
+    while (table[i].hash && table[i].hash != hash) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+/**
+ * Rebuild the series table once it is half full, leaving out the series
+ * that were in neither this body nor the one before
+ * @return 0 or -1 if there was no memory
+ */
+static int _expo_series_rehash(expo_t *expo) {
+    unsigned int live = 0;
+    for (unsigned int i = 0; i <= expo->mask; i++) {
+        if (expo->series[i].hash && expo->series[i].seen + 1 >= expo->nr_parses) {
+            live++;
+        }
+    }
+
+    unsigned int size = EXPO_SERIES_MIN;
+    while (size < live * 4) {
+        size *= 2;
+    }
+    expo_series_t *table = calloc(size, sizeof(expo_series_t));
+    if (!table) {
+        return -1;
+    }
+    for (unsigned int i = 0; i <= expo->mask; i++) {
+        expo_series_t *old = &expo->series[i];
+        if (old->hash && old->seen + 1 >= expo->nr_parses) {
+            *_expo_series_slot(table, size - 1, old->hash) = *old;
+        }
+    }
+    free(expo->series);
+    expo->series = table;
+    expo->mask = size - 1;
+    expo->nr_series = live;
+    return 0;
+}
+
+/**
+ * Work out when a counter sample was created
+ */
+static int _expo_created(expo_t *expo, expo_family_t *family,
+        expo_sample_t *sample, int64_t now) {
+    const char *text = expo->text->str;
+    uint64_t hash = _expo_hash(&text[family->name_pos], family->name_len,
+            0xcbf29ce484222325ULL);
+    hash = _expo_hash("{", 1, hash);
+    hash = _expo_hash(&text[sample->labels_pos], sample->labels_len, hash);
+    if (!hash) {
+        hash = 1;
+    }
+
+    if ((expo->nr_series + 1) * 2 > expo->mask + 1) {
+        if (_expo_series_rehash(expo) == -1) {
+            return -1;
+        }
+    }
+
+    expo_series_t *series = _expo_series_slot(expo->series, expo->mask, hash);
+    if (!series->hash) {
+        series->hash = hash;
+        series->created = (expo->nr_parses > 1) ? now : 0;
+        expo->nr_series++;
+    } else if (sample->value < series->value) {
+        series->created = now;
+    }
+    series->value = sample->value;
+    series->seen = expo->nr_parses;
+    sample->created = series->created;
+    return 0;
+}
+
+/**
+ * Find the family with this name, adding it if it is new
+ * @param hint is the family to try first, as the samples of one family
+ * are usually together
+ */
+static expo_family_t *_expo_family(expo_t *expo, const char *name, size_t len,
+        unsigned int hint) {
+    const char *text = expo->text->str;
+    if (hint < expo->nr_families) {
+        expo_family_t *family = &expo->families[hint];
+        if (family->name_len == len && !memcmp(&text[family->name_pos], name, len)) {
+            return family;
+        }
+    }
+    for (unsigned int i = 0; i < expo->nr_families; i++) {
+        expo_family_t *family = &expo->families[i];
+        if (family->name_len == len && !memcmp(&text[family->name_pos], name, len)) {
+            return family;
+        }
+    }
+
+    if (expo->nr_families == expo->max_families) {
+        unsigned int max = expo->max_families ? expo->max_families * 2 : 16;
+        expo_family_t *families = realloc(expo->families, max * sizeof(*families));
+        if (!families) {
+            return NULL;
+        }
+        expo->families = families;
+        expo->max_families = max;
+    }
+    expo_family_t *family = &expo->families[expo->nr_families++];
+    family->name_pos = name - text;
+    family->name_len = len;
+    family->type = EXPO_UNTYPED;
+    family->first = -1;
+    family->last = -1;
+    return family;
+}
+
+static expo_sample_t *_expo_sample(expo_t *expo, expo_family_t *family) {
+    if (expo->nr_samples == expo->max_samples) {
+        unsigned int max = expo->max_samples ? expo->max_samples * 2 : 64;
+        expo_sample_t *samples = realloc(expo->samples, max * sizeof(*samples));
+        if (!samples) {
+            return NULL;
+        }
+        expo->samples = samples;
+        expo->max_samples = max;
+    }
+    int32_t i = expo->nr_samples++;
+    expo_sample_t *sample = &expo->samples[i];
+    memset(sample, 0, sizeof(*sample));
+    sample->next = -1;
+    if (family->last == -1) {
+        family->first = i;
+    } else {
+        expo->samples[family->last].next = i;
+    }
+    family->last = i;
+    return sample;
+}
+
+static size_t _expo_name_len(const char *p, const char *end) {
+    const char *name = p;
+    while (p < end && *p != ' ' && *p != '{' && *p != '\t') {
+        p++;
+    }
+    return p - name;
+}
+
+/**
+ * Parse a "# TYPE name type" line
+ */
+static int _expo_type(expo_t *expo, const char *p, const char *end) {
+    p += 7;
+    size_t len = _expo_name_len(p, end);
+    expo_family_t *family = _expo_family(expo, p, len, expo->nr_families);
+    if (!family) {
+        return -1;
+    }
+    p += len + 1;
+    if (end - p == 7 && !memcmp(p, "counter", 7)) {
+        family->type = EXPO_COUNTER;
+    } else if (end - p == 5 && !memcmp(p, "gauge", 5)) {
+        family->type = EXPO_GAUGE;
+    }
+    return 0;
+}
+
+/**
+ * Parse a sample line, name{labels} value
+ */
+static int _expo_line(expo_t *expo, const char *p, const char *end,
+        unsigned int *hint, int64_t now) {
+    const char *text = expo->text->str;
+    size_t len = _expo_name_len(p, end);
+    if (!len) {
+        return -1;
+    }
+    expo_family_t *family = _expo_family(expo, p, len, *hint);
+    if (!family) {
+        return -1;
+    }
+    *hint = family - expo->families;
+    p += len;
+
+    uint32_t labels_pos = p - text;
+    uint32_t labels_len = 0;
+    if (p < end && *p == '{') {
+        // Find the closing brace, stepping over any in the quoted values
+        int quoted = 0;
+        labels_pos++;
+        for (p++; p < end; p++) {
+            if (quoted && *p == '\\') {
+                p++;
+            } else if (*p == '"') {
+                quoted = !quoted;
+            } else if (!quoted && *p == '}') {
+                break;
+            }
+        }
+        if (p >= end) {
+            return -1;
+        }
+        labels_len = p - text - labels_pos;
+        p++;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    // The text is nul terminated, so the strtod() cannot run off the end
+    expo_sample_t *sample = _expo_sample(expo, family);
+    if (!sample) {
+        return -1;
+    }
+    char *value_end;
+    sample->labels_pos = labels_pos;
+    sample->labels_len = labels_len;
+    sample->value_pos = p - text;
+    sample->value = strtod(p, &value_end);
+    if (value_end == p || value_end > end) {
+        return -1;
+    }
+    sample->value_len = value_end - p;
+
+    if (family->type == EXPO_COUNTER) {
+        return _expo_created(expo, family, sample, now);
+    }
+    return 0;
+}
+
+/**
+ * Parse a body in the Prometheus text format, replacing the last one
+ * @param body is the text, in pieces which are joined together
+ * @param nr is the number of pieces
+ * @param now is the wall clock time the body was rendered at
+ * @return 0 or -1 if the body could not be parsed
+ */
+int expo_parse(expo_t *expo, const struct iovec *body, int nr, int64_t now) {
+    expo->nr_families = 0;
+    expo->nr_samples = 0;
+    expo->nr_parses++;
+
+    sb_zero(expo->text);
+    for (int i = 0; i < nr; i++) {
+        if (_expo_append(&expo->text, body[i].iov_base, body[i].iov_len) == -1) {
+            return -1;
+        }
+    }
+
+    // All the positions are offsets into our copy of the text
+    const char *text = expo->text->str;
+    const char *p = text;
+    const char *text_end = text + sb_len(expo->text);
+    unsigned int hint = 0;
+    while (p < text_end) {
+        const char *end = memchr(p, '\n', text_end - p);
+        if (!end) {
+            end = text_end;
+        }
+
+        int r = 0;
+        if (end - p > 7 && !memcmp(p, "# TYPE ", 7)) {
+            r = _expo_type(expo, p, end);
+        } else if (p < end && *p != '#') {
+            r = _expo_line(expo, p, end, &hint, now);
+        }
+        if (r == -1) {
+            return -1;
+        }
+        p = end + 1;
+    }
+    return 0;
+}
+
+/**
+ * Write the name of a family as OpenMetrics has it, which does not
+ * include the _total of a counter
+ */
+static int _expo_om_name(expo_t *expo, strbuf_t **pp, expo_family_t *family) {
+    const char *name = &expo->text->str[family->name_pos];
+    size_t len = family->name_len;
+    if (family->type == EXPO_COUNTER && len > 6 && !memcmp(&name[len - 6], "_total", 6)) {
+        len -= 6;
+    }
+    return _expo_append(pp, name, len);
+}
+
+static int _expo_om_sample(expo_t *expo, strbuf_t **pp, expo_family_t *family,
+        expo_sample_t *sample, const char *suffix, const char *value, size_t len) {
+    const char *text = expo->text->str;
+    int r = _expo_om_name(expo, pp, family);
+    r |= _expo_puts(pp, suffix);
+    if (sample->labels_len) {
+        r |= _expo_puts(pp, "{");
+        r |= _expo_append(pp, &text[sample->labels_pos], sample->labels_len);
+        r |= _expo_puts(pp, "}");
+    }
+    r |= _expo_puts(pp, " ");
+    r |= _expo_append(pp, value, len);
+    r |= _expo_puts(pp, "\n");
+    return r;
+}
+
+/**
+ * Render the last body parsed in the OpenMetrics text format
+ * @param pp is the strbuf to replace the contents of
+ * @return 0 or -1 if it did not fit
+ */
+int expo_openmetrics(expo_t *expo, strbuf_t **pp) {
+    static const char *types[] = {
+        [EXPO_UNTYPED] = "unknown",
+        [EXPO_COUNTER] = "counter",
+        [EXPO_GAUGE] = "gauge",
+    };
+    const char *text = expo->text->str;
+    int r = 0;
+
+    sb_zero(*pp);
+    for (unsigned int i = 0; i < expo->nr_families; i++) {
+        expo_family_t *family = &expo->families[i];
+        if (family->first == -1) {
+            continue;
+        }
+        r |= _expo_puts(pp, "# TYPE ");
+        r |= _expo_om_name(expo, pp, family);
+        r |= _expo_puts(pp, " ");
+        r |= _expo_puts(pp, types[family->type]);
+        r |= _expo_puts(pp, "\n");
+
+        const char *suffix = (family->type == EXPO_COUNTER) ? "_total" : "";
+        for (int32_t j = family->first; j != -1; j = expo->samples[j].next) {
+            expo_sample_t *sample = &expo->samples[j];
+            r |= _expo_om_sample(expo, pp, family, sample, suffix,
+                    &text[sample->value_pos], sample->value_len);
+            if (sample->created) {
+                char created[24];
+                int len = snprintf(created, sizeof(created), "%li",
+                        (long)sample->created);
+                r |= _expo_om_sample(expo, pp, family, sample, "_created",
+                        created, len);
+            }
+        }
+    }
+    r |= _expo_puts(pp, "# EOF\n");
+    return r ? -1 : 0;
+}
+
+static int _expo_varint_len(uint64_t v) {
+    int len = 1;
+    while (v >= 0x80) {
+        len++;
+        v >>= 7;
+    }
+    return len;
+}
+
+static int _expo_varint(strbuf_t **pp, uint64_t v) {
+    unsigned char buf[10];
+    int len = 0;
+    while (v >= 0x80) {
+        buf[len++] = v | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    return _expo_append(pp, buf, len);
+}
+
+/**
+ * Write a length delimited protobuf field
+ */
+static int _expo_pb_bytes(strbuf_t **pp, int field, const void *buf, size_t len) {
+    int r = _expo_varint(pp, (field << 3) | 2);
+    r |= _expo_varint(pp, len);
+    r |= _expo_append(pp, buf, len);
+    return r;
+}
+
+static int _expo_pb_double(strbuf_t **pp, int field, double value) {
+    uint64_t bits;
+    unsigned char buf[8];
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) {
+        buf[i] = bits >> (i * 8);
+    }
+    int r = _expo_varint(pp, (field << 3) | 1);
+    r |= _expo_append(pp, buf, sizeof(buf));
+    return r;
+}
+
+/**
+ * Write the labels of a sample as LabelPair messages, undoing the escapes
+ * in the values
+ */
+static int _expo_pb_labels(expo_t *expo, strbuf_t **pp, expo_sample_t *sample) {
+    const char *p = &expo->text->str[sample->labels_pos];
+    const char *end = p + sample->labels_len;
+    int r = 0;
+
+    while (p < end) {
+        const char *name = p;
+        while (p < end && *p != '=') {
+            p++;
+        }
+        size_t name_len = p - name;
+        p += 2;
+
+        const char *value = p;
+        size_t len = 0;
+        for (; p < end && *p != '"'; p++, len++) {
+            if (*p == '\\') {
+                p++;
+            }
+        }
+
+        sb_zero(expo->pair);
+        r |= _expo_pb_bytes(&expo->pair, 1, name, name_len);
+        r |= _expo_varint(&expo->pair, (2 << 3) | 2);
+        r |= _expo_varint(&expo->pair, len);
+        for (; value < p; value++) {
+            char ch = *value;
+            if (ch == '\\') {
+                value++;
+                ch = (*value == 'n') ? '\n' : *value;
+            }
+            r |= _expo_append(&expo->pair, &ch, 1);
+        }
+        r |= _expo_pb_bytes(pp, 1, expo->pair->str, sb_len(expo->pair));
+
+        p++;
+        if (p < end && *p == ',') {
+            p++;
+        }
+    }
+    return r;
+}
+
+/**
+ * Render the last body parsed as delimited io.prometheus.client.MetricFamily
+ * protobuf messages
+ * @param pp is the strbuf to replace the contents of
+ * @return 0 or -1 if it did not fit
+ */
+int expo_protobuf(expo_t *expo, strbuf_t **pp) {
+    // The MetricType enum values
+    static const int types[] = {
+        [EXPO_UNTYPED] = 3,
+        [EXPO_COUNTER] = 0,
+        [EXPO_GAUGE] = 1,
+    };
+    // The Metric field that holds the value for each type
+    static const int fields[] = {
+        [EXPO_UNTYPED] = 5,
+        [EXPO_COUNTER] = 3,
+        [EXPO_GAUGE] = 2,
+    };
+    const char *text = expo->text->str;
+    int r = 0;
+
+    sb_zero(*pp);
+    for (unsigned int i = 0; i < expo->nr_families; i++) {
+        expo_family_t *family = &expo->families[i];
+        if (family->first == -1) {
+            continue;
+        }
+
+        sb_zero(expo->family);
+        r |= _expo_pb_bytes(&expo->family, 1, &text[family->name_pos],
+                family->name_len);
+        r |= _expo_varint(&expo->family, 3 << 3);
+        r |= _expo_varint(&expo->family, types[family->type]);
+
+        for (int32_t j = family->first; j != -1; j = expo->samples[j].next) {
+            expo_sample_t *sample = &expo->samples[j];
+
+            sb_zero(expo->metric);
+            r |= _expo_pb_labels(expo, &expo->metric, sample);
+
+            // The value message, with a google.protobuf.Timestamp for when
+            // a counter was created
+            sb_zero(expo->pair);
+            r |= _expo_pb_double(&expo->pair, 1, sample->value);
+            if (sample->created) {
+                r |= _expo_varint(&expo->pair, (3 << 3) | 2);
+                r |= _expo_varint(&expo->pair, 1 + _expo_varint_len(sample->created));
+                r |= _expo_varint(&expo->pair, 1 << 3);
+                r |= _expo_varint(&expo->pair, sample->created);
+            }
+
+            r |= _expo_pb_bytes(&expo->metric, fields[family->type],
+                    expo->pair->str, sb_len(expo->pair));
+            r |= _expo_pb_bytes(&expo->family, 4, expo->metric->str,
+                    sb_len(expo->metric));
+        }
+
+        r |= _expo_varint(pp, sb_len(expo->family));
+        r |= _expo_append(pp, expo->family->str, sb_len(expo->family));
+    }
+    return r ? -1 : 0;
+}
@@ -0,0 +1,79 @@
+/** @file
+ * Internal interface definitions for the other metrics exposition formats
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef EXPO_H
+#define EXPO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "strbuf.h"
+
+#define EXPO_UNTYPED 0
+#define EXPO_COUNTER 1
+#define EXPO_GAUGE 2
+
+typedef struct expo_family {
+    uint32_t name_pos;          //!< Where the name is in the text
+    uint32_t name_len;
+    int type;
+    int32_t first;              //!< The first sample, or -1
+    int32_t last;               //!< The last sample, to append to
+} expo_family_t;
+
+typedef struct expo_sample {
+    uint32_t labels_pos;        //!< The text between the braces
+    uint32_t labels_len;
+    uint32_t value_pos;
+    uint32_t value_len;
+    int32_t next;               //!< The next sample in the family, or -1
+    double value;
+    int64_t created;            //!< When the counter started, or zero
+} expo_sample_t;
+
+/**
+ * What is remembered about a counter from one body to the next, to find
+ * when it was created or reset
+ */
+typedef struct expo_series {
+    uint64_t hash;              //!< Of the name and labels, zero if unused
+    double value;
+    int64_t created;
+    unsigned long seen;         //!< The last parse it was in
+} expo_series_t;
+
+/**
+ * One body of metrics in the text format, parsed so that it can be
+ * written out again in the other formats.  The samples of each family
+ * are linked together, as the text can have the families interleaved.
+ */
+typedef struct expo {
+    strbuf_t *text;             //!< A copy of the parsed body
+    unsigned int nr_families;
+    unsigned int max_families;
+    expo_family_t *families;
+    unsigned int nr_samples;
+    unsigned int max_samples;
+    expo_sample_t *samples;
+
+    unsigned long nr_parses;
+    unsigned int nr_series;
+    unsigned int mask;          //!< Size of the series table, less one
+    expo_series_t *series;
+
+    strbuf_t *family;           //!< For building the protobuf messages
+    strbuf_t *metric;
+    strbuf_t *pair;
+} expo_t;
+
+expo_t *expo_malloc(size_t);
+void expo_free(expo_t *);
+int expo_parse(expo_t *, const struct iovec *, int, int64_t);
+int expo_openmetrics(expo_t *, strbuf_t **);
+int expo_protobuf(expo_t *, strbuf_t **);
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Tests for the gzip compressed output
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "gz.h"
+
+// Undo the compression, returning the length
+size_t gunzip(strbuf_t *gz, char *buf, size_t size) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    assert(inflateInit2(&z, 15 + 16)==Z_OK);
+    z.next_in = (unsigned char *)gz->str;
+    z.avail_in = sb_len(gz);
+    z.next_out = (unsigned char *)buf;
+    z.avail_out = size;
+    assert(inflate(&z, Z_FINISH)==Z_STREAM_END);
+    assert(z.avail_in==0);
+    inflateEnd(&z);
+    return z.total_out;
+}
+
+// Tests are silent and return if everything is OK, or abort if issues
+void gz_tests() {
+    strbuf_t *src = sb_malloc(4000);
+    for (int i = 0; i < 100; i++) {
+        sb_printf(src, "iptables_acct_bytes_total{port=\"%i\"} %i\n", i, i * 7);
+    }
+
+    struct iovec vec = { src->str, sb_len(src) };
+
+    // Starts too small, so has to grow
+    strbuf_t *gz = sb_malloc(16);
+    gz->capacity_max = 4000;
+    assert(gz_compress(&gz, &vec, 1, GZ_LEVEL_DEFAULT)==0);
+    assert(sb_len(gz) > 18);
+    assert(sb_len(gz) < sb_len(src) / 4);
+    assert(memcmp(gz->str, "\x1f\x8b", 2)==0);
+
+    char buf[4000];
+    assert(gunzip(gz, buf, sizeof(buf))==sb_len(src));
+    assert(memcmp(buf, src->str, sb_len(src))==0);
+
+    // The old contents are replaced
+    assert(gz_compress(&gz, &vec, 1, 1)==0);
+    assert(gunzip(gz, buf, sizeof(buf))==sb_len(src));
+
+    // A body in pieces is compressed as if it were in one
+    struct iovec pieces[3] = {
+        { src->str, 10 },
+        { &src->str[10], 0 },
+        { &src->str[10], sb_len(src) - 10 },
+    };
+    assert(gz_compress(&gz, pieces, 3, GZ_LEVEL_DEFAULT)==0);
+    assert(gunzip(gz, buf, sizeof(buf))==sb_len(src));
+    assert(memcmp(buf, src->str, sb_len(src))==0);
+
+    // An empty body is still a valid stream
+    assert(gz_compress(&gz, NULL, 0, 9)==0);
+    assert(gunzip(gz, buf, sizeof(buf))==0);
+
+    // Without the room for the worst case, nothing is produced
+    strbuf_t *small = sb_malloc(16);
+    sb_zero(src);
+    sb_printf(src, "hello\n");
+    vec.iov_len = sb_len(src);
+    assert(gz_compress(&small, &vec, 1, GZ_LEVEL_DEFAULT)==-1);
+    assert(sb_len(small)==0);
+
+    free(small);
+    free(gz);
+    free(src);
+}
+
+int main() {
+    printf("Running gz tests\n");
+    gz_tests();
+}
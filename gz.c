@@ -0,0 +1,69 @@
+/** @file
+ * Compress a body into a gzip stream, using zlib
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <string.h>
+#include <zlib.h>
+
+#include "gz.h"
+
+/**
+ * Replace the contents of the destination with the source compressed.
+ * The destination is expanded to the worst case size first, so this is
+ * done in one pass over the source.
+ * @param pp is a pointer to the destination strbuf pointer.  This may be
+ * updated if there is a sb_realloc() call.
+ * @param src is the array of pieces to compress, in order
+ * @param nr is the number of pieces
+ * @param level is the zlib compression level, from 1 to 9
+ * @return 0 or -1 if zlib failed or the output would be larger than the
+ * destination capacity_max
+ */
+int gz_compress(strbuf_t **pp, const struct iovec *src, int nr, int level) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+
+    sb_zero(*pp);
+
+    // The extra 16 in the window bits asks for a gzip header and trailer
+    if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < nr; i++) {
+        len += src[i].iov_len;
+    }
+    size_t bound = deflateBound(&z, len);
+    if (bound > (*pp)->capacity && !sb_realloc(pp, bound)) {
+        deflateEnd(&z);
+        return -1;
+    }
+    strbuf_t *p = *pp;
+
+    z.next_out = (unsigned char *)p->str;
+    z.avail_out = p->capacity;
+
+    int r = Z_OK;
+    for (int i = 0; i < nr && r == Z_OK; i++) {
+        if (!src[i].iov_len) {
+            // deflate() counts no progress as an error
+            continue;
+        }
+        z.next_in = src[i].iov_base;
+        z.avail_in = src[i].iov_len;
+        r = deflate(&z, Z_NO_FLUSH);
+    }
+    if (r == Z_OK) {
+        r = deflate(&z, Z_FINISH);
+    }
+    deflateEnd(&z);
+    if (r != Z_STREAM_END) {
+        return -1;
+    }
+    p->wr_pos = z.total_out;
+    return 0;
+}
@@ -0,0 +1,18 @@
+/** @file
+ * Internal interface definitions for the gzip compressed output
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef GZ_H
+#define GZ_H
+
+#include <sys/uio.h>
+
+#include "strbuf.h"
+
+#define GZ_LEVEL_DEFAULT 6
+
+int gz_compress(strbuf_t **, const struct iovec *, int, int);
+#endif
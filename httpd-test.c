@@ -10,7 +10,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -19,19 +18,11 @@
 #include "connslot.h"
 #include "jsonrpc.h"
 
-int do_jsonrpc(strbuf_t *request, strbuf_t **reply) {
-    // Dont bother looking at the header fields
+int do_jsonrpc(char *body, strbuf_t **reply) {
     // Assume the body is zero terminated text
 
     sb_zero(*reply);
 
-    char *body = memmem(request->str, sb_len(request), "\r\n\r\n", 4);
-    if (!body) {
-        sb_reprintf(reply, "Error: no body\n");
-        return -1;
-    }
-    body += 4;
-
     jsonrpc_t json;
 
     if (jsonrpc_parse(body, &json) != 0) {
@@ -50,12 +41,63 @@ void send_str(int fd, char *s) {
     write(fd,s,strlen(s));
 }
 
+struct httpd {
+    slots_t *slots;
+    strbuf_t *reply;
+};
+
+void httpd_request(conn_t *conn, void *arg) {
+    struct httpd *httpd = arg;
+    strbuf_t **pp;
+    conn_http_t *http = conn->http;
+    int post = conn_slice_is(conn, http->method, "POST");
+
+    // generate reply
+
+    if (post && conn_slice_is(conn, http->path, "/echo")) {
+        conn->reply = conn->request;
+    } else if (post && conn_slice_is(conn, http->path, "/jsonrpc")) {
+        // Copied, as a pipelined request could follow this one
+        char *body = strndup(conn_slice_ptr(conn, http->body), http->body.len);
+
+        do_jsonrpc(body, &httpd->reply);
+        conn->reply = httpd->reply;
+        free(body);
+    } else {
+        conn->reply = httpd->reply;
+    }
+
+    pp = &conn->reply_header;
+    sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
+    sb_reprintf(pp, "x-slot: %li\r\n", conn - httpd->slots->conn);
+    sb_reprintf(pp, "x-open: %i\r\n", httpd->slots->nr_open);
+    sb_reprintf(pp, "Content-Length: %lu\r\n", sb_len(conn->reply));
+    sb_reprintf(
+        pp,
+        "Connection: %s\r\n\r\n",
+        conn->keepalive ? "keep-alive" : "close"
+    );
+
+    // TODO: detect reply_header realloc failure
+    //   // We filled up the reply_header strbuf
+    //   send_str(conn->fd, "HTTP/1.0 500 \r\n\r\n");
+    //   conn->state = CONN_EMPTY;
+    //   // TODO: we might have corrupted the ->reply_header ?
+    //   return;
+
+    // Try to immediately start sending the reply
+    conn_write(conn);
+}
+
 #define NR_SLOTS 5
+#define MAX_SLOTS 100
 void httpd_test(int port) {
+    struct httpd httpd;
     slots_t *slots = slots_malloc(NR_SLOTS);
     if (!slots) {
         abort();
     }
+    slots->max_slots = MAX_SLOTS;
 
     if (slots_listen_tcp(slots, port)!=0) {
         perror("slots_listen_tcp");
@@ -71,38 +113,18 @@ void httpd_test(int port) {
     reply->capacity_max = 1000;
     sb_printf(reply, "Hello World\n");
 
+    httpd.slots = slots;
+    httpd.reply = reply;
+
     signal(SIGPIPE, SIG_IGN);
 
     int running = 1;
     while (running) {
-        fd_set readers;
-        fd_set writers;
-        FD_ZERO(&readers);
-        FD_ZERO(&writers);
-        int fdmax = slots_fdset(slots, &readers, &writers);
+        int nr = slots_wait(slots, 5000, httpd_request, &httpd);
 
-        struct timeval tv;
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
-
-        int nr = select(fdmax+1, &readers, &writers, NULL, &tv);
-
-        if (nr == -1) {
-            perror("select");
-            exit(1);
-        }
-        if (nr == 0) {
-            // Must be a timeout
-            slots_closeidle(slots);
-            continue;
-        }
-
-        // There is at least one event waiting
-        int nr_ready = slots_fdset_loop(slots, &readers, &writers);
-
-        switch (nr_ready) {
+        switch (nr) {
             case -1:
-                perror("accept");
+                perror("slots_wait");
                 exit(1);
 
             case -2:
@@ -111,49 +133,8 @@ void httpd_test(int port) {
                 exit(1);
 
             case 0:
-                continue;
-        }
-
-        for (int i=0; i<slots->nr_slots; i++) {
-            if (slots->conn[i].fd == -1) {
-                continue;
-            }
-
-            if (slots->conn[i].state == CONN_READY) {
-                strbuf_t **pp;
-                // TODO:
-                // - parse request
-
-                // generate reply
-
-                if (strncmp("POST /echo ",slots->conn[i].request->str,10) == 0) {
-                    slots->conn[i].reply = slots->conn[i].request;
-                } else if (strncmp("POST /jsonrpc ",slots->conn[i].request->str,13) == 0) {
-                    // TODO: helper to extract http body
-                    sb_reappend(&slots->conn[i].request, "\0", 1);
-
-                    do_jsonrpc(slots->conn[i].request, &reply);
-                    slots->conn[i].reply = reply;
-                } else {
-                    slots->conn[i].reply = reply;
-                }
-
-                pp = &slots->conn[i].reply_header;
-                sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
-                sb_reprintf(pp, "x-slot: %i\r\n", i);
-                sb_reprintf(pp, "x-open: %i\r\n", slots->nr_open);
-                sb_reprintf(pp, "Content-Length: %lu\r\n\r\n", sb_len(slots->conn[i].reply));
-
-                // TODO: detect reply_header realloc failure
-                //   // We filled up the reply_header strbuf
-                //   send_str(slots->conn[i].fd, "HTTP/1.0 500 \r\n\r\n");
-                //   slots->conn[i].state = CONN_EMPTY;
-                //   // TODO: we might have corrupted the ->reply_header ?
-                //   continue;
-
-                // Try to immediately start sending the reply
-                conn_write(&slots->conn[i]);
-            }
+                // Must be a timeout
+                slots_closeidle(slots);
         }
     }
 }
@@ -0,0 +1,255 @@
+/** @file
+ * Read the rule counters directly from the kernel using the ip_tables
+ * getsockopt interface - the same one that iptables-save uses - without
+ * needing to fork any helper process.
+ *
+ * The raw data is kept in a strbuf laid out as a struct ipt_blob, which
+ * allows a recording of a live system to be replayed in the tests.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter/xt_comment.h>
+#include <linux/netfilter/xt_tcpudp.h>
+
+#include "ipt.h"
+
+/**
+ * The layout of the raw data buffer.
+ * Using a struct ensures that the entry table is correctly aligned.
+ */
+struct ipt_blob {
+    struct ipt_getinfo info;
+    struct ipt_get_entries entries;
+};
+
+static const char *hook_names[NF_INET_NUMHOOKS] = {
+    [NF_INET_PRE_ROUTING] = "PREROUTING",
+    [NF_INET_LOCAL_IN] = "INPUT",
+    [NF_INET_FORWARD] = "FORWARD",
+    [NF_INET_LOCAL_OUT] = "OUTPUT",
+    [NF_INET_POST_ROUTING] = "POSTROUTING",
+};
+
+/**
+ * Fetch the entries for one table from the kernel.
+ * @param table is the name of the table to fetch (eg: "raw")
+ * @return a newly allocated strbuf containing a struct ipt_blob, or NULL
+ * on error (with errno set)
+ */
+strbuf_t *ipt_get_entries(const char *table) {
+    struct ipt_getinfo info;
+    socklen_t len;
+
+    int fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    memset(&info, 0, sizeof(info));
+    strncpy(info.name, table, sizeof(info.name) - 1);
+    len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_IP, IPT_SO_GET_INFO, &info, &len) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    // The table could change between the two calls, in which case the
+    // kernel returns EAGAIN and we need to start again with fresh info
+    strbuf_t *p = NULL;
+    while (1) {
+        size_t size = sizeof(struct ipt_blob) + info.size;
+        free(p);
+        p = sb_malloc(size);
+        if (!p) {
+            break;
+        }
+
+        struct ipt_blob *blob = (struct ipt_blob *)p->str;
+        memset(blob, 0, sizeof(*blob));
+        blob->info = info;
+        memcpy(blob->entries.name, info.name, sizeof(blob->entries.name));
+        blob->entries.size = info.size;
+
+        len = sizeof(blob->entries) + info.size;
+        if (getsockopt(fd, IPPROTO_IP, IPT_SO_GET_ENTRIES, &blob->entries,
+                    &len) == 0) {
+            p->wr_pos = size;
+            break;
+        }
+
+        free(p);
+        p = NULL;
+        if (errno != EAGAIN) {
+            break;
+        }
+
+        len = sizeof(info);
+        if (getsockopt(fd, IPPROTO_IP, IPT_SO_GET_INFO, &info, &len) == -1) {
+            break;
+        }
+    }
+
+    close(fd);
+    return p;
+}
+
+static char *ipt_port(const uint16_t *pts, char *buf, size_t size) {
+    if (pts[0] == 0 && pts[1] == 0xffff) {
+        // The default "any port" range
+        return NULL;
+    }
+    if (pts[0] == pts[1]) {
+        snprintf(buf, size, "%u", pts[0]);
+    } else {
+        snprintf(buf, size, "%u:%u", pts[0], pts[1]);
+    }
+    return buf;
+}
+
+/**
+ * Walk all the rules in a recorded table and extract their details.
+ * The chain names and the rule matches are decoded to produce the same
+ * linedata as parsing the iptables-save output would have.
+ * @param p is a strbuf containing a struct ipt_blob
+ * @param cb is called for each rule found
+ * @param arg is passed unchanged to the callback
+ * @return the number of table entries walked, or -1 if the data is malformed
+ */
+int ipt_parse_entries(strbuf_t *p, linedata_cb_t cb, void *arg) {
+    if (!p || sb_len(p) < sizeof(struct ipt_blob)) {
+        return -1;
+    }
+
+    struct ipt_blob *blob = (struct ipt_blob *)p->str;
+    unsigned int size = blob->entries.size;
+
+    if (sb_len(p) - sizeof(struct ipt_blob) < size) {
+        return -1;
+    }
+
+    unsigned char *base = (unsigned char *)blob->entries.entrytable;
+    unsigned int offset = 0;
+    char *chain = NULL;
+    int nr = 0;
+
+    while (offset + sizeof(struct ipt_entry) <= size) {
+        struct ipt_entry *e = (struct ipt_entry *)(base + offset);
+
+        if (e->next_offset < sizeof(struct ipt_entry) ||
+                e->next_offset > size - offset ||
+                e->target_offset < sizeof(struct ipt_entry) ||
+                e->target_offset + sizeof(struct xt_entry_target) >
+                e->next_offset) {
+            return -1;
+        }
+        nr++;
+
+        int policy = 0;
+        for (int hook = 0; hook < NF_INET_NUMHOOKS; hook++) {
+            if (!(blob->info.valid_hooks & (1 << hook))) {
+                continue;
+            }
+            if (offset == blob->info.hook_entry[hook]) {
+                chain = (char *)hook_names[hook];
+            }
+            if (offset == blob->info.underflow[hook]) {
+                policy = 1;
+            }
+        }
+
+        struct xt_entry_target *t =
+            (struct xt_entry_target *)(base + offset + e->target_offset);
+
+        if (strcmp(t->u.user.name, XT_ERROR_TARGET) == 0) {
+            // Either the start of a user chain or the end of the table
+            struct xt_error_target *error = (struct xt_error_target *)t;
+            error->errorname[sizeof(error->errorname) - 1] = 0;
+            chain = error->errorname;
+            offset += e->next_offset;
+            continue;
+        }
+
+        if (policy) {
+            // Builtin chain policies are not rules
+            offset += e->next_offset;
+            continue;
+        }
+
+        char packets[24];
+        char bytes[24];
+        char proto[8];
+        char port[12];
+        struct linedata d;
+
+        snprintf(packets, sizeof(packets), "%llu",
+                (unsigned long long)e->counters.pcnt);
+        snprintf(bytes, sizeof(bytes), "%llu",
+                (unsigned long long)e->counters.bcnt);
+        d.packets = acct_slice(packets);
+        d.bytes = acct_slice(bytes);
+        d.chain = acct_slice(chain);
+        d.proto = acct_slice(
+            acct_proto_name(e->ip.proto, proto, sizeof(proto))
+        );
+        d.port = acct_slice(NULL);
+        d.matched = 0;
+
+        unsigned int match_offset = sizeof(struct ipt_entry);
+        while (match_offset + sizeof(struct xt_entry_match) <=
+                e->target_offset) {
+            struct xt_entry_match *m =
+                (struct xt_entry_match *)(base + offset + match_offset);
+
+            if (m->u.match_size < sizeof(struct xt_entry_match) ||
+                    m->u.match_size > e->target_offset - match_offset) {
+                return -1;
+            }
+            size_t datasize = m->u.match_size - sizeof(struct xt_entry_match);
+
+            // The tcp and udp matches share the same port layout and
+            // iptables-save shows the sport before the dport
+            if ((strcmp(m->u.user.name, "tcp") == 0 &&
+                    datasize >= sizeof(struct xt_tcp)) ||
+                    (strcmp(m->u.user.name, "udp") == 0 &&
+                    datasize >= sizeof(struct xt_udp))) {
+                struct xt_udp *ports = (struct xt_udp *)m->data;
+                if (!d.port.str) {
+                    d.port = acct_slice(
+                        ipt_port(ports->spts, port, sizeof(port))
+                    );
+                }
+                if (!d.port.str) {
+                    d.port = acct_slice(
+                        ipt_port(ports->dpts, port, sizeof(port))
+                    );
+                }
+            } else if (strcmp(m->u.user.name, "comment") == 0 &&
+                    datasize >= sizeof(struct xt_comment_info)) {
+                struct xt_comment_info *comment =
+                    (struct xt_comment_info *)m->data;
+                comment->comment[sizeof(comment->comment) - 1] = 0;
+
+                // Check if our tag is here
+                d.matched = (strstr(comment->comment, "ACCT")==NULL)?0:1;
+            }
+
+            match_offset += m->u.match_size;
+        }
+
+        cb(&d, arg);
+        offset += e->next_offset;
+    }
+
+    return nr;
+}
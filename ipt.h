@@ -0,0 +1,16 @@
+/** @file
+ * Internal interface definitions for the native ip_tables collector
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef IPT_H
+#define IPT_H
+
+#include "accounting.h"
+#include "strbuf.h"
+
+strbuf_t *ipt_get_entries(const char *);
+int ipt_parse_entries(strbuf_t *, linedata_cb_t, void *);
+#endif
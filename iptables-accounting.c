@@ -2,25 +2,149 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "accounting.h"
+#include "conntrack.h"
+#include "expo.h"
+#include "gz.h"
+#include "rope.h"
+#include "store.h"
+#include "tmpl.h"
 #include "strbuf.h"
 #include "connslot.h"
+#include "ipt.h"
+#include "iptsave.h"
+#include "nfnl.h"
+#include "nfacct.h"
+#include "nft.h"
 
-/* FIXME: globals */
+// The options, which are only set by argparser() before any threads start
 int service_port = 8088;
 #define MODE_SERVICE 1
 #define MODE_TEST 2
 #define MODE_DUMP 3
+#define MODE_RECORD 4
 int mode = MODE_SERVICE;
+#define COLLECTOR_SAVE 1
+#define COLLECTOR_IPT 2
+#define COLLECTOR_NFT 3
+#define COLLECTOR_NFACCT 4
+#define COLLECTOR_CONNTRACK 5
+int collector = COLLECTOR_SAVE;
+ct_keyspec_t conntrack_spec;
+int conntrack_spec_set = 0;
+unsigned int conntrack_slots = 1000;
+unsigned int topk_n = 0;
+// Track more keys than are reported, to keep the estimates accurate
+#define TOPK_COUNTERS_PER_RESULT 10
+int topk_metrics = 0;
+int parse_threads = 1;
+int cache_ttl = 10;
+int cache_max_stale = 10;
+int service_max_conns = 64;
+int service_threads = 1;
+int gzip_level = GZ_LEVEL_DEFAULT;
+int gzip_output = 0;
+#define FORMAT_TEXT 0
+#define FORMAT_OPENMETRICS 1
+#define FORMAT_PROTOBUF 2
+#define NR_FORMATS 3
+int output_format = FORMAT_TEXT;
+int use_memfd = 0;
+int use_stream = 0;
+int nft_table_family;
+char *nft_table = NULL;
+char *nft_chain = NULL;
+
+// The exposition formats, in the order that they are preferred when a
+// scraper accepts several of them equally
+struct format {
+    const char *name;
+    const char *media;
+    const char *content_type;
+} formats[NR_FORMATS] = {
+    [FORMAT_TEXT] = {
+        "text",
+        "text/plain",
+        "text/plain; version=0.0.4; charset=utf-8",
+    },
+    [FORMAT_OPENMETRICS] = {
+        "openmetrics",
+        "application/openmetrics-text",
+        "application/openmetrics-text; version=1.0.0; charset=utf-8",
+    },
+    [FORMAT_PROTOBUF] = {
+        "protobuf",
+        "application/vnd.google.protobuf",
+        "application/vnd.google.protobuf; "
+        "proto=io.prometheus.client.MetricFamily; encoding=delimited",
+    },
+};
+
+int format_parse(char *s) {
+    for (int i = 0; i < NR_FORMATS; i++) {
+        if (strcmp(s, formats[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parse a "family table [chain]" string, in the same order that the nft
+// command uses
+int nft_table_parse(char *s) {
+    char *saveptr;
+    char *family = strtok_r(s, " ", &saveptr);
+    char *table = strtok_r(NULL, " ", &saveptr);
+    char *chain = strtok_r(NULL, " ", &saveptr);
+
+    if (!family || !table || strtok_r(NULL, " ", &saveptr)) {
+        return -1;
+    }
+
+    nft_table_family = nft_family(family);
+    if (nft_table_family == -1) {
+        return -1;
+    }
+    nft_table = table;
+    nft_chain = chain;
+    return 0;
+}
+
+// Parse a whole number option that must be between min and max
+int parse_count(const char *s, unsigned int min, unsigned int max,
+        unsigned int *result) {
+    if (*s < '0' || *s > '9') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(s, &end, 10);
+    if (errno || *end || n < min || n > max) {
+        return -1;
+    }
+    *result = n;
+    return 0;
+}
 
 void argparser(int argc, char **argv) {
     int error = 0;
@@ -29,6 +153,23 @@ void argparser(int argc, char **argv) {
         {"port",    required_argument, 0,  'p' },
         {"test",    no_argument,       0,  't' },
         {"dump",    no_argument,       0,  'd' },
+        {"record",  no_argument,       0,  'r' },
+        {"collector", required_argument, 0,  'c' },
+        {"nft-table", required_argument, 0,  'n' },
+        {"conntrack-key", required_argument, 0,  'k' },
+        {"conntrack-slots", required_argument, 0,  's' },
+        {"topk",    required_argument, 0,  'K' },
+        {"topk-metrics", no_argument,  0,  'M' },
+        {"parse-threads", required_argument, 0,  'P' },
+        {"ttl",     required_argument, 0,  'T' },
+        {"max-stale", required_argument, 0,  'S' },
+        {"max-connections", required_argument, 0,  'C' },
+        {"threads", required_argument, 0,  'j' },
+        {"gzip-level", required_argument, 0,  'z' },
+        {"gzip",    no_argument,       0,  'Z' },
+        {"format",  required_argument, 0,  'F' },
+        {"memfd",   no_argument,       0,  'm' },
+        {"stream",  no_argument,       0,  'X' },
         {"help",    no_argument,       0,  'h' },
         {0,         0,                 0,  0 }
     };
@@ -36,7 +177,7 @@ void argparser(int argc, char **argv) {
     while (1) {
         int option_index = 0;
 
-        int c = getopt_long(argc, argv, "p:tdh", long_options, &option_index);
+        int c = getopt_long(argc, argv, "p:tdrc:n:k:s:K:MP:T:S:C:j:z:ZF:mXh", long_options, &option_index);
         if (c == -1)
             break;
 
@@ -51,6 +192,112 @@ void argparser(int argc, char **argv) {
             case 'd':
                 mode = MODE_DUMP;
                 break;
+            case 'r':
+                mode = MODE_RECORD;
+                break;
+            case 'c':
+                if (strcmp(optarg, "save") == 0) {
+                    collector = COLLECTOR_SAVE;
+                } else if (strcmp(optarg, "ipt") == 0) {
+                    collector = COLLECTOR_IPT;
+                } else if (strcmp(optarg, "nft") == 0) {
+                    collector = COLLECTOR_NFT;
+                } else if (strcmp(optarg, "nfacct") == 0) {
+                    collector = COLLECTOR_NFACCT;
+                } else if (strcmp(optarg, "conntrack") == 0) {
+                    collector = COLLECTOR_CONNTRACK;
+                } else {
+                    printf("Unknown collector %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'n':
+                if (nft_table_parse(optarg) != 0) {
+                    printf("Bad nft table %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'k':
+                if (ct_keyspec_parse(&conntrack_spec, optarg) != 0) {
+                    printf("Bad conntrack key %s\n", optarg);
+                    error++;
+                }
+                conntrack_spec_set = 1;
+                break;
+            case 's':
+                if (parse_count(optarg, 1, CT_SLOTS_MAX, &conntrack_slots) != 0) {
+                    printf("Bad conntrack slots %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'K':
+                if (parse_count(optarg, 0, TOPK_COUNTERS_MAX / TOPK_COUNTERS_PER_RESULT,
+                        &topk_n) != 0) {
+                    printf("Bad topk %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'M':
+                topk_metrics = 1;
+                break;
+            case 'P':
+                parse_threads = atoi(optarg);
+                if (parse_threads < 1 || parse_threads > IPTSAVE_THREADS_MAX) {
+                    printf("Bad parse threads %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'T':
+                cache_ttl = atoi(optarg);
+                if (cache_ttl < 1) {
+                    printf("Bad ttl %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'S':
+                cache_max_stale = atoi(optarg);
+                if (cache_max_stale < 0) {
+                    printf("Bad max stale %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'C':
+                service_max_conns = atoi(optarg);
+                if (service_max_conns < 1) {
+                    printf("Bad max connections %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'j':
+                service_threads = atoi(optarg);
+                if (service_threads < 1) {
+                    printf("Bad threads %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'z':
+                gzip_level = atoi(optarg);
+                if (gzip_level < 0 || gzip_level > 9) {
+                    printf("Bad gzip level %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'Z':
+                gzip_output = 1;
+                break;
+            case 'm':
+                use_memfd = 1;
+                break;
+            case 'X':
+                use_stream = 1;
+                break;
+            case 'F':
+                output_format = format_parse(optarg);
+                if (output_format == -1) {
+                    printf("Unknown format %s\n", optarg);
+                    error++;
+                }
+                break;
             case 'h':
                 printf("Usage:\n");
                 printf("    %s [args]\n", argv[0]);
@@ -65,322 +312,1762 @@ void argparser(int argc, char **argv) {
                 printf("Unknown option\n");
                 error++;
         }
+    }
 
-        if (optind < argc) {
-            printf("Unknown args\n");
-            error++;
-        }
+    if (optind < argc) {
+        printf("Unknown args\n");
+        error++;
     }
 
     if (error) {
         exit(1);
     }
+
+    if (!nft_table) {
+        // Static, as the parsed names are left pointing into it
+        static char default_table[] = "inet counting";
+        if (nft_table_parse(default_table) != 0) {
+            printf("Bad default nft table\n");
+            exit(1);
+        }
+    }
+
+    if ((topk_n || topk_metrics) && collector != COLLECTOR_CONNTRACK) {
+        printf("The topk options need the conntrack collector\n");
+        exit(1);
+    }
+    if (gzip_output && !gzip_level) {
+        printf("The gzip option needs a gzip level\n");
+        exit(1);
+    }
+    if (use_stream && collector != COLLECTOR_SAVE) {
+        printf("The stream option needs the save collector\n");
+        exit(1);
+    }
+    if (topk_metrics && !topk_n) {
+        printf("The topk-metrics option needs a topk size\n");
+        exit(1);
+    }
+
+    if (!conntrack_spec_set) {
+        char default_key[] = "src/24,dport";
+        ct_keyspec_parse(&conntrack_spec, default_key);
+    }
 }
 
-struct linedata {
-    char *packets;
-    char *bytes;
-    char *chain;
-    char *proto;
-    char *port;
-    int matched;
-    // -1 = bad syntax
-    // 0 = good syntax but not matched
-    // 1 = matched
-};
+/*
+ * The lines of the body are written with the sb_put() functions, into room
+ * reserved for each line, rather than with printf formatting
+ */
 
-struct linedata iptables_oneline(char *s) {
-    struct linedata d;
+// The room needed for a line from prom_put_sample()
+#define PROM_SAMPLE_MAX(name_len, labels_len) \
+    ((name_len) + (labels_len) + 4 + SB_U64_MAX)
+
+// Write a line with one number, and the labels if there are any
+void prom_put_sample(strbuf_t *p, const char *name, size_t len,
+        const char *labels, size_t labels_len, uint64_t val) {
+    sb_put(p, name, len);
+    if (labels_len) {
+        sb_put(p, SB_LIT("{"));
+        sb_put(p, labels, labels_len);
+        sb_put(p, SB_LIT("}"));
+    }
+    sb_put(p, SB_LIT(" "));
+    sb_put_u64(p, val);
+    sb_put(p, SB_LIT("\n"));
+}
 
-    if (*s != '[') {
-        d.matched = -1;
-        return d;
+// Append a line with one number to the body
+void prom_sample(rope_t *r, const char *name, size_t len,
+        const char *labels, size_t labels_len, uint64_t val) {
+    strbuf_t *p = rope_reserve(r, PROM_SAMPLE_MAX(len, labels_len));
+    if (p) {
+        prom_put_sample(p, name, len, labels, labels_len, val);
+        rope_commit(r);
     }
+}
 
-    s++;
+// Append a line with one number and no labels to the body
+void prom_value(rope_t *r, const char *name, size_t len, uint64_t val) {
+    prom_sample(r, name, len, NULL, 0, val);
+}
 
-    d.packets = strtok(s,":");
-    d.bytes = strtok(NULL,"]");
-    d.chain = NULL;
-    d.proto = NULL;
-    d.port = NULL;
-    d.matched = 0;
+void prom_header(rope_t *r) {
+    rope_append(r, SB_LIT(
+        "# TYPE iptables_acct_packets_total counter\n"
+        "# TYPE iptables_acct_bytes_total counter\n"
+    ));
+}
 
-    char *opt;
+// Missing values have always been shown by printf as "(null)"
+slice_t prom_slice(slice_t s) {
+    if (!s.str) {
+        return (slice_t){ "(null)", 6 };
+    }
+    return s;
+}
 
-    while ((opt = strtok(NULL," ")) != NULL) {
-        optarg = NULL;
+// Format the labels for one of the stored rules, replacing the contents
+// of the strbuf, or return -1 if they do not fit
+int prom_store_labels(store_t *st, unsigned int i, strbuf_t **pp) {
+    slice_t chain = prom_slice(store_label(st, st->chain[i]));
+    slice_t proto = prom_slice(store_label(st, st->proto[i]));
+    slice_t port = prom_slice(store_label(st, st->port[i]));
+
+    sb_zero(*pp);
+    size_t len = sizeof("chain=\"\",proto=\"\",port=\"\"") - 1;
+    strbuf_t *p = sb_reserve(pp, len + chain.len + proto.len + port.len);
+    if (!p) {
+        return -1;
+    }
+    sb_put(p, SB_LIT("chain=\""));
+    sb_put(p, chain.str, chain.len);
+    sb_put(p, SB_LIT("\",proto=\""));
+    sb_put(p, proto.str, proto.len);
+    sb_put(p, SB_LIT("\",port=\""));
+    sb_put(p, port.str, port.len);
+    sb_put(p, SB_LIT("\""));
+    return 0;
+}
 
-        if (*opt != '-') {
-            // We dont understand this, skip it
-            continue;
+// Space for the labels of one rule, which is only grown for very long ones,
+// up to the longest line that a segment of the body can take
+strbuf_t *prom_labels_malloc(void) {
+    strbuf_t *labels = sb_malloc(256);
+    if (!labels) {
+        abort();
+    }
+    labels->capacity_max = ROPE_SEG_SIZE;
+    return labels;
+}
+
+// Fill a template with the text for the stored rules, leaving holes for
+// the packets and bytes of each rule
+void prom_store_tmpl(store_t *st, tmpl_t *t) {
+    strbuf_t *labels = prom_labels_malloc();
+    for (unsigned int i = 0; i < st->nr_rows; i++) {
+        if (prom_store_labels(st, i, &labels) != 0) {
+            // Leaving the template invalid will cause a rebuild
+            t->fingerprint = 0;
+            break;
         }
-        opt++;
+        int len = sb_len(labels);
 
-        if (*opt == '-') {
-            // a long opt
-            opt++;
-            if (strcmp("dport",opt)==0) {
-                char *dport = strtok(NULL," ");
-                if (!d.port) {
-                    d.port = dport;
-                }
-            } else if (strcmp("sport",opt)==0) {
-                char *sport = strtok(NULL," ");
-                if (!d.port) {
-                    d.port = sport;
-                }
-            } else if (strcmp("comment",opt)==0) {
-                char *comment = strtok(NULL," ");
-                // TODO: doesnt handle comments with spaces
+        tmpl_printf(t, "iptables_acct_packets_total{%.*s} ", len, labels->str);
+        tmpl_hole(t);
+        tmpl_printf(t, "\niptables_acct_bytes_total{%.*s} ", len, labels->str);
+        tmpl_hole(t);
+        tmpl_printf(t, "\n");
+    }
+    free(labels);
+}
+
+// The body in one of the formats, with everything needed to send it
+typedef struct variant {
+    const struct iovec *vecs;   // the body, or NULL if it could not be made
+    int nr_vecs;
+    size_t len;
+    strbuf_t *body;         // the other formats are made in here
+    struct iovec vec;       // the one vector for them
+    strbuf_t *header;       // the reply header shared by every scrape
+    int fd;                 // a sealed memfd with the body, or -1
+} variant_t;
+
+/*
+ * One set of results.  Once it is published, nothing in a snapshot is
+ * changed except that each variant is filled in the first time it is
+ * asked for.  It is freed when the last reference to it is dropped, which
+ * might be by a worker that was still sending from it.
+ */
+typedef struct snapshot {
+    int refs;
+    unsigned long generation;
+    int64_t time;           // When the results were collected (clock_ms)
+    time_t timestamp;       // The wall clock time written into the body
+    int stale;              // The body has the stale marker on the end
+    rope_t *body;           // Only sent if it did not overflow
+    struct iovec *vecs;     // The segments of the body
+    int nr_vecs;
+    strbuf_t *topk;         // NULL unless --topk
+    variant_t *variant[NR_FORMATS][2];  // written once, see cache_variant()
+} snapshot_t;
+
+snapshot_t *snapshot_malloc(rope_t *body) {
+    snapshot_t *s = calloc(1, sizeof(snapshot_t));
+    if (!s) {
+        abort();
+    }
+    s->refs = 1;
+    s->body = body;
+    s->nr_vecs = rope_iovec(body, &s->vecs);
+    return s;
+}
 
-                // Check if our tag is here
-                d.matched = (strstr(comment, "ACCT")==NULL)?0:1;
+void snapshot_free(snapshot_t *s) {
+    for (int i = 0; i < NR_FORMATS; i++) {
+        for (int gzip = 0; gzip < 2; gzip++) {
+            variant_t *v = s->variant[i][gzip];
+            if (!v) {
+                continue;
             }
-            continue;
+            free(v->body);
+            free(v->header);
+            if (v->fd != -1) {
+                close(v->fd);
+            }
+            free(v);
         }
+    }
+    rope_free(s->body);
+    free(s->topk);
+    free(s);
+}
 
-        switch (*opt) {
-            case 'A':
-                d.chain = strtok(NULL," ");
-                break;
-            case 'p':
-                d.proto = strtok(NULL," ");
-                break;
-            case 'm': // module
-                strtok(NULL," ");
-                break;
-        }
+// Only called by a thread that already has a reference
+void snapshot_ref(snapshot_t *s) {
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
 
+void snapshot_unref(snapshot_t *s) {
+    if (s && __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        snapshot_free(s);
     }
-    return d;
 }
 
-void generate_prom(FILE *input, strbuf_t **pp) {
-    // [0:0] -A INPUT -f
-    // [501:38322] -A INPUT -p tcp -m tcp --dport 22 -m comment --comment "Failsafe SSH" -j ACCEPT
-    //
-    // table inet counting {
-    //   chain INPUT {
-    //     type filter hook input priority filter; policy accept;
-    //     tcp dport 22 counter packets 0 bytes 0
+// Called by connslot once a reply from the snapshot has been sent
+void snapshot_release(void *arg) {
+    snapshot_unref(arg);
+}
+
+// Part of a body that is sent to the scrapers while it is still being made
+typedef struct stream_part {
+    struct stream_part *next;   // NULL until the collector adds the next part
+    strbuf_t *chunk;        // Framed as an HTTP chunk, or NULL if abandoned
+    int last;
+} stream_part_t;
+
+/*
+ * The body of a refresh that is still running, with --stream.  The
+ * collector adds the parts as the rules are parsed, and each reply follows
+ * along behind it holding a reference, so the parts are kept until the
+ * slowest of them has finished.
+ */
+typedef struct stream {
+    int refs;
+    int done;               // The last part has been added
+    stream_part_t head;     // Has no chunk, the first part is head.next
+    stream_part_t *tail;    // Only used by the collector
+} stream_t;
+
+void stream_free(stream_t *st) {
+    stream_part_t *part = st->head.next;
+    while (part) {
+        stream_part_t *next = part->next;
+        free(part->chunk);
+        free(part);
+        part = next;
+    }
+    free(st);
+}
 
-    struct linedata d;
+// Only called by a thread that already has a reference
+void stream_ref(stream_t *st) {
+    __atomic_add_fetch(&st->refs, 1, __ATOMIC_RELAXED);
+}
 
-    sb_reprintf(pp,"# TYPE iptables_acct_packets_total counter\n");
-    sb_reprintf(pp,"# TYPE iptables_acct_bytes_total counter\n");
+void stream_unref(stream_t *st) {
+    if (st && __atomic_sub_fetch(&st->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        stream_free(st);
+    }
+}
 
-    char buf1[100];
-    int lines = 0;
+// Called by connslot once a streamed reply is finished with
+void stream_release(void *arg) {
+    stream_unref(arg);
+}
 
-    while (!feof(input)) {
-        char *s = (char *)&buf1;
-        *s = 0;
+/*
+ * In the service mode, the collector runs in the main thread and each
+ * worker thread serves its own pool of connections.  The collector keeps
+ * all of the state for making the results to itself, and hands each new
+ * set to the workers as a snapshot.
+ */
 
-        if (fgets(s, sizeof(buf1), input) == NULL) {
-            break;
-        }
-        lines++;
+// How long the collector child is given before it is killed
+#define COLLECTOR_TIMEOUT 5
 
-        d = iptables_oneline(s);
+// Start a prefetch this long before it should be needed, in addition to
+// the time the refreshes are taking
+#define PREFETCH_MARGIN_MS 250
 
-        if (d.matched != 1) {
-            // We didnt match on this line, so skip output
-            continue;
-        }
+// Scrapes closer together than this are treated as one scrape
+#define CADENCE_MIN_MS 100
+
+// The background iptables-save child
+struct refresh {
+    pid_t pid;
+    int fd;             // The output from the child, or -1 if not running
+    int64_t started;
+    int64_t duration;   // Average time taken by a refresh
+    int lines;
+};
 
-        char buf2[100];
-        char *labels = (char *)&buf2;
-        snprintf(labels, sizeof(buf2),
-                "chain=\"%s\",proto=\"%s\",port=\"%s\"",
-                d.chain, d.proto, d.port);
+struct cadence {
+    int64_t last;       // When the latest scrape arrived
+    int64_t interval;   // Average time between scrapes
+    int samples;
+};
 
-        sb_reprintf(pp,"iptables_acct_packets_total{%s} %s\n",
-                labels,
-                d.packets
-        );
-        sb_reprintf(pp,"iptables_acct_bytes_total{%s} %s\n",
-                labels,
-                d.bytes
-        );
+// Everything that the collector changes, which only its thread looks at
+typedef struct collector {
+    store_t *store;         // The counters from the latest refresh
+    strbuf_t *save_buf;     // Kept between refreshes, so it grows only once
+    tmpl_t *tmpl;
+    unsigned long tmpl_hits;
+    unsigned long tmpl_misses;
+    ct_agg_t *conntrack_agg;
+    strbuf_t *topk;
+    time_t inject_now;      // Set when replaying a recording for the tests
+    FILE *inject_input;
+    rope_t *body;           // The results being made
+    time_t timestamp;       // The wall clock time written into the body
+    unsigned long generation;
+    snapshot_t *current;    // The latest published results
+    stream_t *stream;       // The body being streamed, or NULL
+    unsigned int streamed;  // How much of the body is in the stream
+    unsigned int stream_rows;   // How many stored rows are in the body
+    struct refresh refresh;
+    struct cadence cadence;
+} collector_t;
+
+struct exporter;
+
+typedef struct worker {
+    pthread_t thread;
+    struct exporter *exporter;
+    slots_t *slots;         // Only made and used by the worker thread
+    int port;
+    int wake_fd;            // Written when the requests waiting can go on
+    int woken;
+    snapshot_t *next;       // A reference handed over by the collector
+    snapshot_t *snap;       // The latest snapshot, only used by this worker
+    stream_t *stream_next;  // Like next, for a body that is being streamed
+    stream_t *stream;
+} worker_t;
+
+typedef struct exporter {
+    collector_t collector;
+    int poke_fd;            // Written by a worker to wake the collector
+    int64_t scrape;         // When the latest scrape arrived
+    int wanted;             // A worker found the results too old
+    int refreshing;         // The collector child is running
+    int nr_workers;
+    worker_t *workers;
+    // The first scrape to want a variant of a snapshot makes it, holding
+    // this lock.  The expo history is also kept under it
+    pthread_mutex_t render_lock;
+    expo_t *expo;
+    unsigned long expo_generation;
+} exporter_t;
+
+// The labels are only formatted again when the accounting rules change,
+// otherwise the cached text just has the new counters written into it
+void prom_store(collector_t *c, rope_t *r) {
+    if (!c->tmpl) {
+        c->tmpl = tmpl_malloc();
+        if (!c->tmpl) {
+            abort();
+        }
+    }
+
+    store_t *st = c->store;
+    uint64_t fingerprint = store_fingerprint(st);
+    if (c->tmpl->valid && c->tmpl->fingerprint == fingerprint) {
+        c->tmpl_hits++;
+    } else {
+        c->tmpl_misses++;
+        tmpl_zero(c->tmpl, fingerprint);
+        prom_store_tmpl(st, c->tmpl);
+        c->tmpl->valid = c->tmpl->fingerprint == fingerprint;
+    }
+    if (!c->tmpl->valid) {
+        // The text did not all fit, so the results would not either
+        r->overflow = true;
+        return;
     }
 
-    sb_reprintf(pp,"iptables_read_lines %i\n", lines);
-    sb_reprintf(pp,"buffer_capacity_bytes %i\n", (*pp)->capacity);
-    sb_reprintf(pp,"buffer_used_bytes %lu\n", sb_len(*pp));
+    const uint64_t *columns[] = { st->packets, st->bytes };
+    tmpl_render(c->tmpl, r, columns, 2);
 }
 
-// Rounds the given time up to the closest multiple of interval
-time_t time_round(time_t time, time_t interval) {
-    return ((time / interval) + 1) * interval;
+void prom_footer(collector_t *c, rope_t *r, int lines) {
+    prom_value(r, SB_LIT("iptables_read_lines"), lines);
+    prom_value(r, SB_LIT("buffer_capacity_bytes"), rope_capacity(r));
+    prom_value(r, SB_LIT("buffer_used_bytes"), r->len);
+    // This body is not finished, so the size is from the one before it
+    variant_t *gz = NULL;
+    if (c->current) {
+        gz = __atomic_load_n(&c->current->variant[FORMAT_TEXT][1], __ATOMIC_ACQUIRE);
+    }
+    prom_value(r, SB_LIT("buffer_gzip_used_bytes"), gz && gz->vecs ? gz->len : 0);
 }
 
-// FIXME: globals
-time_t p_expires = 0;
-time_t inject_now = 0;
-FILE *inject_input = NULL;
+void prom_timestamp(collector_t *c, rope_t *r, time_t now) {
+    prom_value(r, SB_LIT("buffer_timestamp"), now);
+    c->timestamp = now;
+}
 
-void cache_generate_prom(strbuf_t **pp) {
-    time_t now = time(NULL);
-    if (now >= p_expires) {
-        // Refresh the cache
-        sb_zero(*pp);
-        p_expires = time_round(now,10);
-
-        FILE *input;
-        if (inject_now) {
-            // Effectively mock the iptables-save command for automated tests
-            now = inject_now;
-            input = inject_input;
-        } else {
-            input = popen("/sbin/iptables-save -c -t raw", "r");
+void store_init(collector_t *c) {
+    if (!c->store) {
+        c->store = store_malloc();
+        if (!c->store) {
+            abort();
         }
-        generate_prom(input, pp);
-        sb_reprintf(pp, "buffer_timestamp %li\n", now);
+    }
+    store_zero(c->store);
+}
 
-        if (inject_now) {
-            fclose(input);
-        } else {
-            pclose(input);
+// Render the rows added to the store since the last call, without using
+// the template, for a body that is streamed while the rules are parsed
+void prom_store_rows(collector_t *c, rope_t *r) {
+    store_t *st = c->store;
+    strbuf_t *labels = prom_labels_malloc();
+    for (; c->stream_rows < st->nr_rows; c->stream_rows++) {
+        unsigned int i = c->stream_rows;
+        if (prom_store_labels(st, i, &labels) != 0) {
+            r->overflow = true;
+            break;
         }
+
+        prom_sample(r, SB_LIT("iptables_acct_packets_total"),
+                labels->str, sb_len(labels), st->packets[i]);
+        prom_sample(r, SB_LIT("iptables_acct_bytes_total"),
+                labels->str, sb_len(labels), st->bytes[i]);
     }
+    free(labels);
 }
 
-void send_str(int fd, char *s) {
-    write(fd,s,strlen(s));
+// The lines after the counters, given the number of rules the collector
+// looked at or -1 if it failed
+void prom_store_end(collector_t *c, int lines, rope_t *r) {
+    rope_append(r, SB_LIT("# TYPE iptables_template_hits_total counter\n"));
+    prom_value(r, SB_LIT("iptables_template_hits_total"), c->tmpl_hits);
+    rope_append(r, SB_LIT("# TYPE iptables_template_misses_total counter\n"));
+    prom_value(r, SB_LIT("iptables_template_misses_total"), c->tmpl_misses);
+
+    if (lines < 0 || c->store->error) {
+        rope_append(r, SB_LIT("iptables_collector_error 1\n"));
+    }
+    if (lines < 0) {
+        lines = 0;
+    }
+
+    prom_footer(c, r, lines);
 }
 
-void http_request(conn_t *conn, strbuf_t **body) {
-    strbuf_t **pp = &conn->reply_header;
+// Render the counters found by a collector, given the number of rules it
+// looked at or -1 if it failed
+void generate_prom_store(collector_t *c, int lines, rope_t *r) {
+    prom_header(r);
+    prom_store(c, r);
+    prom_store_end(c, lines, r);
+}
 
-    if (strncmp("GET /metrics ",conn->request->str,13) != 0) {
-        sb_reprintf(pp, "HTTP/1.1 404 Not Found\r\n");
-        sb_reprintf(pp, "Content-Length: 0\r\n\r\n");
-        conn->reply = NULL;
-        goto out;
+#define SAVE_BUF_SIZE (64*1024)
+#define SAVE_BUF_MAX (16*1024*1024)
+
+void save_buf_init(collector_t *c) {
+    if (!c->save_buf) {
+        c->save_buf = sb_malloc(SAVE_BUF_SIZE);
+        if (c->save_buf) {
+            c->save_buf->capacity_max = SAVE_BUF_MAX;
+        }
     }
+}
 
-    cache_generate_prom(body);
+void generate_prom(collector_t *c, int fd, rope_t *r) {
+    // [0:0] -A INPUT -f
+    // [501:38322] -A INPUT -p tcp -m tcp --dport 22 -m comment --comment "Failsafe SSH" -j ACCEPT
 
-    if (!body) {
-        // We filled up the body strbuf
-        sb_reprintf(pp, "HTTP/1.1 500 overflow\r\n\r\n");
-        sb_reprintf(pp, "buffer_overflow 1\n");
-        conn->reply = NULL;
-        goto out;
+    save_buf_init(c);
+
+    int lines = -1;
+    if (c->save_buf) {
+        lines = iptsave_read(
+            fd,
+            &c->save_buf,
+            parse_threads,
+            store_add,
+            c->store
+        );
     }
 
-    conn->reply = *body;
-    sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
-    sb_reprintf(pp, "Content-Length: %lu\r\n\r\n", sb_len(conn->reply));
+    generate_prom_store(c, lines, r);
+}
 
-out:
-    // TODO: detect if pp overflowed
-    // if (!p) {
-    //     // We filled up the reply_header strbuf
-    //     send_str(conn->fd, "HTTP/1.0 500 \r\n\r\n");
-    //     conn_close(conn);
-    //     return body;
-    // }
+void generate_prom_ipt(collector_t *c, strbuf_t *blob, rope_t *r) {
+    // Each table entry is the equivalent of one iptables-save line
+    int entries = ipt_parse_entries(blob, store_add, c->store);
 
-    conn_write(conn);
+    generate_prom_store(c, entries, r);
 }
 
-#define NR_SLOTS 5
+// Open the netlink socket for the selected collector and start its dump
+int netlink_dump(void) {
+    switch (collector) {
+        case COLLECTOR_NFT:
+            return nft_dump_rules(nft_table_family, nft_table, nft_chain);
+        case COLLECTOR_NFACCT:
+            return nfacct_dump();
+        case COLLECTOR_CONNTRACK:
+            return conntrack_dump();
+    }
+    return -1;
+}
 
-void mode_service(int port, strbuf_t **pp) {
-    slots_t *slots = slots_malloc(NR_SLOTS);
-    if (!slots) {
-        abort();
+void generate_prom_netlink(collector_t *c, int fd, rope_t *r) {
+    // Each rule or object is the equivalent of one iptables-save line
+    int nr = -1;
+    if (fd != -1) {
+        switch (collector) {
+            case COLLECTOR_NFT:
+                nr = nft_read_rules(fd, store_add, c->store);
+                break;
+            case COLLECTOR_NFACCT:
+                nr = nfacct_read(fd, store_add, c->store);
+                break;
+        }
     }
 
-    if (slots_listen_tcp(slots, port)!=0) {
-        perror("slots_listen_tcp");
-        exit(1);
+    generate_prom_store(c, nr, r);
+}
+
+void generate_topk(ct_agg_t *agg, strbuf_t **pp) {
+    topk_t *t = agg->topk;
+
+    int32_t *order = malloc(topk_n * sizeof(int32_t));
+    strbuf_t *labels = sb_malloc(256);
+    if (!order || !labels) {
+        abort();
     }
 
-    signal(SIGPIPE, SIG_IGN);
+    sb_reprintf(pp,"# TYPE conntrack_topk_bytes gauge\n");
+    sb_reprintf(pp,"# TYPE conntrack_topk_bytes_error gauge\n");
 
-    int running = 1;
-    while (running) {
-        fd_set readers;
-        fd_set writers;
-        FD_ZERO(&readers);
-        FD_ZERO(&writers);
-        int fdmax = slots_fdset(slots, &readers, &writers);
+    unsigned int n = topk_sorted(t, order, topk_n);
+    for (unsigned int i = 0; i < n; i++) {
+        topk_counter_t *c = &t->counters[order[i]];
+        ct_key_t key;
+        memcpy(&key, topk_key(t, order[i]), sizeof(key));
 
-        struct timeval tv;
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
+        sb_zero(labels);
+        ct_labels(agg, &key, labels);
 
-        int nr = select(fdmax+1, &readers, &writers, NULL, &tv);
+        sb_reprintf(pp,"conntrack_topk_bytes{rank=\"%u\",%s} %" PRIu64 "\n",
+                i + 1, labels->str, c->count);
+        sb_reprintf(pp,"conntrack_topk_bytes_error{rank=\"%u\",%s} %" PRIu64 "\n",
+                i + 1, labels->str, c->error);
+    }
+    sb_reprintf(pp,"conntrack_topk_total_bytes %" PRIu64 "\n", t->total);
 
-        if (nr == -1) {
-            perror("select");
-            exit(1);
+    free(labels);
+    free(order);
+}
+
+// The largest output for one aggregated key, and the room needed after the
+// last key for the remaining lines
+#define CONNTRACK_ENTRY_MAX 768
+#define CONNTRACK_RESERVE 512
+
+void generate_prom_conntrack(collector_t *c, int fd, rope_t *r) {
+    if (!c->conntrack_agg) {
+        c->conntrack_agg = ct_agg_malloc(&conntrack_spec, conntrack_slots);
+        if (!c->conntrack_agg) {
+            abort();
+        }
+        if (topk_n) {
+            c->conntrack_agg->topk = topk_malloc(
+                    topk_n * TOPK_COUNTERS_PER_RESULT,
+                    sizeof(ct_key_t)
+            );
+            c->topk = sb_malloc(1000);
+            if (!c->conntrack_agg->topk || !c->topk) {
+                abort();
+            }
+            c->topk->capacity_max = 200000;
         }
-        if (nr == 0) {
-            // Must be a timeout
-            slots_closeidle(slots);
+    }
+    ct_agg_t *agg = c->conntrack_agg;
+    ct_agg_zero(agg);
+
+    // The flows are aggregated as they are read, without storing them
+    int flows = -1;
+    if (fd != -1) {
+        flows = conntrack_read(fd, agg);
+    }
+
+    rope_append(r, SB_LIT(
+        "# TYPE conntrack_acct_flows gauge\n"
+        "# TYPE conntrack_acct_packets gauge\n"
+        "# TYPE conntrack_acct_bytes gauge\n"
+    ));
+
+    strbuf_t *labels = sb_malloc(256);
+    if (!labels) {
+        abort();
+    }
+
+    for (unsigned int i = 0; i < agg->nr_used; i++) {
+        ct_entry_t *e = &agg->entries[i];
+
+        // Anything that would not fit in the output is counted as overflow
+        if (r->len + CONNTRACK_ENTRY_MAX + CONNTRACK_RESERVE > r->len_max) {
+            agg->overflow.flows += e->flows;
+            agg->overflow.packets += e->packets;
+            agg->overflow.bytes += e->bytes;
             continue;
         }
 
-        // There is at least one event waiting
-        int nr_ready = slots_fdset_loop(slots, &readers, &writers);
+        sb_zero(labels);
+        ct_labels(agg, &e->key, labels);
 
-        switch (nr_ready) {
-            case -1:
-                perror("accept");
-                exit(1);
+        size_t len = sb_len(labels);
+        prom_sample(r, SB_LIT("conntrack_acct_flows"), labels->str, len, e->flows);
+        prom_sample(r, SB_LIT("conntrack_acct_packets"), labels->str, len, e->packets);
+        prom_sample(r, SB_LIT("conntrack_acct_bytes"), labels->str, len, e->bytes);
+    }
+    free(labels);
 
-            case -2:
-                // No slots! - shouldnt happen, since we gate on nr_open
-                printf("no slots\n");
-                exit(1);
+    prom_value(r, SB_LIT("conntrack_acct_overflow_flows"), agg->overflow.flows);
+    prom_value(r, SB_LIT("conntrack_acct_overflow_packets"), agg->overflow.packets);
+    prom_value(r, SB_LIT("conntrack_acct_overflow_bytes"), agg->overflow.bytes);
 
-            case 0:
-                continue;
+    if (agg->topk) {
+        sb_zero(c->topk);
+        generate_topk(agg, &c->topk);
+
+        if (topk_metrics) {
+            rope_append(r, c->topk->str, sb_len(c->topk));
         }
+    }
 
-        for (int i=0; i<slots->nr_slots; i++) {
-            if (slots->conn[i].fd == -1) {
-                continue;
-            }
+    if (flows < 0) {
+        rope_append(r, SB_LIT("iptables_collector_error 1\n"));
+        flows = 0;
+    }
 
-            if (slots->conn[i].state == CONN_READY) {
-                http_request(&slots->conn[i], pp);
-            }
+    // Each flow is the equivalent of one iptables-save line
+    prom_footer(c, r, flows);
+}
+
+// The raw ip_tables data is never expected to be anywhere near this size
+#define IPT_BLOB_MAX (16*1024*1024)
+
+strbuf_t *collect_ipt(collector_t *c) {
+    if (!c->inject_now) {
+        return ipt_get_entries("raw");
+    }
+
+    // Replay a recording of the kernel data for automated tests
+    strbuf_t *blob = sb_malloc(1000);
+    if (blob) {
+        blob->capacity_max = IPT_BLOB_MAX;
+        if (sb_reread(&blob, fileno(c->inject_input)) == -1) {
+            free(blob);
+            blob = NULL;
         }
     }
+    fclose(c->inject_input);
+    return blob;
 }
 
-int main(int argc, char **argv) {
-    int outfd = 1;   // stdout
+// The largest body, and the largest copy of it in the other formats
+#define BODY_MAX (16*1024*1024)
 
-    argparser(argc, argv);
+// Start the body for a new set of results
+rope_t *collector_body(collector_t *c) {
+    if (!c->body) {
+        c->body = rope_malloc(BODY_MAX);
+        if (!c->body) {
+            abort();
+        }
+    }
+    rope_zero(c->body);
+    return c->body;
+}
+
+// Refresh the results by running the collector
+void cache_generate_prom(collector_t *c) {
+    time_t now = time(NULL);
 
-    // Create the cache buffer with a reasonable max size
-    strbuf_t *p = sb_malloc(1000);
-    p->capacity_max = 200000;
+    rope_t *r = collector_body(c);
+    store_init(c);
 
-    switch (mode) {
-        case MODE_SERVICE:
-            mode_service(service_port, &p);
-            break;
-        case MODE_TEST:
-            inject_now = 1644144574;
-            inject_input = stdin;
-        /* FALL THROUGH */
-        case MODE_DUMP: {
-            cache_generate_prom(&p);
+    if (c->inject_now) {
+        now = c->inject_now;
+    }
 
-            // TODO: detect overflow
-            // if (!p) {
-            //     send_str(outfd, "HTTP/1.0 500 overflow\n\nbuffer_overflow 1\n");
-            //     return -1;
-            // }
+    if (collector == COLLECTOR_IPT) {
+        strbuf_t *blob = collect_ipt(c);
+        generate_prom_ipt(c, blob, r);
+        free(blob);
+        prom_timestamp(c, r, now);
+        return;
+    }
+
+    if (collector == COLLECTOR_NFT || collector == COLLECTOR_NFACCT ||
+            collector == COLLECTOR_CONNTRACK) {
+        int fd;
+        if (c->inject_now) {
+            // Replay a recording of the netlink messages
+            fd = fileno(c->inject_input);
+        } else {
+            fd = netlink_dump();
+        }
+        if (collector == COLLECTOR_CONNTRACK) {
+            generate_prom_conntrack(c, fd, r);
+        } else {
+            generate_prom_netlink(c, fd, r);
+        }
+        prom_timestamp(c, r, now);
+
+        if (c->inject_now) {
+            fclose(c->inject_input);
+        } else if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    FILE *input;
+    if (c->inject_now) {
+        // Effectively mock the iptables-save command for automated tests
+        input = c->inject_input;
+    } else {
+        input = popen("/sbin/iptables-save -c -t raw", "r");
+    }
+    generate_prom(c, fileno(input), r);
+    prom_timestamp(c, r, now);
+
+    if (c->inject_now) {
+        fclose(input);
+    } else {
+        pclose(input);
+    }
+}
+
+void exporter_init(exporter_t *e) {
+    memset(e, 0, sizeof(exporter_t));
+    e->collector.generation = 1;
+    e->collector.refresh.fd = -1;
+    e->poke_fd = -1;
+    pthread_mutex_init(&e->render_lock, NULL);
+}
 
-            sb_write(outfd, p, 0, -1);
+// Let the workers answer the requests that were waiting
+void exporter_wake(exporter_t *e) {
+    uint64_t one = 1;
+    for (int i = 0; i < e->nr_workers; i++) {
+        if (write(e->workers[i].wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            // Already woken, and not yet read
+        }
+    }
+}
+
+/*
+ * Replace the current results with the body that the collector has made.
+ * The snapshot starts with a reference for each worker, which is passed
+ * over with an atomic exchange, so a worker only ever touches snapshots
+ * that it holds a reference to.
+ */
+void exporter_publish(exporter_t *e, int64_t time, int stale) {
+    collector_t *c = &e->collector;
+
+    snapshot_t *s = snapshot_malloc(c->body);
+    c->body = NULL;
+    s->generation = c->generation++;
+    s->time = time;
+    s->timestamp = c->timestamp;
+    s->stale = stale;
+    if (c->topk) {
+        s->topk = sb_malloc(sb_len(c->topk) + 1);
+        if (!s->topk) {
+            abort();
+        }
+        sb_append(s->topk, c->topk->str, sb_len(c->topk));
+    }
+
+    for (int i = 0; i < e->nr_workers; i++) {
+        snapshot_ref(s);
+        snapshot_t *old = __atomic_exchange_n(
+            &e->workers[i].next,
+            s,
+            __ATOMIC_ACQ_REL
+        );
+        // Replaced before the worker had a chance to look at it
+        snapshot_unref(old);
+    }
+    snapshot_unref(c->current);
+    c->current = s;
+
+    exporter_wake(e);
+}
+
+// Streamed parts are at least this big, apart from the last one
+#define STREAM_CHUNK_MIN (16*1024)
+
+// Add a part to the stream, and let the workers send it
+void stream_add(exporter_t *e, strbuf_t *chunk, int last) {
+    collector_t *c = &e->collector;
+    stream_t *st = c->stream;
+
+    stream_part_t *part = calloc(1, sizeof(stream_part_t));
+    if (!part) {
+        abort();
+    }
+    part->chunk = chunk;
+    part->last = last;
+    __atomic_store_n(&st->tail->next, part, __ATOMIC_RELEASE);
+    st->tail = part;
+
+    if (last) {
+        __atomic_store_n(&st->done, 1, __ATOMIC_RELEASE);
+        c->stream = NULL;
+        stream_unref(st);
+    }
+    exporter_wake(e);
+}
+
+// Start a new body, which is handed to the workers as it is made
+void stream_start(exporter_t *e) {
+    collector_t *c = &e->collector;
+
+    stream_t *st = calloc(1, sizeof(stream_t));
+    if (!st) {
+        abort();
+    }
+    st->refs = 1 + e->nr_workers;
+    st->tail = &st->head;
+    for (int i = 0; i < e->nr_workers; i++) {
+        stream_unref(__atomic_exchange_n(
+            &e->workers[i].stream_next,
+            st,
+            __ATOMIC_ACQ_REL
+        ));
+    }
+
+    c->stream = st;
+    c->streamed = 0;
+    c->stream_rows = 0;
+    prom_header(collector_body(c));
+
+    // The requests that were waiting can follow along now
+    exporter_wake(e);
+}
+
+// Pass the body made since the last part on to the stream
+void stream_flush(exporter_t *e, int last) {
+    collector_t *c = &e->collector;
+    rope_t *body = c->body;
+    unsigned int len = body->len - c->streamed;
+    if (!last && len < STREAM_CHUNK_MIN) {
+        return;
+    }
+
+    strbuf_t *chunk = sb_malloc(len + 32);
+    if (!chunk) {
+        abort();
+    }
+    if (len) {
+        // An empty chunk would be taken as the end of the body
+        sb_printf(chunk, "%x\r\n", len);
+        chunk->wr_pos += rope_copy(body, c->streamed, &chunk->str[chunk->wr_pos], len);
+        sb_append(chunk, "\r\n", 2);
+    }
+    if (last) {
+        sb_append(chunk, "0\r\n\r\n", 5);
+    }
+    c->streamed += len;
+    stream_add(e, chunk, last);
+}
+
+// Stop the stream without finishing the body, which the replies following
+// it can only show by closing the connection
+void stream_abandon(exporter_t *e) {
+    stream_add(e, NULL, 1);
+}
+
+// Render a snapshot in one of the other formats, with the render_lock held
+int cache_render(exporter_t *e, snapshot_t *s, int format, strbuf_t **pp) {
+    if (!e->expo) {
+        e->expo = expo_malloc(BODY_MAX);
+        if (!e->expo) {
+            return -1;
+        }
+    }
+    if (e->expo_generation != s->generation) {
+        if (e->expo_generation > s->generation) {
+            // The history has moved on past this snapshot
+            return -1;
+        }
+        if (expo_parse(e->expo, s->vecs, s->nr_vecs, s->timestamp) != 0) {
+            return -1;
+        }
+        e->expo_generation = s->generation;
+    }
+
+    if (format == FORMAT_OPENMETRICS) {
+        return expo_openmetrics(e->expo, pp);
+    }
+    return expo_protobuf(e->expo, pp);
+}
+
+// Write the part of the reply header that is the same for every scrape
+// of this variant
+void prom_reply_header(strbuf_t **pp, int format, int gzip, size_t len) {
+    sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
+    sb_reprintf(pp, "Content-Type: %s\r\n", formats[format].content_type);
+    sb_reprintf(pp, "Vary: Accept, Accept-Encoding\r\n");
+    if (gzip) {
+        sb_reprintf(pp, "Content-Encoding: gzip\r\n");
+    }
+    sb_reprintf(pp, "Content-Length: %lu\r\n", len);
+}
+
+// Write all of a variant to a blocking file descriptor
+// Returns 0 or -1 for error
+int variant_write(int fd, variant_t *v) {
+    for (int i = 0; i < v->nr_vecs; i++) {
+        const char *buf = v->vecs[i].iov_base;
+        size_t pos = 0;
+        while (pos < v->vecs[i].iov_len) {
+            ssize_t size = write(fd, &buf[pos], v->vecs[i].iov_len - pos);
+            if (size == -1 && errno == EINTR) {
+                continue;
+            }
+            if (size == -1) {
+                return -1;
+            }
+            pos += size;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Make a sealed memfd with the contents of a variant, for sending with
+ * sendfile().  A reply takes its own reference with dup(), so the file
+ * lives on for as long as a slow scraper is still being sent it.
+ * Returns -1 if memfd is not used or the file could not be made
+ */
+int cache_file(variant_t *v) {
+    if (!use_memfd) {
+        return -1;
+    }
+
+    int fd = memfd_create("iptables-accounting", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd != -1) {
+        int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+        if (variant_write(fd, v) == -1 ||
+                fcntl(fd, F_ADD_SEALS, seals) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    return fd;
+}
+
+// Make a variant of a snapshot, if it is not already made, with the
+// render_lock held
+variant_t *cache_variant_locked(exporter_t *e, snapshot_t *s, int format, int gzip) {
+    variant_t *v = s->variant[format][gzip];
+    if (v) {
+        return v;
+    }
+
+    v = calloc(1, sizeof(variant_t));
+    if (!v) {
+        return NULL;
+    }
+    v->fd = -1;
+
+    if (s->body->overflow) {
+        // Nothing is made from a body that is missing some of the results
+    } else if (format == FORMAT_TEXT && !gzip) {
+        // Sent straight from the segments of the body
+        v->vecs = s->vecs;
+        v->nr_vecs = s->nr_vecs;
+        v->len = s->body->len;
+    } else if (!gzip || gzip_level) {
+        v->body = sb_malloc(1000);
+        if (v->body) {
+            v->body->capacity_max = BODY_MAX;
+
+            int r;
+            if (gzip) {
+                variant_t *src = cache_variant_locked(e, s, format, 0);
+                r = src && src->vecs ? gz_compress(&v->body, src->vecs, src->nr_vecs, gzip_level) : -1;
+            } else {
+                r = cache_render(e, s, format, &v->body);
+            }
+            if (r != 0) {
+                // Served in another way instead
+                free(v->body);
+                v->body = NULL;
+            } else {
+                v->vec.iov_base = v->body->str;
+                v->vec.iov_len = sb_len(v->body);
+                v->vecs = &v->vec;
+                v->nr_vecs = 1;
+                v->len = sb_len(v->body);
+            }
+        }
+    }
+
+    if (v->vecs) {
+        v->header = sb_malloc(256);
+        if (v->header) {
+            v->header->capacity_max = 1000;
+            prom_reply_header(&v->header, format, gzip, v->len);
+        }
+        v->fd = cache_file(v);
+    }
+
+    __atomic_store_n(&s->variant[format][gzip], v, __ATOMIC_RELEASE);
+    return v;
+}
+
+/*
+ * Get a snapshot in the given format, optionally compressed with gzip.
+ * Each variant is only made the first time that a scraper asks for it,
+ * and then shared by all the replies that want it without any locking.
+ * Returns NULL if gzip is disabled or the variant could not be made
+ */
+variant_t *cache_variant(exporter_t *e, snapshot_t *s, int format, int gzip) {
+    variant_t *v = __atomic_load_n(&s->variant[format][gzip], __ATOMIC_ACQUIRE);
+    if (!v) {
+        pthread_mutex_lock(&e->render_lock);
+        v = cache_variant_locked(e, s, format, gzip);
+        pthread_mutex_unlock(&e->render_lock);
+    }
+    return v && v->vecs ? v : NULL;
+}
+
+// Pick the format that the scraper likes best, or the text format if it
+// does not say
+int accept_format(conn_t *conn) {
+    int best = FORMAT_TEXT;
+    int best_q = 0;
+    for (int i = 0; i < NR_FORMATS; i++) {
+        int q = conn_header_q(conn, "Accept", formats[i].media);
+        if (q > best_q) {
+            best = i;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+/*
+ * The iptables-save child is run in the background.  Its output is read
+ * and parsed by the collector as it arrives, so a slow child does not stop
+ * the workers from serving the other connections.  Requests that need the
+ * new data wait until the refresh is finished and are then all answered
+ * from the same snapshot.
+ *
+ * The times of the scrapes are tracked, so that the refresh can be started
+ * just before the next scrape is expected.  While a refresh is running,
+ * results up to cache_max_stale seconds past their TTL are still served.
+ */
+
+extern char **environ;
+
+// Milliseconds from an arbitrary start, which never goes backwards
+int64_t clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Add a sample to an exponentially weighted moving average
+int64_t ewma(int64_t avg, int64_t sample) {
+    return avg ? avg + (sample - avg) / 4 : sample;
+}
+
+// Learn the interval and phase of the scrapes
+void cadence_note(struct cadence *cadence, int64_t now) {
+    if (cadence->last && now - cadence->last < CADENCE_MIN_MS) {
+        return;
+    }
+    if (cadence->last) {
+        cadence->interval = ewma(cadence->interval, now - cadence->last);
+        cadence->samples++;
+    }
+    cadence->last = now;
+}
+
+// When to start refreshing the cache, before the next expected scrape
+// Returns zero if there is no need
+int64_t cadence_prefetch(collector_t *c, int64_t now) {
+    struct cadence *cadence = &c->cadence;
+    if (c->refresh.fd != -1 || cadence->samples < 2 || !c->current) {
+        return 0;
+    }
+    if (now - cadence->last > cadence->interval * 3) {
+        // The scrapes seem to have stopped
+        return 0;
+    }
+
+    // Find the first expected scrape that the cache will be too old for
+    int64_t expires = c->current->time + cache_ttl * 1000;
+    int64_t scrape = cadence->last + cadence->interval;
+    while (scrape < expires) {
+        scrape += cadence->interval;
+    }
+
+    int64_t prefetch = scrape - c->refresh.duration - PREFETCH_MARGIN_MS;
+
+    // Never refresh more often than the TTL
+    if (prefetch < c->refresh.started + cache_ttl * 1000) {
+        prefetch = c->refresh.started + cache_ttl * 1000;
+    }
+    return prefetch;
+}
+
+// Start the collector child, with a non-blocking pipe for its output
+int refresh_spawn(exporter_t *e) {
+    collector_t *c = &e->collector;
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+
+    char *argv[] = { "/sbin/iptables-save", "-c", "-t", "raw", NULL };
+    int r = posix_spawn(&c->refresh.pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    if (r != 0) {
+        close(fds[0]);
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    save_buf_init(c);
+    if (c->save_buf) {
+        sb_zero(c->save_buf);
+    }
+    store_init(c);
+
+    c->refresh.fd = fds[0];
+    c->refresh.lines = 0;
+    __atomic_store_n(&e->refreshing, 1, __ATOMIC_RELEASE);
+    if (use_stream) {
+        stream_start(e);
+    }
+    return 0;
+}
+
+// Stop reading from the collector child and reap it
+int refresh_stop(exporter_t *e, int sig) {
+    collector_t *c = &e->collector;
+    int status = 0;
+
+    if (sig) {
+        kill(c->refresh.pid, sig);
+    }
+    close(c->refresh.fd);
+    c->refresh.fd = -1;
+    waitpid(c->refresh.pid, &status, 0);
+    return status;
+}
+
+// Publish the results of the latest refresh
+void refresh_done(exporter_t *e) {
+    collector_t *c = &e->collector;
+    c->refresh.duration = ewma(c->refresh.duration, clock_ms() - c->refresh.started);
+    exporter_publish(e, c->refresh.started, 0);
+
+    // Only once the new results are there to be found
+    __atomic_store_n(&e->refreshing, 0, __ATOMIC_RELEASE);
+}
+
+// Replace the cache with the stored results, or just the error if the
+// collector failed
+void refresh_render(exporter_t *e, int lines) {
+    collector_t *c = &e->collector;
+    if (c->stream) {
+        if (lines >= 0) {
+            // Finish the body that has been streamed so far
+            prom_store_rows(c, c->body);
+            prom_store_end(c, lines, c->body);
+            prom_timestamp(c, c->body, time(NULL));
+            if (c->body->overflow) {
+                // Some of the results are missing from what was sent
+                stream_abandon(e);
+            } else {
+                stream_flush(e, 1);
+            }
+            refresh_done(e);
+            return;
+        }
+        stream_abandon(e);
+    }
+    if (lines < 0) {
+        store_zero(c->store);
+    }
+    rope_t *r = collector_body(c);
+    generate_prom_store(c, lines, r);
+    prom_timestamp(c, r, time(NULL));
+    refresh_done(e);
+}
+
+// Start refreshing the cache.  Only the save collector runs in the
+// background, the others are finished before this returns
+void refresh_start(exporter_t *e) {
+    collector_t *c = &e->collector;
+    c->refresh.started = clock_ms();
+
+    if (collector != COLLECTOR_SAVE) {
+        cache_generate_prom(c);
+        refresh_done(e);
+        return;
+    }
+
+    if (refresh_spawn(e) == -1) {
+        store_init(c);
+        refresh_render(e, -1);
+    }
+}
+
+void refresh_read(exporter_t *e) {
+    collector_t *c = &e->collector;
+    int r = -1;
+    if (c->save_buf) {
+        r = iptsave_feed(
+            c->refresh.fd,
+            &c->save_buf,
+            parse_threads,
+            &c->refresh.lines,
+            store_add,
+            c->store
+        );
+    }
+    if (r == 1) {
+        if (c->stream) {
+            prom_store_rows(c, c->body);
+            stream_flush(e, 0);
+        }
+        return;
+    }
+
+    int status = refresh_stop(e, r == -1 ? SIGKILL : 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        r = -1;
+    }
+    refresh_render(e, r == 0 ? c->refresh.lines : -1);
+}
+
+// Give up on a hung collector child, and keep serving the last good
+// results with a marker to show that they are stale
+void refresh_timeout(exporter_t *e) {
+    collector_t *c = &e->collector;
+    refresh_stop(e, SIGKILL);
+    __atomic_store_n(&e->refreshing, 0, __ATOMIC_RELEASE);
+    if (c->stream) {
+        stream_abandon(e);
+    }
+
+    if (!c->current) {
+        // There are no good results to keep
+        refresh_render(e, -1);
+        return;
+    }
+    if (!c->current->stale) {
+        snapshot_t *s = c->current;
+        rope_t *r = collector_body(c);
+        for (int i = 0; i < s->nr_vecs; i++) {
+            rope_append(r, s->vecs[i].iov_base, s->vecs[i].iov_len);
+        }
+        r->overflow |= s->body->overflow;
+        rope_append(r, SB_LIT("iptables_collector_stale 1\n"));
+        c->timestamp = c->current->timestamp;
+        exporter_publish(e, c->current->time, 1);
+    } else {
+        // Nothing new, but the waiting requests can have the stale results
+        exporter_wake(e);
+    }
+}
+
+// Start a refresh that a worker asked for, if the results are too old
+void collector_refresh(exporter_t *e) {
+    collector_t *c = &e->collector;
+    int64_t now = clock_ms();
+
+    // A failing collector is still only run once per TTL
+    if (c->refresh.fd == -1 &&
+            (!c->current || now >= c->current->time + cache_ttl * 1000) &&
+            (!c->refresh.started || now >= c->refresh.started + cache_ttl * 1000)) {
+        refresh_start(e);
+    }
+}
+
+// Tell the collector about a new scrape, and that the results are too old
+// if stale is true
+void exporter_scrape(exporter_t *e, int64_t now, int stale) {
+    int64_t last = __atomic_exchange_n(&e->scrape, now, __ATOMIC_RELAXED);
+    if (stale) {
+        __atomic_store_n(&e->wanted, 1, __ATOMIC_RELEASE);
+    }
+    if (stale || now - last >= CADENCE_MIN_MS) {
+        uint64_t one = 1;
+        if (write(e->poke_fd, &one, sizeof(one)) != sizeof(one)) {
+            // Already poked, and not yet read
+        }
+    }
+}
+
+// Pick up the latest snapshot that the collector has handed over
+snapshot_t *worker_snapshot(worker_t *w) {
+    if (__atomic_load_n(&w->next, __ATOMIC_ACQUIRE)) {
+        snapshot_t *next = __atomic_exchange_n(&w->next, NULL, __ATOMIC_ACQ_REL);
+        snapshot_unref(w->snap);
+        w->snap = next;
+    }
+    return w->snap;
+}
+
+// Find the snapshot to reply from, scrape is true for a new request (and
+// not one that was already waiting for a refresh)
+// Returns NULL if the reply needs to wait for the collector
+snapshot_t *worker_reply_snapshot(worker_t *w, int scrape) {
+    exporter_t *e = w->exporter;
+    snapshot_t *s = worker_snapshot(w);
+    int64_t now = clock_ms();
+
+    if (scrape) {
+        exporter_scrape(e, now, !s || now >= s->time + cache_ttl * 1000);
+    }
+
+    if (s && now < s->time + (cache_ttl + cache_max_stale) * 1000) {
+        // Either fresh, or not too stale to use while refreshing
+        return s;
+    }
+    if (scrape || __atomic_load_n(&e->refreshing, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return s;
+}
+
+// Pick up the latest stream that the collector has handed over, letting
+// go of it once it is finished
+stream_t *worker_stream(worker_t *w) {
+    if (__atomic_load_n(&w->stream_next, __ATOMIC_ACQUIRE)) {
+        stream_t *next = __atomic_exchange_n(&w->stream_next, NULL, __ATOMIC_ACQ_REL);
+        stream_unref(w->stream);
+        w->stream = next;
+    }
+    if (w->stream && __atomic_load_n(&w->stream->done, __ATOMIC_ACQUIRE)) {
+        stream_unref(w->stream);
+        w->stream = NULL;
+    }
+    return w->stream;
+}
+
+// Start a chunked reply that follows the body the collector is making
+// Returns false if there is no body being streamed
+int stream_reply(worker_t *w, conn_t *conn) {
+    if (!use_stream || !conn_slice_is(conn, conn->http->version, "HTTP/1.1")) {
+        return 0;
+    }
+    stream_t *st = worker_stream(w);
+    if (!st) {
+        return 0;
+    }
+
+    stream_ref(st);
+    conn->reply_release = stream_release;
+    conn->reply_owner = st;
+    conn->reply_more = &st->head;
+
+    // The header goes out straight away, before any of the body
+    strbuf_t **pp = &conn->reply_header;
+    sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
+    sb_reprintf(pp, "Content-Type: %s\r\n", formats[FORMAT_TEXT].content_type);
+    sb_reprintf(pp, "Vary: Accept, Accept-Encoding\r\n");
+    sb_reprintf(pp, "Transfer-Encoding: chunked\r\n");
+    sb_reprintf(
+        pp,
+        "Connection: %s\r\n\r\n",
+        conn->keepalive ? "keep-alive" : "close"
+    );
+    conn_write(conn);
+    return 1;
+}
+
+// Send the next part of a streamed reply once the collector has made it.
+// The next part is only given once the last one has been sent, so a slow
+// scraper is not sent more than the socket will take
+void stream_continue(conn_t *conn) {
+    stream_part_t *part = conn->reply_more;
+    stream_part_t *next = __atomic_load_n(&part->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        conn->state = CONN_WAITING;
+        return;
+    }
+    if (!next->chunk) {
+        // Without the last chunk, the scraper knows the body is incomplete
+        conn->state = CONN_EMPTY;
+        return;
+    }
+
+    conn->reply = next->chunk;
+    conn->reply_more = next->last ? NULL : next;
+    conn_write(conn);
+}
+
+void send_str(int fd, char *s) {
+    write(fd,s,strlen(s));
+}
+
+// Keep the snapshot until the reply from it has been sent
+void reply_snapshot(conn_t *conn, snapshot_t *s) {
+    snapshot_ref(s);
+    conn->reply_release = snapshot_release;
+    conn->reply_owner = s;
+}
+
+void http_request(conn_t *conn, void *arg) {
+    worker_t *w = arg;
+    if (conn->reply_more) {
+        stream_continue(conn);
+        return;
+    }
+
+    strbuf_t **pp = &conn->reply_header;
+    int get = conn_slice_is(conn, conn->http->method, "GET");
+    snapshot_t *s;
+
+    if (topk_n && get && conn_slice_is(conn, conn->http->path, "/topk")) {
+        s = worker_reply_snapshot(w, conn->state == CONN_READY);
+        if (!s) {
+            // Leave the request waiting for the refresh
+            conn->state = CONN_WAITING;
+            return;
+        }
+
+        conn->reply = s->topk;
+        reply_snapshot(conn, s);
+        sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
+        sb_reprintf(pp, "Content-Length: %lu\r\n", sb_len(conn->reply));
+        goto out;
+    }
+
+    if (!get || !conn_slice_is(conn, conn->http->path, "/metrics")) {
+        sb_reprintf(pp, "HTTP/1.1 404 Not Found\r\n");
+        sb_reprintf(pp, "Content-Length: 0\r\n");
+        conn->reply = NULL;
+        goto out;
+    }
+
+    s = worker_reply_snapshot(w, conn->state == CONN_READY);
+    if (!s) {
+        if (!stream_reply(w, conn)) {
+            // Leave the request waiting for the refresh
+            conn->state = CONN_WAITING;
+        }
+        return;
+    }
+
+    if (s->body->overflow) {
+        // Some of the results did not fit in the body, so rather than
+        // send it without them, say so.  The reply has no length, so the
+        // end of the connection is the end of the reply
+        conn->keepalive = 0;
+        sb_reprintf(pp, "HTTP/1.1 500 overflow\r\n");
+        sb_reprintf(pp, "Connection: close\r\n\r\n");
+        sb_reprintf(pp, "buffer_overflow 1\n");
+        conn->reply = NULL;
+        goto send;
+    }
+
+    int format = accept_format(conn);
+    if (!cache_variant(w->exporter, s, format, 0)) {
+        // The text format can always be sent
+        format = FORMAT_TEXT;
+    }
+    int gzip = conn_header_q(conn, "Accept-Encoding", "gzip") > 0 &&
+        cache_variant(w->exporter, s, format, 1);
+
+    // Only the Connection header is left for this connection to add
+    // (only the plain text can be missing, if there was no memory for it)
+    variant_t *v = cache_variant(w->exporter, s, format, gzip);
+    conn->reply = NULL;
+    conn->reply_vecs = v ? v->vecs : s->vecs;
+    conn->reply_nr_vecs = v ? v->nr_vecs : s->nr_vecs;
+    conn->shared_header = v ? v->header : NULL;
+    if (!conn->shared_header) {
+        prom_reply_header(pp, format, gzip, v ? v->len : s->body->len);
+    }
+    reply_snapshot(conn, s);
+
+    if (v && v->fd != -1) {
+        conn->reply_file = dup(v->fd);
+    }
+    if (conn->reply_file != -1) {
+        conn->reply_file_len = v->len;
+        conn->reply_vecs = NULL;
+        conn->reply_nr_vecs = 0;
+    }
+
+out:
+    sb_reprintf(
+        pp,
+        "Connection: %s\r\n\r\n",
+        conn->keepalive ? "keep-alive" : "close"
+    );
+
+send:
+    // TODO: detect if pp overflowed
+    // if (!p) {
+    //     // We filled up the reply_header strbuf
+    //     send_str(conn->fd, "HTTP/1.0 500 \r\n\r\n");
+    //     conn_close(conn);
+    //     return body;
+    // }
+
+    conn_write(conn);
+}
+
+// The pool starts this size, and grows up to --max-connections
+#define NR_SLOTS 5
+
+// Make the pool of connections, in the worker thread that uses it, as an
+// io_uring ring can only be entered by the thread that set it up
+void worker_slots(worker_t *w) {
+    exporter_t *e = w->exporter;
+    w->slots = slots_malloc(NR_SLOTS);
+    if (!w->slots) {
+        abort();
+    }
+    if (service_max_conns > w->slots->max_slots) {
+        w->slots->max_slots = service_max_conns;
+    }
+
+    // Each worker has its own listen socket, and the kernel shares the
+    // new connections between them
+    w->slots->reuseport = e->nr_workers > 1;
+    if (slots_listen_tcp(w->slots, w->port)!=0) {
+        perror("slots_listen_tcp");
+        exit(1);
+    }
+
+    if (slots_watch(w->slots, w->wake_fd, &w->woken) != 0) {
+        perror("slots_watch");
+        exit(1);
+    }
+}
+
+void *worker_main(void *arg) {
+    worker_t *w = arg;
+    worker_slots(w);
+
+    while (1) {
+        int nr = slots_wait(w->slots, 5000, http_request, w);
+
+        switch (nr) {
+            case -1:
+                perror("slots_wait");
+                exit(1);
+
+            case -2:
+                // No slots! - shouldnt happen, since we gate on nr_open
+                printf("no slots\n");
+                exit(1);
+
+            case 0:
+                // Must be a timeout
+                slots_closeidle(w->slots);
+        }
+
+        if (w->woken) {
+            // Answer the requests that were waiting for the collector
+            uint64_t count;
+            w->woken = 0;
+            if (read(w->wake_fd, &count, sizeof(count)) == sizeof(count)) {
+                slots_foreach(w->slots, CONN_WAITING, http_request, w);
+            }
+        }
+    }
+    return NULL;
+}
+
+void worker_start(exporter_t *e, worker_t *w, int port) {
+    w->exporter = e;
+    w->port = port;
+
+    // Made here, as the collector can wake the worker straight away
+    w->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (w->wake_fd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+void mode_service(exporter_t *e, int port) {
+    collector_t *c = &e->collector;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    e->poke_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (e->poke_fd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    e->nr_workers = service_threads;
+    e->workers = calloc(e->nr_workers, sizeof(worker_t));
+    if (!e->workers) {
+        abort();
+    }
+    for (int i = 0; i < e->nr_workers; i++) {
+        worker_start(e, &e->workers[i], port);
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = e->poke_fd, .events = POLLIN },
+        { .fd = -1, .events = POLLIN },
+    };
+
+    int running = 1;
+    while (running) {
+        int64_t now = clock_ms();
+        int64_t wake = now + 5000;
+
+        if (c->refresh.fd != -1) {
+            // Wake up in time to enforce the collector timeout
+            int64_t deadline = c->refresh.started + COLLECTOR_TIMEOUT * 1000;
+            wake = (deadline < wake) ? deadline : wake;
+        }
+
+        int64_t prefetch = cadence_prefetch(c, now);
+        if (prefetch) {
+            wake = (prefetch < wake) ? prefetch : wake;
+        }
+
+        // Ignored by poll() while there is no refresh running
+        fds[1].fd = c->refresh.fd;
+        int nr = poll(fds, 2, (wake > now) ? wake - now : 0);
+        if (nr == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+
+        int wanted = 0;
+        if (nr > 0 && fds[0].revents) {
+            uint64_t count;
+            if (read(e->poke_fd, &count, sizeof(count)) == sizeof(count)) {
+                cadence_note(&c->cadence, __atomic_load_n(&e->scrape, __ATOMIC_RELAXED));
+                wanted = __atomic_exchange_n(&e->wanted, 0, __ATOMIC_ACQ_REL);
+            }
+        }
+
+        if (c->refresh.fd != -1) {
+            if (nr > 0 && fds[1].revents) {
+                refresh_read(e);
+            } else if (clock_ms() >= c->refresh.started + COLLECTOR_TIMEOUT * 1000) {
+                refresh_timeout(e);
+            }
+        } else if (wanted) {
+            collector_refresh(e);
+        } else {
+            prefetch = cadence_prefetch(c, clock_ms());
+            if (prefetch && clock_ms() >= prefetch) {
+                refresh_start(e);
+            }
+        }
+
+        if (wanted && c->refresh.fd == -1) {
+            // No refresh is running, so the waiting requests get what the
+            // workers already have
+            exporter_wake(e);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int outfd = 1;   // stdout
+
+    argparser(argc, argv);
+
+    exporter_t *e = malloc(sizeof(exporter_t));
+    if (!e) {
+        abort();
+    }
+    exporter_init(e);
+
+    switch (mode) {
+        case MODE_SERVICE:
+            mode_service(e, service_port);
+            break;
+        case MODE_TEST:
+            e->collector.inject_now = 1644144574;
+            e->collector.inject_input = stdin;
+        /* FALL THROUGH */
+        case MODE_DUMP: {
+            cache_generate_prom(&e->collector);
+            exporter_publish(e, clock_ms(), 0);
+
+            if (e->collector.current->body->overflow) {
+                fprintf(stderr, "buffer_overflow 1\n");
+                return 1;
+            }
+
+            // The same copy as the service would send
+            variant_t *out = cache_variant(e, e->collector.current, output_format, gzip_output);
+            if (!out) {
+                printf("%s output failed\n", formats[output_format].name);
+                return 1;
+            }
+            variant_write(outfd, out);
+            break;
+        }
+        case MODE_RECORD: {
+            // Save the raw collector data, for use with --test
+            if (collector == COLLECTOR_NFT || collector == COLLECTOR_NFACCT ||
+                    collector == COLLECTOR_CONNTRACK) {
+                int fd = netlink_dump();
+                if (fd == -1 || nfnl_stream(fd, nfnl_record, &outfd) == -1) {
+                    perror("netlink_dump");
+                    return 1;
+                }
+                close(fd);
+                break;
+            }
+            if (collector != COLLECTOR_IPT) {
+                printf("The save collector cannot be recorded\n");
+                return 1;
+            }
+
+            strbuf_t *blob = ipt_get_entries("raw");
+            if (!blob) {
+                perror("ipt_get_entries");
+                return 1;
+            }
+            sb_write(outfd, blob, 0, -1);
+            free(blob);
             break;
         }
     }
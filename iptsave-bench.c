@@ -0,0 +1,187 @@
+/*
+ * Benchmark the iptables-save parsers on a synthetic dump
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iptsave.h"
+#include "scan.h"
+
+#define REPEAT 20
+
+// One in this many lines is an accounting rule
+#define TAGGED_EVERY 20
+
+static void count_matched(struct linedata *d, void *arg) {
+    int *matched = arg;
+    if (d->matched == 1) {
+        (*matched)++;
+    }
+}
+
+/*
+ * The fgets and strtok based parser that iptsave.c replaced, kept here as
+ * the baseline
+ */
+static int strtok_oneline(char *s) {
+    if (*s != '[') {
+        return -1;
+    }
+    s++;
+    strtok(s, ":");
+    strtok(NULL, "]");
+
+    int matched = 0;
+    char *opt;
+    while ((opt = strtok(NULL, " ")) != NULL) {
+        if (*opt != '-') {
+            continue;
+        }
+        opt++;
+        if (*opt == '-') {
+            opt++;
+            if (strcmp("dport", opt) == 0 || strcmp("sport", opt) == 0) {
+                strtok(NULL, " ");
+            } else if (strcmp("comment", opt) == 0) {
+                char *comment = strtok(NULL, " ");
+                matched = (comment && strstr(comment, "ACCT")) ? 1 : 0;
+            }
+            continue;
+        }
+        switch (*opt) {
+            case 'A':
+            case 'p':
+            case 'm':
+                strtok(NULL, " ");
+                break;
+        }
+    }
+    return matched;
+}
+
+static int run_strtok(char *buf, size_t len) {
+    FILE *input = fmemopen(buf, len, "r");
+    char line[100];
+    int matched = 0;
+
+    while (fgets(line, sizeof(line), input) != NULL) {
+        if (strtok_oneline(line) == 1) {
+            matched++;
+        }
+    }
+    fclose(input);
+    return matched;
+}
+
+// Tokenise every line, as iptsave did before the pre-scan
+static int run_slices(char *buf, size_t len) {
+    const char *p = buf;
+    const char *end = buf + len;
+    int matched = 0;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) {
+            nl = end;
+        }
+        struct linedata d = iptsave_oneline(p, nl - p);
+        count_matched(&d, &matched);
+        p = nl + 1;
+    }
+    return matched;
+}
+
+static int run_prescan(char *buf, size_t len) {
+    int lines = 0;
+    int matched = 0;
+    iptsave_parse(buf, len, 1, &lines, count_matched, &matched);
+    return matched;
+}
+
+static int run_threads(char *buf, size_t len) {
+    int lines = 0;
+    int matched = 0;
+    iptsave_parse_threads(buf, len, 1, 4, &lines, count_matched, &matched);
+    return matched;
+}
+
+static char *generate(int nr_lines, size_t *len) {
+    size_t size = nr_lines * 100;
+    char *buf = malloc(size);
+    if (!buf) {
+        abort();
+    }
+    size_t pos = 0;
+
+    for (int i = 0; i < nr_lines; i++) {
+        if (i % TAGGED_EVERY == 0) {
+            pos += snprintf(&buf[pos], size - pos,
+                    "[%i:%i] -A INPUT -p tcp -m tcp --dport %i "
+                    "-m comment --comment ACCT\n",
+                    i, i * 60, i % 65536);
+        } else {
+            pos += snprintf(&buf[pos], size - pos,
+                    "[%i:%i] -A FORWARD -s 10.%i.%i.0/24 -i eth0 "
+                    "-m conntrack --ctstate NEW -j ACCEPT\n",
+                    i, i * 60, (i >> 8) & 255, i & 255);
+        }
+    }
+    *len = pos;
+    return buf;
+}
+
+static void bench(const char *name, int (*fn)(char *, size_t),
+        char *buf, size_t len, int nr_lines) {
+    struct timespec t0, t1;
+    int matched = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < REPEAT; i++) {
+        matched = fn(buf, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    ns /= REPEAT;
+    printf("%8i lines %-16s %8i matched %9.0f ns/line %8.1f MB/s\n",
+            nr_lines, name, matched, ns / nr_lines, len / ns * 1e3);
+}
+
+int main(int argc, char **argv) {
+    int sizes[] = { 10000, 100000 };
+    const char *scanners[] = { "scalar", "sse2", "avx2" };
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int nr_lines = sizes[i];
+        if (argc > 1) {
+            nr_lines = atoi(argv[1]) * (i + 1);
+        }
+
+        size_t len;
+        char *buf = generate(nr_lines, &len);
+
+        bench("strtok", run_strtok, buf, len, nr_lines);
+        bench("slices", run_slices, buf, len, nr_lines);
+
+        for (unsigned int j = 0; j < sizeof(scanners) / sizeof(scanners[0]);
+                j++) {
+            if (scan_use(scanners[j]) == -1) {
+                continue;
+            }
+            char name[32];
+            snprintf(name, sizeof(name), "prescan-%s", scanners[j]);
+            bench(name, run_prescan, buf, len, nr_lines);
+        }
+
+        // Small dumps are parsed by one thread regardless
+        bench("prescan-4threads", run_threads, buf, len, nr_lines);
+        free(buf);
+    }
+}
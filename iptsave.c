@@ -0,0 +1,423 @@
+/** @file
+ * Parse the text output from "iptables-save -c".
+ *
+ * The input is read in large chunks into a caller supplied strbuf and each
+ * line is tokenised in place.  The fields are passed on as slices that
+ * point into that buffer, so nothing is copied and the input is never
+ * modified.  There is no hidden state, so several parses can be run at
+ * the same time as long as they each have their own buffer.
+ *
+ * A large dump that has already been buffered can also be split into
+ * ranges that are parsed in parallel.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "iptsave.h"
+#include "scan.h"
+
+/**
+ * Find the next token in a line.
+ * Tokens are separated by spaces, but a double quoted token may contain
+ * spaces and backslash escaped quotes.  The quotes are not included in the
+ * token, and any escapes are left as they are.
+ * @param pos is the current position, which is moved past the token
+ * @param end is the end of the line
+ * @param tok is set to the token found
+ * @return true if a token was found
+ */
+static int iptsave_token(const char **pos, const char *end, slice_t *tok) {
+    const char *p = *pos;
+
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    if (p == end) {
+        *pos = p;
+        return 0;
+    }
+
+    if (*p == '"') {
+        p++;
+        tok->str = p;
+        while (p < end && *p != '"') {
+            if (*p == '\\' && p + 1 < end) {
+                p++;
+            }
+            p++;
+        }
+        tok->len = p - tok->str;
+        if (p < end) {
+            // Skip the closing quote
+            p++;
+        }
+    } else {
+        tok->str = p;
+        while (p < end && *p != ' ') {
+            p++;
+        }
+        tok->len = p - tok->str;
+    }
+
+    *pos = p;
+    return 1;
+}
+
+static int slice_eq(slice_t s, const char *str) {
+    size_t len = strlen(str);
+    return s.len == len && memcmp(s.str, str, len) == 0;
+}
+
+/**
+ * Extract the accounting details from one line of iptables-save output
+ * @param s is the start of the line
+ * @param len is the length of the line, not including any newline
+ * @return the details, with slices pointing into the line
+ */
+struct linedata iptsave_oneline(const char *s, size_t len) {
+    const char *end = s + len;
+    struct linedata d;
+
+    d.packets = acct_slice(NULL);
+    d.bytes = acct_slice(NULL);
+    d.chain = acct_slice(NULL);
+    d.proto = acct_slice(NULL);
+    d.port = acct_slice(NULL);
+
+    // [501:38322] -A INPUT -p tcp -m tcp --dport 22 -j ACCEPT
+    const char *colon = len ? memchr(s, ':', len) : NULL;
+    const char *close = colon ? memchr(colon, ']', end - colon) : NULL;
+    if (!close || *s != '[') {
+        d.matched = -1;
+        return d;
+    }
+
+    d.packets.str = s + 1;
+    d.packets.len = colon - d.packets.str;
+    d.bytes.str = colon + 1;
+    d.bytes.len = close - d.bytes.str;
+    d.matched = 0;
+
+    const char *pos = close + 1;
+    slice_t opt;
+
+    while (iptsave_token(&pos, end, &opt)) {
+        slice_t arg;
+
+        if (opt.len < 2 || opt.str[0] != '-') {
+            // We dont understand this, skip it
+            continue;
+        }
+
+        if (opt.str[1] == '-') {
+            // a long opt
+            opt.str += 2;
+            opt.len -= 2;
+            if (slice_eq(opt, "dport") || slice_eq(opt, "sport")) {
+                if (iptsave_token(&pos, end, &arg) && !d.port.str) {
+                    d.port = arg;
+                }
+            } else if (slice_eq(opt, "comment")) {
+                if (iptsave_token(&pos, end, &arg)) {
+                    // Check if our tag is here
+                    d.matched = memmem(arg.str, arg.len, "ACCT", 4) ? 1 : 0;
+                }
+            }
+            continue;
+        }
+
+        switch (opt.str[1]) {
+            case 'A':
+                if (iptsave_token(&pos, end, &arg)) {
+                    d.chain = arg;
+                }
+                break;
+            case 'p':
+                if (iptsave_token(&pos, end, &arg)) {
+                    d.proto = arg;
+                }
+                break;
+            case 'm': // module
+                iptsave_token(&pos, end, &arg);
+                break;
+        }
+    }
+    return d;
+}
+
+/**
+ * Parse the lines in a buffer.
+ * Every line is counted, but only the lines with the accounting tag
+ * somewhere in them are tokenised and passed to the callback, as the other
+ * lines can never match.
+ * @param buf is the start of the data
+ * @param len is the length of the data
+ * @param final is true if there is no more data to come, so a last line
+ * without a newline should also be parsed
+ * @param lines is incremented for each line
+ * @param cb is called with the details from each possible accounting line
+ * @param arg is passed to the callback
+ * @return the number of bytes used, which will end on a line boundary
+ */
+size_t iptsave_parse(const char *buf, size_t len, int final, int *lines,
+        linedata_cb_t cb, void *arg) {
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (p < end) {
+        int tagged;
+        const char *nl = scan_line(p, end, &tagged);
+        if (!nl) {
+            if (!final) {
+                break;
+            }
+            nl = end;
+        }
+        (*lines)++;
+
+        if (tagged) {
+            struct linedata d = iptsave_oneline(p, nl - p);
+            cb(&d, arg);
+        }
+        p = nl < end ? nl + 1 : end;
+    }
+    return p - buf;
+}
+
+/*
+ * One range of a buffered dump, parsed by its own thread.  The results are
+ * only stored, so that they can be passed to the real callback in the
+ * original order once every thread has finished.
+ */
+struct iptsave_part {
+    const char *buf;
+    size_t len;
+    int final;
+    size_t used;
+    int lines;
+    struct linedata *results;
+    unsigned int nr_results;
+    unsigned int size;
+    int error;
+};
+
+static void iptsave_part_store(struct linedata *d, void *arg) {
+    struct iptsave_part *part = arg;
+
+    if (part->nr_results == part->size) {
+        unsigned int size = part->size ? part->size * 2 : 64;
+        struct linedata *results = realloc(
+            part->results,
+            size * sizeof(*results)
+        );
+        if (!results) {
+            part->error = 1;
+            return;
+        }
+        part->results = results;
+        part->size = size;
+    }
+    part->results[part->nr_results++] = *d;
+}
+
+static void *iptsave_part_parse(void *arg) {
+    struct iptsave_part *part = arg;
+
+    part->used = iptsave_parse(
+        part->buf,
+        part->len,
+        part->final,
+        &part->lines,
+        iptsave_part_store,
+        part
+    );
+    return NULL;
+}
+
+/**
+ * Parse the lines in a buffer using several threads.
+ * The buffer is split at line boundaries into one range per thread, and
+ * the callback is called from the calling thread, in the original line
+ * order, once all the ranges are parsed.  Buffers too small to be worth
+ * starting threads for are parsed directly.
+ * @param buf is the start of the data
+ * @param len is the length of the data
+ * @param final is true if there is no more data to come
+ * @param threads is the most threads to use
+ * @param lines is incremented for each line
+ * @param cb is called with the details from each possible accounting line
+ * @param arg is passed to the callback
+ * @return the number of bytes used, or -1 if there was an error
+ */
+ssize_t iptsave_parse_threads(const char *buf, size_t len, int final,
+        int threads, int *lines, linedata_cb_t cb, void *arg) {
+    if (threads > IPTSAVE_THREADS_MAX) {
+        threads = IPTSAVE_THREADS_MAX;
+    }
+    if ((size_t)threads > len / IPTSAVE_THREAD_MIN_BYTES) {
+        threads = len / IPTSAVE_THREAD_MIN_BYTES;
+    }
+    if (threads < 2) {
+        return iptsave_parse(buf, len, final, lines, cb, arg);
+    }
+
+    struct iptsave_part part[IPTSAVE_THREADS_MAX];
+    pthread_t tid[IPTSAVE_THREADS_MAX];
+    int started[IPTSAVE_THREADS_MAX];
+    const char *end = buf + len;
+    const char *p = buf;
+
+    memset(part, 0, sizeof(part));
+    for (int i = 0; i < threads; i++) {
+        const char *stop = end;
+        if (i < threads - 1) {
+            // Move the split forward to the end of a line
+            stop = buf + len / threads * (i + 1);
+            if (stop < p) {
+                stop = p;
+            }
+            const char *nl = memchr(stop, '\n', end - stop);
+            stop = nl ? nl + 1 : end;
+        }
+        part[i].buf = p;
+        part[i].len = stop - p;
+        part[i].final = (stop == end) ? final : 1;
+        p = stop;
+    }
+
+    // The calling thread takes the first range itself
+    for (int i = 1; i < threads; i++) {
+        started[i] = pthread_create(
+            &tid[i],
+            NULL,
+            iptsave_part_parse,
+            &part[i]
+        ) == 0;
+        if (!started[i]) {
+            iptsave_part_parse(&part[i]);
+        }
+    }
+    iptsave_part_parse(&part[0]);
+
+    int error = 0;
+    size_t used = 0;
+    for (int i = 0; i < threads; i++) {
+        if (i && started[i]) {
+            pthread_join(tid[i], NULL);
+        }
+        error |= part[i].error;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        if (!error) {
+            for (unsigned int j = 0; j < part[i].nr_results; j++) {
+                cb(&part[i].results[j], arg);
+            }
+            *lines += part[i].lines;
+            used += part[i].used;
+        }
+        free(part[i].results);
+    }
+
+    if (error) {
+        return -1;
+    }
+    return used;
+}
+
+/**
+ * Read and parse whatever iptables-save output is available.
+ * This can be used with a non-blocking file descriptor, calling it each
+ * time the descriptor is readable.  Only complete lines are parsed, and
+ * the remaining data is kept in the strbuf until the next call.
+ * @param fd is the file descriptor to read from
+ * @param pp is the strbuf to use for reading, which must start empty and
+ * may be expanded to hold long lines
+ * @param threads is the most threads to use.  If this is more than one,
+ * as much of the dump as will fit is kept in the strbuf and then split
+ * between the threads at the end.
+ * @param lines is incremented for each line
+ * @param cb is called with the details from each possible accounting line
+ * @param arg is passed to the callback
+ * @return 1 if there is more to read, zero at the end of the data, or -1
+ * for an error
+ */
+int iptsave_feed(int fd, strbuf_t **pp, int threads, int *lines,
+        linedata_cb_t cb, void *arg) {
+    ssize_t size = sb_refill(pp, fd);
+    if (size == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        }
+        return -1;
+    }
+
+    if (threads > 1 && size > 0) {
+        // Keep buffering, to give the threads as much as possible
+        return 1;
+    }
+
+    // Only the end of the data finishes the last line.  A full strbuf
+    // keeps its partial last line for the next read, unless there are no
+    // complete lines, as then it is a piece of a line too long to buffer
+    strbuf_t *p = *pp;
+    ssize_t used = iptsave_parse_threads(
+        &p->str[p->rd_pos],
+        p->wr_pos - p->rd_pos,
+        size == 0,
+        threads,
+        lines,
+        cb,
+        arg
+    );
+    if (used == 0 && size == -2) {
+        used = iptsave_parse_threads(
+            &p->str[p->rd_pos],
+            p->wr_pos - p->rd_pos,
+            1,
+            threads,
+            lines,
+            cb,
+            arg
+        );
+    }
+    if (used == -1) {
+        return -1;
+    }
+    p->rd_pos += used;
+
+    return size == 0 ? 0 : 1;
+}
+
+/**
+ * Read all the iptables-save output and parse it with iptsave_feed()
+ * @param fd is the file descriptor to read from
+ * @param pp is the strbuf to use for reading, which will be emptied
+ * and may be expanded to hold long lines
+ * @param threads is the most threads to use
+ * @param cb is called with the details from each possible accounting line
+ * @param arg is passed to the callback
+ * @return the number of lines read, or -1 for an error
+ */
+int iptsave_read(int fd, strbuf_t **pp, int threads, linedata_cb_t cb,
+        void *arg) {
+    int lines = 0;
+    int r;
+
+    sb_zero(*pp);
+    while ((r = iptsave_feed(fd, pp, threads, &lines, cb, arg)) == 1) {
+        // More to read
+    }
+    if (r == -1) {
+        return -1;
+    }
+    return lines;
+}
@@ -0,0 +1,33 @@
+/** @file
+ * Internal interface definitions for the iptables-save text parser
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef IPTSAVE_H
+#define IPTSAVE_H
+
+#include <sys/types.h>
+
+#include "accounting.h"
+#include "strbuf.h"
+
+/**
+ * The most parse threads that can be used
+ */
+#define IPTSAVE_THREADS_MAX 16
+
+/**
+ * Each parse thread must have at least this much data to parse, as
+ * starting a thread costs more than parsing a small range
+ */
+#define IPTSAVE_THREAD_MIN_BYTES (256*1024)
+
+struct linedata iptsave_oneline(const char *, size_t);
+size_t iptsave_parse(const char *, size_t, int, int *, linedata_cb_t, void *);
+ssize_t iptsave_parse_threads(const char *, size_t, int, int, int *,
+        linedata_cb_t, void *);
+int iptsave_feed(int, strbuf_t **, int, int *, linedata_cb_t, void *);
+int iptsave_read(int, strbuf_t **, int, linedata_cb_t, void *);
+#endif
@@ -0,0 +1,145 @@
+/** @file
+ * Read the named nfacct counter objects using nfnetlink.
+ *
+ * All the objects are fetched with a single dump request, without needing
+ * to walk any ruleset.  The accounting objects are recognised by their
+ * name, which also carries the labels, in the form that
+ * iptables-accounting-add creates:
+ *
+ *     ACCT_<chain>_<proto>_<port>
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_acct.h>
+
+#include "nfacct.h"
+#include "nfnl.h"
+
+#define NFACCT_PREFIX "ACCT_"
+
+struct nfacct_read {
+    linedata_cb_t cb;
+    void *arg;
+};
+
+/**
+ * Open a netlink socket and request a dump of all the nfacct objects.
+ * @return the socket to read the reply from, or -1 for error
+ */
+int nfacct_dump(void) {
+    int fd = nfnl_open();
+    if (fd == -1) {
+        return -1;
+    }
+
+    strbuf_t *msg = nfnl_msg(
+            (NFNL_SUBSYS_ACCT << 8) | NFNL_MSG_ACCT_GET,
+            NLM_F_DUMP,
+            AF_UNSPEC
+    );
+    if (!msg) {
+        close(fd);
+        return -1;
+    }
+
+    int r = nfnl_send(fd, msg);
+    free(msg);
+    if (r == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Split an object name into the label fields.
+ * The fields are found from the right, so the chain name is allowed to
+ * contain underscores.
+ * @param name is a writable copy of the object name
+ * @return zero, or -1 if this is not an accounting object
+ */
+static int nfacct_name_parse(char *name, struct linedata *d) {
+    if (strncmp(name, NFACCT_PREFIX, strlen(NFACCT_PREFIX)) != 0) {
+        return -1;
+    }
+    name += strlen(NFACCT_PREFIX);
+
+    char *sep = strrchr(name, '_');
+    if (!sep) {
+        return -1;
+    }
+    *sep = 0;
+    d->port = acct_slice(sep + 1);
+
+    sep = strrchr(name, '_');
+    if (!sep) {
+        return -1;
+    }
+    *sep = 0;
+    d->proto = acct_slice(sep + 1);
+    d->chain = acct_slice(name);
+    return 0;
+}
+
+static int nfacct_msg(struct nlmsghdr *nlh, void *arg) {
+    struct nfacct_read *read = arg;
+
+    if (nlh->nlmsg_type != ((NFNL_SUBSYS_ACCT << 8) | NFNL_MSG_ACCT_NEW)) {
+        return 0;
+    }
+
+    const struct nlattr *tb[NFACCT_MAX + 1];
+    nfnl_iter_t iter;
+    nfnl_iter_msg(&iter, nlh);
+    nfnl_attrs(&iter, tb, NFACCT_MAX);
+
+    char name[NFACCT_NAME_MAX];
+    char packets[24];
+    char bytes[24];
+    struct linedata d;
+
+    d.chain = acct_slice(NULL);
+    d.proto = acct_slice(NULL);
+    d.port = acct_slice(NULL);
+    d.matched = 0;
+
+    char *s = tb[NFACCT_NAME] ? nfnl_attr_str(tb[NFACCT_NAME]) : NULL;
+    if (s) {
+        strncpy(name, s, sizeof(name) - 1);
+        name[sizeof(name) - 1] = 0;
+        d.matched = (nfacct_name_parse(name, &d) == 0)?1:0;
+    }
+
+    snprintf(packets, sizeof(packets), "%llu", (unsigned long long)
+            (tb[NFACCT_PKTS] ? nfnl_attr_be64(tb[NFACCT_PKTS]) : 0));
+    snprintf(bytes, sizeof(bytes), "%llu", (unsigned long long)
+            (tb[NFACCT_BYTES] ? nfnl_attr_be64(tb[NFACCT_BYTES]) : 0));
+    d.packets = acct_slice(packets);
+    d.bytes = acct_slice(bytes);
+
+    read->cb(&d, read->arg);
+    return 0;
+}
+
+/**
+ * Read the reply to nfacct_dump(), or a recording of it.
+ * @param fd is the socket or recording file to read
+ * @param cb is called for each object found
+ * @param arg is passed unchanged to the callback
+ * @return the number of objects read, or -1 for error (with errno set)
+ */
+int nfacct_read(int fd, linedata_cb_t cb, void *arg) {
+    struct nfacct_read read = {
+        .cb = cb,
+        .arg = arg,
+    };
+    return nfnl_stream(fd, nfacct_msg, &read);
+}
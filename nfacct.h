@@ -0,0 +1,15 @@
+/** @file
+ * Internal interface definitions for the nfacct collector
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef NFACCT_H
+#define NFACCT_H
+
+#include "accounting.h"
+
+int nfacct_dump(void);
+int nfacct_read(int, linedata_cb_t, void *);
+#endif
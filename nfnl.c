@@ -0,0 +1,338 @@
+/** @file
+ * A minimal set of helpers for talking to the netfilter subsystems over
+ * netlink, without needing libmnl or libnftnl.
+ *
+ * Replies are processed as a stream, one message at a time, so the size of
+ * a dump never needs to fit in memory.  The same stream code can read a
+ * recording of the messages from a file, which allows the collectors to be
+ * tested without a kernel.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netfilter/nfnetlink.h>
+
+#include "nfnl.h"
+
+// Larger than the biggest single message that a kernel dump will send
+#define NFNL_BUFSIZE (64*1024)
+
+/**
+ * Open a netlink socket to the netfilter subsystems
+ * @return the socket or -1 for error
+ */
+int nfnl_open(void) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Start building a new request message.
+ * @param type is the message type, (subsys << 8) | msg
+ * @param flags are added to NLM_F_REQUEST
+ * @param family is the nfgenmsg protocol family
+ * @return the allocated message buffer or NULL
+ */
+strbuf_t *nfnl_msg(uint16_t type, uint16_t flags, uint8_t family) {
+    strbuf_t *p = sb_malloc(256);
+    if (!p) {
+        return NULL;
+    }
+
+    struct nlmsghdr nlh = {
+        .nlmsg_len = 0,
+        .nlmsg_type = type,
+        .nlmsg_flags = NLM_F_REQUEST | flags,
+        .nlmsg_seq = 1,
+    };
+    struct nfgenmsg nfg = {
+        .nfgen_family = family,
+        .version = NFNETLINK_V0,
+        .res_id = 0,
+    };
+
+    sb_append(p, &nlh, NLMSG_HDRLEN);
+    sb_append(p, &nfg, NLMSG_ALIGN(sizeof(nfg)));
+    return p;
+}
+
+/**
+ * Append an attribute to a request message.
+ * The request messages are small, so this is expected to always fit.
+ */
+void nfnl_put(strbuf_t *p, uint16_t type, const void *data, size_t len) {
+    struct nlattr nla = {
+        .nla_len = NLA_HDRLEN + len,
+        .nla_type = type,
+    };
+    static const char pad[NLA_ALIGNTO];
+
+    sb_append(p, &nla, NLA_HDRLEN);
+    sb_append(p, (void *)data, len);
+    sb_append(p, (void *)pad, NLA_ALIGN(len) - len);
+}
+
+void nfnl_put_str(strbuf_t *p, uint16_t type, const char *s) {
+    nfnl_put(p, type, s, strlen(s) + 1);
+}
+
+/**
+ * Send a completed request message
+ * @return zero or -1 for error
+ */
+int nfnl_send(int fd, strbuf_t *p) {
+    if (sb_full(p)) {
+        // The message was truncated while being built
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    struct nlmsghdr *nlh = (struct nlmsghdr *)p->str;
+    nlh->nlmsg_len = sb_len(p);
+
+    if (send(fd, p->str, sb_len(p), 0) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read netlink messages from the file descriptor, calling the callback for
+ * each one until the end of the dump.
+ * The descriptor can either be a netlink socket or a file containing a
+ * recording of the messages, in which case the end of file also ends the
+ * dump.
+ * @return the number of messages processed or -1 for error (with errno set)
+ */
+int nfnl_stream(int fd, nfnl_cb_t cb, void *arg) {
+    strbuf_t *buf = sb_malloc(NFNL_BUFSIZE);
+    if (!buf) {
+        return -1;
+    }
+
+    int nr = 0;
+    int done = 0;
+    int error = 0;
+
+    while (!done && !error) {
+        ssize_t size = sb_read(fd, buf);
+        if (size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            break;
+        }
+        if (size == 0) {
+            // Only a file can reach an end
+            break;
+        }
+
+        size_t len = sb_len(buf);
+        size_t pos = 0;
+
+        while (len - pos >= NLMSG_HDRLEN) {
+            struct nlmsghdr *nlh = (struct nlmsghdr *)&buf->str[pos];
+
+            if (nlh->nlmsg_len < NLMSG_HDRLEN || nlh->nlmsg_len > buf->capacity) {
+                error = EBADMSG;
+                break;
+            }
+            if (nlh->nlmsg_len > len - pos) {
+                // A partial message, which can only happen with a file
+                break;
+            }
+
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                done = 1;
+                break;
+            }
+
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = NLMSG_DATA(nlh);
+                if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*err))) {
+                    error = EBADMSG;
+                    break;
+                }
+                if (err->error) {
+                    error = -err->error;
+                    break;
+                }
+                // Otherwise this is just an ack
+            } else if (nlh->nlmsg_type >= NLMSG_MIN_TYPE) {
+                if (cb(nlh, arg) < 0) {
+                    error = ECANCELED;
+                    break;
+                }
+                nr++;
+            }
+
+            pos += NLMSG_ALIGN(nlh->nlmsg_len);
+            if (pos > len) {
+                pos = len;
+            }
+        }
+
+        // Keep any partial message for the next read
+        memmove(buf->str, &buf->str[pos], len - pos);
+        buf->wr_pos = len - pos;
+    }
+
+    free(buf);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return nr;
+}
+
+/**
+ * A nfnl_stream() callback that writes each message to a file descriptor,
+ * to make a recording that can be replayed later.
+ * @param arg is a pointer to the int file descriptor
+ */
+int nfnl_record(struct nlmsghdr *nlh, void *arg) {
+    int fd = *(int *)arg;
+    if (write(fd, nlh, NLMSG_ALIGN(nlh->nlmsg_len)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void nfnl_iter_init(nfnl_iter_t *iter, const void *data, size_t len) {
+    iter->pos = data;
+    iter->remain = len;
+}
+
+/**
+ * Setup to iterate over the attributes contained in a nested attribute
+ */
+void nfnl_iter_nest(nfnl_iter_t *iter, const struct nlattr *nest) {
+    nfnl_iter_init(iter, nfnl_attr_data(nest), nfnl_attr_len(nest));
+}
+
+/**
+ * Setup to iterate over the attributes in a nfnetlink message
+ */
+void nfnl_iter_msg(nfnl_iter_t *iter, const struct nlmsghdr *nlh) {
+    size_t hdrlen = NLMSG_SPACE(sizeof(struct nfgenmsg));
+    if (nlh->nlmsg_len < hdrlen) {
+        nfnl_iter_init(iter, NULL, 0);
+        return;
+    }
+    nfnl_iter_init(iter, (char *)nlh + hdrlen, nlh->nlmsg_len - hdrlen);
+}
+
+/**
+ * @return the next attribute or NULL if there are no more valid attributes
+ */
+const struct nlattr *nfnl_iter_next(nfnl_iter_t *iter) {
+    if (iter->remain < NLA_HDRLEN) {
+        return NULL;
+    }
+
+    const struct nlattr *nla = (const struct nlattr *)iter->pos;
+    if (nla->nla_len < NLA_HDRLEN || nla->nla_len > iter->remain) {
+        return NULL;
+    }
+
+    size_t step = NLA_ALIGN(nla->nla_len);
+    if (step > iter->remain) {
+        step = iter->remain;
+    }
+    iter->pos += step;
+    iter->remain -= step;
+    return nla;
+}
+
+/**
+ * Fill a table, indexed by type, with the remaining attributes.
+ * @param tb is the table to fill, with room for max+1 entries
+ * @param max is the largest attribute type wanted
+ */
+void nfnl_attrs(nfnl_iter_t *iter, const struct nlattr **tb, int max) {
+    const struct nlattr *nla;
+
+    memset(tb, 0, (max + 1) * sizeof(*tb));
+    while ((nla = nfnl_iter_next(iter)) != NULL) {
+        int type = nla->nla_type & NLA_TYPE_MASK;
+        if (type <= max) {
+            tb[type] = nla;
+        }
+    }
+}
+
+const void *nfnl_attr_data(const struct nlattr *nla) {
+    return (const char *)nla + NLA_HDRLEN;
+}
+
+size_t nfnl_attr_len(const struct nlattr *nla) {
+    return nla->nla_len - NLA_HDRLEN;
+}
+
+/**
+ * @return the string payload, or NULL if it is not correctly terminated
+ */
+char *nfnl_attr_str(const struct nlattr *nla) {
+    size_t len = nfnl_attr_len(nla);
+    const char *s = nfnl_attr_data(nla);
+    if (!len || s[len - 1] != 0) {
+        return NULL;
+    }
+    return (char *)s;
+}
+
+// The fixed size accessors all return zero for a short attribute
+
+uint8_t nfnl_attr_u8(const struct nlattr *nla) {
+    if (nfnl_attr_len(nla) < 1) {
+        return 0;
+    }
+    return *(const uint8_t *)nfnl_attr_data(nla);
+}
+
+uint16_t nfnl_attr_be16(const struct nlattr *nla) {
+    uint16_t val;
+    if (nfnl_attr_len(nla) < sizeof(val)) {
+        return 0;
+    }
+    memcpy(&val, nfnl_attr_data(nla), sizeof(val));
+    return be16toh(val);
+}
+
+uint32_t nfnl_attr_be32(const struct nlattr *nla) {
+    uint32_t val;
+    if (nfnl_attr_len(nla) < sizeof(val)) {
+        return 0;
+    }
+    memcpy(&val, nfnl_attr_data(nla), sizeof(val));
+    return be32toh(val);
+}
+
+uint64_t nfnl_attr_be64(const struct nlattr *nla) {
+    uint64_t val;
+    if (nfnl_attr_len(nla) < sizeof(val)) {
+        return 0;
+    }
+    memcpy(&val, nfnl_attr_data(nla), sizeof(val));
+    return be64toh(val);
+}
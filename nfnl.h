@@ -0,0 +1,52 @@
+/** @file
+ * Internal interface definitions for the nfnetlink helpers
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef NFNL_H
+#define NFNL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/netlink.h>
+
+#include "strbuf.h"
+
+/**
+ * An iterator over a sequence of netlink attributes
+ */
+typedef struct nfnl_iter {
+    const char *pos;
+    size_t remain;
+} nfnl_iter_t;
+
+/**
+ * Called by nfnl_stream() for each message received
+ * Returning a negative number will stop the stream
+ */
+typedef int (*nfnl_cb_t)(struct nlmsghdr *, void *);
+
+int nfnl_open(void);
+strbuf_t *nfnl_msg(uint16_t, uint16_t, uint8_t);
+void nfnl_put(strbuf_t *, uint16_t, const void *, size_t);
+void nfnl_put_str(strbuf_t *, uint16_t, const char *);
+int nfnl_send(int, strbuf_t *);
+int nfnl_stream(int, nfnl_cb_t, void *);
+int nfnl_record(struct nlmsghdr *, void *);
+
+void nfnl_iter_init(nfnl_iter_t *, const void *, size_t);
+void nfnl_iter_nest(nfnl_iter_t *, const struct nlattr *);
+void nfnl_iter_msg(nfnl_iter_t *, const struct nlmsghdr *);
+const struct nlattr *nfnl_iter_next(nfnl_iter_t *);
+void nfnl_attrs(nfnl_iter_t *, const struct nlattr **, int);
+
+const void *nfnl_attr_data(const struct nlattr *);
+size_t nfnl_attr_len(const struct nlattr *);
+char *nfnl_attr_str(const struct nlattr *);
+uint8_t nfnl_attr_u8(const struct nlattr *);
+uint16_t nfnl_attr_be16(const struct nlattr *);
+uint32_t nfnl_attr_be32(const struct nlattr *);
+uint64_t nfnl_attr_be64(const struct nlattr *);
+#endif
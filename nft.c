@@ -0,0 +1,337 @@
+/** @file
+ * Read the rule counters from one nftables table using nfnetlink.
+ *
+ * Only the rules in the named table (and optionally a single chain) are
+ * requested from the kernel, so the cost of a refresh does not depend on
+ * the size of the rest of the firewall.  Every rule in the table with a
+ * counter expression is treated as an accounting rule.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "nfnl.h"
+#include "nft.h"
+
+// What the value in each register was loaded from
+enum nft_reg_contents {
+    REG_UNKNOWN,
+    REG_L4PROTO,
+    REG_SPORT,
+    REG_DPORT,
+};
+
+#define NFT_NR_REGS 32
+
+struct nft_rule {
+    enum nft_reg_contents regs[NFT_NR_REGS];
+    unsigned int proto;
+    char port[12];
+    uint64_t packets;
+    uint64_t bytes;
+    int counter;
+};
+
+struct nft_read {
+    linedata_cb_t cb;
+    void *arg;
+};
+
+/**
+ * Convert an nft family name into the protocol family number
+ * @return the number or -1 if the name is not known
+ */
+int nft_family(const char *name) {
+    if (strcmp(name, "ip") == 0) {
+        return NFPROTO_IPV4;
+    }
+    if (strcmp(name, "ip6") == 0) {
+        return NFPROTO_IPV6;
+    }
+    if (strcmp(name, "inet") == 0) {
+        return NFPROTO_INET;
+    }
+    if (strcmp(name, "bridge") == 0) {
+        return NFPROTO_BRIDGE;
+    }
+    if (strcmp(name, "netdev") == 0) {
+        return NFPROTO_NETDEV;
+    }
+    return -1;
+}
+
+/**
+ * Open a netlink socket and request a dump of the rules in one table.
+ * @param family is the table protocol family
+ * @param table is the table name
+ * @param chain is the chain name or NULL for all chains in the table
+ * @return the socket to read the reply from, or -1 for error
+ */
+int nft_dump_rules(int family, const char *table, const char *chain) {
+    int fd = nfnl_open();
+    if (fd == -1) {
+        return -1;
+    }
+
+    strbuf_t *msg = nfnl_msg(
+            (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_GETRULE,
+            NLM_F_DUMP,
+            family
+    );
+    if (!msg) {
+        close(fd);
+        return -1;
+    }
+
+    nfnl_put_str(msg, NFTA_RULE_TABLE, table);
+    if (chain) {
+        nfnl_put_str(msg, NFTA_RULE_CHAIN, chain);
+    }
+
+    int r = nfnl_send(fd, msg);
+    free(msg);
+    if (r == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void nft_reg_set(struct nft_rule *rule, const struct nlattr *reg,
+        enum nft_reg_contents contents) {
+    if (!reg) {
+        return;
+    }
+    uint32_t nr = nfnl_attr_be32(reg);
+    if (nr < NFT_NR_REGS) {
+        rule->regs[nr] = contents;
+    }
+}
+
+static enum nft_reg_contents nft_reg_get(struct nft_rule *rule,
+        const struct nlattr *reg) {
+    if (!reg) {
+        return REG_UNKNOWN;
+    }
+    uint32_t nr = nfnl_attr_be32(reg);
+    if (nr >= NFT_NR_REGS) {
+        return REG_UNKNOWN;
+    }
+    return rule->regs[nr];
+}
+
+// Extract the NFTA_DATA_VALUE from a nested nft data attribute
+static const struct nlattr *nft_data_value(const struct nlattr *data) {
+    const struct nlattr *tb[NFTA_DATA_MAX + 1];
+    nfnl_iter_t iter;
+
+    if (!data) {
+        return NULL;
+    }
+    nfnl_iter_nest(&iter, data);
+    nfnl_attrs(&iter, tb, NFTA_DATA_MAX);
+    return tb[NFTA_DATA_VALUE];
+}
+
+static void nft_expr_meta(struct nft_rule *rule, nfnl_iter_t *iter) {
+    const struct nlattr *tb[NFTA_META_MAX + 1];
+    nfnl_attrs(iter, tb, NFTA_META_MAX);
+
+    if (tb[NFTA_META_KEY] && nfnl_attr_be32(tb[NFTA_META_KEY]) == NFT_META_L4PROTO) {
+        nft_reg_set(rule, tb[NFTA_META_DREG], REG_L4PROTO);
+    } else {
+        nft_reg_set(rule, tb[NFTA_META_DREG], REG_UNKNOWN);
+    }
+}
+
+static void nft_expr_payload(struct nft_rule *rule, nfnl_iter_t *iter) {
+    const struct nlattr *tb[NFTA_PAYLOAD_MAX + 1];
+    nfnl_attrs(iter, tb, NFTA_PAYLOAD_MAX);
+
+    enum nft_reg_contents contents = REG_UNKNOWN;
+
+    if (tb[NFTA_PAYLOAD_BASE] && tb[NFTA_PAYLOAD_OFFSET] && tb[NFTA_PAYLOAD_LEN]) {
+        uint32_t base = nfnl_attr_be32(tb[NFTA_PAYLOAD_BASE]);
+        uint32_t offset = nfnl_attr_be32(tb[NFTA_PAYLOAD_OFFSET]);
+        uint32_t len = nfnl_attr_be32(tb[NFTA_PAYLOAD_LEN]);
+
+        // The tcp, udp, udplite and sctp headers all start with the ports
+        if (base == NFT_PAYLOAD_TRANSPORT_HEADER && len == 2) {
+            if (offset == 0) {
+                contents = REG_SPORT;
+            } else if (offset == 2) {
+                contents = REG_DPORT;
+            }
+        }
+    }
+
+    nft_reg_set(rule, tb[NFTA_PAYLOAD_DREG], contents);
+}
+
+static void nft_expr_cmp(struct nft_rule *rule, nfnl_iter_t *iter) {
+    const struct nlattr *tb[NFTA_CMP_MAX + 1];
+    nfnl_attrs(iter, tb, NFTA_CMP_MAX);
+
+    if (!tb[NFTA_CMP_OP] || nfnl_attr_be32(tb[NFTA_CMP_OP]) != NFT_CMP_EQ) {
+        return;
+    }
+
+    const struct nlattr *value = nft_data_value(tb[NFTA_CMP_DATA]);
+    if (!value) {
+        return;
+    }
+
+    switch (nft_reg_get(rule, tb[NFTA_CMP_SREG])) {
+        case REG_L4PROTO:
+            rule->proto = nfnl_attr_u8(value);
+            break;
+        case REG_SPORT:
+        case REG_DPORT:
+            // As with iptables-save, the first port mentioned is used
+            if (!rule->port[0]) {
+                snprintf(rule->port, sizeof(rule->port), "%u",
+                        nfnl_attr_be16(value));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void nft_expr_range(struct nft_rule *rule, nfnl_iter_t *iter) {
+    const struct nlattr *tb[NFTA_RANGE_MAX + 1];
+    nfnl_attrs(iter, tb, NFTA_RANGE_MAX);
+
+    if (!tb[NFTA_RANGE_OP] || nfnl_attr_be32(tb[NFTA_RANGE_OP]) != NFT_RANGE_EQ) {
+        return;
+    }
+
+    const struct nlattr *from = nft_data_value(tb[NFTA_RANGE_FROM_DATA]);
+    const struct nlattr *to = nft_data_value(tb[NFTA_RANGE_TO_DATA]);
+    if (!from || !to) {
+        return;
+    }
+
+    switch (nft_reg_get(rule, tb[NFTA_RANGE_SREG])) {
+        case REG_SPORT:
+        case REG_DPORT:
+            if (!rule->port[0]) {
+                snprintf(rule->port, sizeof(rule->port), "%u:%u",
+                        nfnl_attr_be16(from), nfnl_attr_be16(to));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void nft_expr_counter(struct nft_rule *rule, nfnl_iter_t *iter) {
+    const struct nlattr *tb[NFTA_COUNTER_MAX + 1];
+    nfnl_attrs(iter, tb, NFTA_COUNTER_MAX);
+
+    if (tb[NFTA_COUNTER_PACKETS]) {
+        rule->packets += nfnl_attr_be64(tb[NFTA_COUNTER_PACKETS]);
+    }
+    if (tb[NFTA_COUNTER_BYTES]) {
+        rule->bytes += nfnl_attr_be64(tb[NFTA_COUNTER_BYTES]);
+    }
+    rule->counter = 1;
+}
+
+static void nft_expr(struct nft_rule *rule, const struct nlattr *elem) {
+    const struct nlattr *tb[NFTA_EXPR_MAX + 1];
+    nfnl_iter_t iter;
+
+    nfnl_iter_nest(&iter, elem);
+    nfnl_attrs(&iter, tb, NFTA_EXPR_MAX);
+
+    if (!tb[NFTA_EXPR_NAME] || !tb[NFTA_EXPR_DATA]) {
+        return;
+    }
+    char *name = nfnl_attr_str(tb[NFTA_EXPR_NAME]);
+    if (!name) {
+        return;
+    }
+
+    nfnl_iter_nest(&iter, tb[NFTA_EXPR_DATA]);
+
+    if (strcmp(name, "meta") == 0) {
+        nft_expr_meta(rule, &iter);
+    } else if (strcmp(name, "payload") == 0) {
+        nft_expr_payload(rule, &iter);
+    } else if (strcmp(name, "cmp") == 0) {
+        nft_expr_cmp(rule, &iter);
+    } else if (strcmp(name, "range") == 0) {
+        nft_expr_range(rule, &iter);
+    } else if (strcmp(name, "counter") == 0) {
+        nft_expr_counter(rule, &iter);
+    }
+}
+
+static int nft_rule_msg(struct nlmsghdr *nlh, void *arg) {
+    struct nft_read *read = arg;
+
+    if (nlh->nlmsg_type != ((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWRULE)) {
+        return 0;
+    }
+
+    const struct nlattr *tb[NFTA_RULE_MAX + 1];
+    nfnl_iter_t iter;
+    nfnl_iter_msg(&iter, nlh);
+    nfnl_attrs(&iter, tb, NFTA_RULE_MAX);
+
+    struct nft_rule rule;
+    memset(&rule, 0, sizeof(rule));
+
+    if (tb[NFTA_RULE_EXPRESSIONS]) {
+        const struct nlattr *elem;
+        nfnl_iter_nest(&iter, tb[NFTA_RULE_EXPRESSIONS]);
+        while ((elem = nfnl_iter_next(&iter)) != NULL) {
+            if ((elem->nla_type & NLA_TYPE_MASK) == NFTA_LIST_ELEM) {
+                nft_expr(&rule, elem);
+            }
+        }
+    }
+
+    char packets[24];
+    char bytes[24];
+    char proto[8];
+    struct linedata d;
+
+    snprintf(packets, sizeof(packets), "%llu", (unsigned long long)rule.packets);
+    snprintf(bytes, sizeof(bytes), "%llu", (unsigned long long)rule.bytes);
+    d.packets = acct_slice(packets);
+    d.bytes = acct_slice(bytes);
+    d.chain = acct_slice(
+        tb[NFTA_RULE_CHAIN] ? nfnl_attr_str(tb[NFTA_RULE_CHAIN]) : NULL
+    );
+    d.proto = acct_slice(acct_proto_name(rule.proto, proto, sizeof(proto)));
+    d.port = acct_slice(rule.port[0] ? rule.port : NULL);
+    d.matched = rule.counter;
+
+    read->cb(&d, read->arg);
+    return 0;
+}
+
+/**
+ * Read the reply to nft_dump_rules(), or a recording of it.
+ * @param fd is the socket or recording file to read
+ * @param cb is called for each rule found
+ * @param arg is passed unchanged to the callback
+ * @return the number of rules read, or -1 for error (with errno set)
+ */
+int nft_read_rules(int fd, linedata_cb_t cb, void *arg) {
+    struct nft_read read = {
+        .cb = cb,
+        .arg = arg,
+    };
+    return nfnl_stream(fd, nft_rule_msg, &read);
+}
@@ -0,0 +1,16 @@
+/** @file
+ * Internal interface definitions for the nftables collector
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef NFT_H
+#define NFT_H
+
+#include "accounting.h"
+
+int nft_family(const char *);
+int nft_dump_rules(int, const char *, const char *);
+int nft_read_rules(int, linedata_cb_t, void *);
+#endif
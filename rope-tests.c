@@ -0,0 +1,147 @@
+/*
+ * Tests for the segmented buffers
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rope.h"
+
+// Tests are silent and return if everything is OK, or abort if issues
+void rope_tests() {
+    rope_t *r = rope_malloc(3 * ROPE_SEG_SIZE);
+    assert(r);
+    assert(r->len==0);
+    assert(rope_capacity(r)==0);
+
+    struct iovec *vecs;
+    assert(rope_iovec(r, &vecs)==0);
+
+    assert(rope_append(r, "abcd", 4)==0);
+    assert(rope_printf(r, "%s%i\n", "efg", 42)==0);
+    assert(r->len==10);
+    assert(rope_capacity(r)==ROPE_SEG_SIZE);
+    assert(rope_iovec(r, &vecs)==1);
+    assert(vecs[0].iov_len==10);
+    assert(memcmp(vecs[0].iov_base, "abcdefg42\n", 10)==0);
+
+    // Filling the first segment moves on to the next without moving the
+    // data already stored
+    char *first = r->segs[0]->str;
+    char *buf = malloc(ROPE_SEG_SIZE);
+    for (int i = 0; i < ROPE_SEG_SIZE; i++) {
+        buf[i] = 'a' + i % 26;
+    }
+    assert(rope_append(r, buf, ROPE_SEG_SIZE)==0);
+    assert(r->len==ROPE_SEG_SIZE + 10);
+    assert(r->segs[0]->str==first);
+    assert(rope_iovec(r, &vecs)==2);
+    assert(vecs[0].iov_len==ROPE_SEG_SIZE);
+    assert(vecs[1].iov_len==10);
+
+    // A formatted string that does not fit is split between the segments
+    assert(rope_printf(r, "%*s", ROPE_SEG_SIZE - 5, "end")==0);
+    assert(rope_iovec(r, &vecs)==3);
+    assert(vecs[1].iov_len==ROPE_SEG_SIZE);
+    assert(vecs[2].iov_len==5);
+
+    char out[16];
+    assert(rope_copy(r, 0, out, 10)==10);
+    assert(memcmp(out, "abcdefg42\n", 10)==0);
+    assert(rope_copy(r, ROPE_SEG_SIZE - 2, out, 4)==4);
+    assert(memcmp(out, "efgh", 4)==0);
+    assert(rope_copy(r, r->len - 5, out, sizeof(out))==5);
+    assert(memcmp(out, "  end", 5)==0);
+
+    // Data that would not fit is refused, and remembered
+    size_t len = r->len;
+    assert(!r->overflow);
+    assert(rope_append(r, buf, ROPE_SEG_SIZE)==-1);
+    assert(r->overflow);
+    assert(r->len==len);
+    assert(rope_printf(r, "%*s", ROPE_SEG_SIZE, "x")==-1);
+    assert(r->len==len);
+    assert(rope_append(r, "x", 1)==0);
+
+    // Emptying keeps the segments for next time
+    rope_zero(r);
+    assert(r->len==0);
+    assert(!r->overflow);
+    assert(rope_iovec(r, &vecs)==0);
+    assert(rope_printf(r, "hello\n")==0);
+    assert(r->segs[0]->str==first);
+    assert(r->nr_alloc==3);
+
+    free(buf);
+    rope_free(r);
+}
+
+void rope_write_tests() {
+    rope_t *r = rope_malloc(ROPE_SEG_SIZE * 2);
+    for (int i = 0; i < 10000; i++) {
+        rope_printf(r, "line %i\n", i);
+    }
+    assert(r->nr_segs==2);
+
+    FILE *f = tmpfile();
+    assert(f);
+    assert(rope_write(fileno(f), r)==(ssize_t)r->len);
+
+    char *buf = malloc(r->len);
+    char *want = malloc(r->len);
+    assert(pread(fileno(f), buf, r->len, 0)==(ssize_t)r->len);
+    assert(rope_copy(r, 0, want, r->len)==r->len);
+    assert(memcmp(buf, want, r->len)==0);
+
+    fclose(f);
+    free(want);
+    free(buf);
+    rope_free(r);
+}
+
+void rope_reserve_tests() {
+    rope_t *r = rope_malloc(ROPE_SEG_SIZE + 40);
+
+    strbuf_t *p = rope_reserve(r, 30);
+    assert(p);
+    sb_put(p, SB_LIT("n "));
+    sb_put_u64(p, 12345);
+    rope_commit(r);
+    assert(r->len==7);
+
+    // What is reserved is kept together in the next segment
+    char *fill = calloc(1, ROPE_SEG_SIZE);
+    assert(rope_append(r, fill, ROPE_SEG_SIZE - 20)==0);
+    free(fill);
+    p = rope_reserve(r, 30);
+    assert(p);
+    assert(p==r->segs[1]);
+    sb_put(p, SB_LIT("end\n"));
+    rope_commit(r);
+    assert(r->len==ROPE_SEG_SIZE - 13 + 4);
+
+    struct iovec *vecs;
+    assert(rope_iovec(r, &vecs)==2);
+    assert(vecs[0].iov_len==ROPE_SEG_SIZE - 13);
+    assert(memcmp(vecs[1].iov_base, "end\n", 4)==0);
+
+    // Reserving more than might fit is an overflow
+    assert(!rope_reserve(r, 60));
+    assert(r->overflow);
+    assert(!rope_reserve(r, ROPE_SEG_SIZE + 1));
+
+    rope_free(r);
+}
+
+int main() {
+    printf("Running rope tests\n");
+    rope_tests();
+    rope_write_tests();
+    rope_reserve_tests();
+}
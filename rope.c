@@ -0,0 +1,286 @@
+/** @file
+ * Buffers made of a chain of fixed size segments, which grow without
+ * moving the data already in them
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rope.h"
+
+/**
+ * Allocate a new, empty rope.  The segments are only allocated as they
+ * are needed.
+ * @param len_max is the most data that the rope may hold
+ * @return the rope or NULL
+ */
+rope_t *rope_malloc(size_t len_max) {
+    rope_t *r = calloc(1, sizeof(rope_t));
+    if (r) {
+        r->len_max = len_max;
+    }
+    return r;
+}
+
+void rope_free(rope_t *r) {
+    if (!r) {
+        return;
+    }
+    for (unsigned int i = 0; i < r->nr_alloc; i++) {
+        free(r->segs[i]);
+    }
+    free(r->segs);
+    free(r->vecs);
+    free(r);
+}
+
+/**
+ * Empty the rope, keeping the segments to use again
+ * @param r is the rope
+ */
+void rope_zero(rope_t *r) {
+    for (unsigned int i = 0; i < r->nr_segs; i++) {
+        sb_zero(r->segs[i]);
+    }
+    r->nr_segs = 0;
+    r->len = 0;
+    r->overflow = false;
+}
+
+/**
+ * Get the storage that has been allocated for the rope
+ * @param r is the rope
+ * @return the total capacity of the segments in use
+ */
+size_t rope_capacity(rope_t *r) {
+    return (size_t)r->nr_segs * ROPE_SEG_SIZE;
+}
+
+// Start using another segment, allocating it if needed
+static strbuf_t *_rope_next(rope_t *r) {
+    if (r->nr_segs == r->nr_alloc) {
+        if (r->nr_alloc == r->max_segs) {
+            unsigned int max = r->max_segs ? r->max_segs * 2 : 8;
+            strbuf_t **segs = realloc(r->segs, max * sizeof(strbuf_t *));
+            if (!segs) {
+                return NULL;
+            }
+            r->segs = segs;
+            struct iovec *vecs = realloc(r->vecs, max * sizeof(struct iovec));
+            if (!vecs) {
+                return NULL;
+            }
+            r->vecs = vecs;
+            r->max_segs = max;
+        }
+        strbuf_t *seg = sb_malloc(ROPE_SEG_SIZE);
+        if (!seg) {
+            return NULL;
+        }
+        r->segs[r->nr_alloc++] = seg;
+    }
+    return r->segs[r->nr_segs++];
+}
+
+/**
+ * Append (by copying) the given data, filling the last segment and then
+ * adding as many more as are needed.
+ * @param r is the rope
+ * @param buf is the new data to copy
+ * @param size is the length of the new data
+ * @return zero, or -1 if the data would not fit, in which case none of it
+ * is stored and the overflow flag is set
+ */
+int rope_append(rope_t *r, const void *buf, size_t size) {
+    if (r->len + size > r->len_max) {
+        r->overflow = true;
+        return -1;
+    }
+
+    const char *src = buf;
+    while (size) {
+        strbuf_t *seg = r->nr_segs ? r->segs[r->nr_segs - 1] : NULL;
+        if (!seg || !sb_avail(seg)) {
+            seg = _rope_next(r);
+            if (!seg) {
+                r->overflow = true;
+                return -1;
+            }
+        }
+
+        size_t len = sb_avail(seg);
+        if (len > size) {
+            len = size;
+        }
+        memcpy(&seg->str[seg->wr_pos], src, len);
+        seg->wr_pos += len;
+        r->len += len;
+        src += len;
+        size -= len;
+    }
+    return 0;
+}
+
+/**
+ * Get a segment with room to append len more bytes, for writing a line
+ * with the sb_put() functions.  rope_commit() must be called once it is
+ * written and before anything else is done with the rope.  The data
+ * reserved for is never split between segments, so the end of a segment
+ * can be left unused.
+ * @param r is the rope
+ * @param len is the most that will be appended, up to ROPE_SEG_SIZE
+ * @return the segment, or NULL if that much might not fit, in which case
+ * the overflow flag is set
+ */
+strbuf_t *rope_reserve(rope_t *r, size_t len) {
+    if (r->len + len > r->len_max || len > ROPE_SEG_SIZE) {
+        r->overflow = true;
+        return NULL;
+    }
+
+    strbuf_t *seg = r->nr_segs ? r->segs[r->nr_segs - 1] : NULL;
+    if (!seg || (size_t)sb_avail(seg) < len) {
+        seg = _rope_next(r);
+        if (!seg) {
+            r->overflow = true;
+            return NULL;
+        }
+    }
+    r->reserved = seg->wr_pos;
+    return seg;
+}
+
+/**
+ * Count what was written to the segment given by rope_reserve()
+ * @param r is the rope
+ */
+void rope_commit(rope_t *r) {
+    r->len += r->segs[r->nr_segs - 1]->wr_pos - r->reserved;
+}
+
+/**
+ * Using printf formatting, append the string to the rope.
+ * @return zero, or -1 if it would not fit (see rope_append())
+ */
+int rope_printf(rope_t *r, const char *format, ...) {
+    va_list ap;
+
+    // Most of the time, the output fits in the last segment
+    strbuf_t *seg = r->nr_segs ? r->segs[r->nr_segs - 1] : NULL;
+    if (seg && r->len < r->len_max) {
+        size_t avail = sb_avail(seg);
+        if (avail > r->len_max - r->len) {
+            avail = r->len_max - r->len;
+        }
+        va_start(ap, format);
+        int size = vsnprintf(&seg->str[seg->wr_pos], avail, format, ap);
+        va_end(ap);
+        if (size < 0) {
+            return -1;
+        }
+        if ((size_t)size < avail) {
+            seg->wr_pos += size;
+            r->len += size;
+            return 0;
+        }
+    }
+
+    // Otherwise, it is formatted on its own and then split between the
+    // segments
+    va_start(ap, format);
+    int size = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    if (size < 0) {
+        return -1;
+    }
+
+    char *buf = malloc(size + 1);
+    if (!buf) {
+        r->overflow = true;
+        return -1;
+    }
+    va_start(ap, format);
+    vsnprintf(buf, size + 1, format, ap);
+    va_end(ap);
+
+    int result = rope_append(r, buf, size);
+    free(buf);
+    return result;
+}
+
+/**
+ * Get the segments as an array of iovec, for sending with writev().  The
+ * array belongs to the rope, and stays valid until the rope is next
+ * changed.
+ * @param r is the rope
+ * @param vecs is set to the array
+ * @return the number of entries
+ */
+int rope_iovec(rope_t *r, struct iovec **vecs) {
+    for (unsigned int i = 0; i < r->nr_segs; i++) {
+        r->vecs[i].iov_base = r->segs[i]->str;
+        r->vecs[i].iov_len = sb_len(r->segs[i]);
+    }
+    *vecs = r->vecs;
+    return r->nr_segs;
+}
+
+/**
+ * Copy part of the data out of the rope
+ * @param r is the rope
+ * @param pos is the offset to start from
+ * @param buf is where to copy it to
+ * @param size is the most to copy
+ * @return the number of bytes copied
+ */
+size_t rope_copy(rope_t *r, size_t pos, void *buf, size_t size) {
+    char *dst = buf;
+    size_t copied = 0;
+
+    for (unsigned int i = 0; i < r->nr_segs && copied < size; i++) {
+        size_t len = sb_len(r->segs[i]);
+        if (pos >= len) {
+            pos -= len;
+            continue;
+        }
+        len -= pos;
+        if (len > size - copied) {
+            len = size - copied;
+        }
+        memcpy(&dst[copied], &r->segs[i]->str[pos], len);
+        copied += len;
+        pos = 0;
+    }
+    return copied;
+}
+
+/**
+ * Write all of the rope to a blocking file descriptor
+ * @param fd is the file descriptor to write to
+ * @param r is the rope
+ * @return the number of bytes written or -1 for error
+ */
+ssize_t rope_write(int fd, rope_t *r) {
+    for (unsigned int i = 0; i < r->nr_segs; i++) {
+        strbuf_t *seg = r->segs[i];
+        size_t pos = 0;
+        while (pos < sb_len(seg)) {
+            ssize_t size = write(fd, &seg->str[pos], sb_len(seg) - pos);
+            if (size == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            pos += size;
+        }
+    }
+    return r->len;
+}
@@ -0,0 +1,53 @@
+/** @file
+ * Internal interface definitions for the segmented buffers
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef ROPE_H
+#define ROPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "strbuf.h"
+
+/**
+ * The size of each segment
+ */
+#define ROPE_SEG_SIZE (64*1024)
+
+/**
+ * A buffer made of a chain of fixed size strbuf segments.  Appending never
+ * moves the data already stored, so a large body does not get copied each
+ * time it grows, and the segments can be sent with writev() as they are.
+ * Data that would take the length past len_max is not stored at all, and
+ * sets the overflow flag instead.
+ */
+typedef struct rope {
+    size_t len;                 //!< The length of the stored data
+    size_t len_max;             //!< The most data that may be stored
+    bool overflow;              //!< Set once anything did not fit
+    unsigned int nr_segs;       //!< The number of segments in use
+    unsigned int nr_alloc;      //!< The number of segments allocated
+    unsigned int max_segs;      //!< Room in the arrays for this many
+    unsigned int reserved;      //!< Where the rope_reserve() started
+    strbuf_t **segs;
+    struct iovec *vecs;         //!< The view made by rope_iovec()
+} rope_t;
+
+rope_t *rope_malloc(size_t);
+void rope_free(rope_t *);
+void rope_zero(rope_t *);
+size_t rope_capacity(rope_t *);
+int rope_append(rope_t *, const void *, size_t);
+strbuf_t *rope_reserve(rope_t *, size_t);
+void rope_commit(rope_t *);
+int rope_printf(rope_t *, const char *, ...)
+__attribute__ ((format (printf, 2, 3)));
+int rope_iovec(rope_t *, struct iovec **);
+size_t rope_copy(rope_t *, size_t, void *, size_t);
+ssize_t rope_write(int, rope_t *);
+#endif
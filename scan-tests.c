@@ -0,0 +1,69 @@
+/*
+ * Tests for the vectorised line scanner
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+
+// Check one version against the simple answer for every start and end
+// position, so every block alignment and tail length is covered
+static void scan_check(const char *buf, size_t len) {
+    for (size_t start = 0; start < len; start++) {
+        for (size_t stop = start; stop <= len; stop++) {
+            const char *p = &buf[start];
+            const char *end = &buf[stop];
+            const char *want = memchr(p, '\n', stop - start);
+            size_t linelen = (want ? want : end) - p;
+            int want_tag = memmem(p, linelen, SCAN_TAG, 4) != NULL;
+
+            int tagged = -1;
+            const char *got = scan_line(p, end, &tagged);
+            assert(got==want);
+            assert(tagged==want_tag);
+        }
+    }
+}
+
+// Tests are silent and return if everything is OK, or abort if issues
+void scan_tests() {
+    char buf[200];
+
+    // A mix of lines, tags, near misses and tags on block boundaries
+    memset(buf, 'x', sizeof(buf));
+    memcpy(&buf[3], "ACCT", 4);
+    buf[10] = '\n';
+    memcpy(&buf[14], "ACC", 3);
+    memcpy(&buf[30], "ACCT", 4);
+    buf[60] = '\n';
+    buf[61] = '\n';
+    memcpy(&buf[62], "AACCT", 5);
+    memcpy(&buf[94], "ACCT", 4);
+    buf[140] = '\n';
+    memcpy(&buf[160], "ACCT", 4);
+    memcpy(&buf[196], "ACCT", 4);
+
+    const char *names[] = { "scalar", "sse2", "avx2" };
+    for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (scan_use(names[i]) == -1) {
+            printf("scan: %s not supported\n", names[i]);
+            continue;
+        }
+        assert(strcmp(scan_name(), names[i])==0);
+        scan_check(buf, sizeof(buf));
+    }
+
+    assert(scan_use("unknown")==-1);
+}
+
+int main() {
+    printf("Running scan tests\n");
+    scan_tests();
+}
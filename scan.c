@@ -0,0 +1,231 @@
+/** @file
+ * Find the end of a line, and check if it holds the accounting tag, with
+ * a single pass over the data.
+ *
+ * Most of the lines in a full iptables-save dump are not accounting rules,
+ * so finding the few tagged lines cheaply avoids tokenising the rest.
+ * On x86 the data is checked in 16 (SSE2) or 32 (AVX2) byte blocks, with
+ * the best version picked at runtime.  Anything else uses the scalar
+ * version.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#define TAG_LEN (sizeof(SCAN_TAG) - 1)
+
+typedef const char *(*scan_fn_t)(const char *, const char *, int *);
+
+static const char *scan_line_scalar(const char *p, const char *end,
+        int *tagged) {
+    int tag = 0;
+
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            *tagged = tag;
+            return p;
+        }
+        if (*p == SCAN_TAG[0] && (size_t)(end - p) >= TAG_LEN &&
+                memcmp(p, SCAN_TAG, TAG_LEN) == 0) {
+            tag = 1;
+        }
+    }
+    *tagged = tag;
+    return NULL;
+}
+
+#ifdef SCAN_X86
+/*
+ * The vector versions compare each block, and the same block shifted by
+ * one, two and three bytes, against the tag characters.  ANDing those
+ * results gives a bit for each position that starts a whole tag, so tags
+ * that cross a block boundary are still found.  As the tag has no newline
+ * in it, any tag found before the first newline is within the line.
+ */
+
+__attribute__((target("sse2")))
+static const char *scan_line_sse2(const char *p, const char *end,
+        int *tagged) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i t0 = _mm_set1_epi8(SCAN_TAG[0]);
+    const __m128i t1 = _mm_set1_epi8(SCAN_TAG[1]);
+    const __m128i t2 = _mm_set1_epi8(SCAN_TAG[2]);
+    const __m128i t3 = _mm_set1_epi8(SCAN_TAG[3]);
+    uint32_t tag = 0;
+
+    while (end - p >= 16 + 3) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 2));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(p + 3));
+
+        uint32_t lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v0, nl));
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(v0, t0), _mm_cmpeq_epi8(v1, t1)),
+            _mm_and_si128(_mm_cmpeq_epi8(v2, t2), _mm_cmpeq_epi8(v3, t3))
+        );
+        uint32_t tags = _mm_movemask_epi8(m);
+
+        if (lines) {
+            // Only the tags before the newline count
+            tags &= (lines & -lines) - 1;
+            *tagged = (tag | tags) != 0;
+            return p + __builtin_ctz(lines);
+        }
+        tag |= tags;
+        p += 16;
+    }
+
+    int tail;
+    const char *nlp = scan_line_scalar(p, end, &tail);
+    *tagged = tag || tail;
+    return nlp;
+}
+
+__attribute__((target("avx2")))
+static const char *scan_line_avx2(const char *p, const char *end,
+        int *tagged) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i t0 = _mm256_set1_epi8(SCAN_TAG[0]);
+    const __m256i t1 = _mm256_set1_epi8(SCAN_TAG[1]);
+    const __m256i t2 = _mm256_set1_epi8(SCAN_TAG[2]);
+    const __m256i t3 = _mm256_set1_epi8(SCAN_TAG[3]);
+    uint32_t tag = 0;
+
+    while (end - p >= 32 + 3) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)(p + 3));
+
+        uint32_t lines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, nl));
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(v0, t0),
+                _mm256_cmpeq_epi8(v1, t1)
+            ),
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(v2, t2),
+                _mm256_cmpeq_epi8(v3, t3)
+            )
+        );
+        uint32_t tags = _mm256_movemask_epi8(m);
+
+        if (lines) {
+            // Only the tags before the newline count
+            tags &= (lines & -lines) - 1;
+            *tagged = (tag | tags) != 0;
+            return p + __builtin_ctz(lines);
+        }
+        tag |= tags;
+        p += 32;
+    }
+
+    int tail;
+    const char *nlp = scan_line_scalar(p, end, &tail);
+    *tagged = tag || tail;
+    return nlp;
+}
+#endif
+
+static const struct scan_impl {
+    const char *name;
+    scan_fn_t fn;
+} scan_impls[] = {
+#ifdef SCAN_X86
+    { "avx2", scan_line_avx2 },
+    { "sse2", scan_line_sse2 },
+#endif
+    { "scalar", scan_line_scalar },
+};
+
+#define NR_IMPLS (sizeof(scan_impls) / sizeof(scan_impls[0]))
+
+static int scan_supported(const struct scan_impl *impl) {
+#ifdef SCAN_X86
+    if (impl->fn == scan_line_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (impl->fn == scan_line_sse2) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return impl->fn == scan_line_scalar;
+}
+
+static const struct scan_impl *scan_best(void) {
+    unsigned int i;
+    for (i = 0; i < NR_IMPLS - 1; i++) {
+        if (scan_supported(&scan_impls[i])) {
+            break;
+        }
+    }
+    return &scan_impls[i];
+}
+
+// The version in use, which is chosen by whichever thread needs it first
+static const struct scan_impl *scan_current = NULL;
+
+static const struct scan_impl *scan_get(void) {
+    const struct scan_impl *impl = __atomic_load_n(&scan_current,
+            __ATOMIC_ACQUIRE);
+    if (impl) {
+        return impl;
+    }
+
+    // If another thread got there first, its choice is kept
+    const struct scan_impl *best = scan_best();
+    if (__atomic_compare_exchange_n(&scan_current, &impl, best, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return best;
+    }
+    return impl;
+}
+
+/**
+ * Find the end of the line starting at p.
+ * @param p is the start of the line
+ * @param end is the end of the available data
+ * @param tagged is set to true if the SCAN_TAG appears in the line
+ * @return the newline at the end of the line, or NULL if there is no
+ * newline before the end of the data
+ */
+const char *scan_line(const char *p, const char *end, int *tagged) {
+    return scan_get()->fn(p, end, tagged);
+}
+
+/**
+ * Choose which version of the scanner to use, instead of the best one
+ * the CPU supports.  This is mainly useful for tests and benchmarks.
+ * @param name is "avx2", "sse2" or "scalar"
+ * @return zero, or -1 if that version is unknown or not supported
+ */
+int scan_use(const char *name) {
+    for (unsigned int i = 0; i < NR_IMPLS; i++) {
+        if (strcmp(scan_impls[i].name, name) == 0) {
+            if (!scan_supported(&scan_impls[i])) {
+                return -1;
+            }
+            __atomic_store_n(&scan_current, &scan_impls[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @return the name of the scanner version in use
+ */
+const char *scan_name(void) {
+    return scan_get()->name;
+}
@@ -0,0 +1,19 @@
+/** @file
+ * Internal interface definitions for the vectorised line scanner
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+/**
+ * The tag that marks an accounting rule
+ */
+#define SCAN_TAG "ACCT"
+
+const char *scan_line(const char *, const char *, int *);
+int scan_use(const char *);
+const char *scan_name(void);
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Tests for the accounting counter store
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+
+static void add(store_t *st, const char *packets, const char *bytes,
+        const char *chain, const char *proto, const char *port, int matched) {
+    struct linedata d;
+    d.packets = acct_slice(packets);
+    d.bytes = acct_slice(bytes);
+    d.chain = acct_slice(chain);
+    d.proto = acct_slice(proto);
+    d.port = acct_slice(port);
+    d.matched = matched;
+    store_add(&d, st);
+}
+
+static int label_is(store_t *st, uint32_t id, const char *want) {
+    slice_t s = store_label(st, id);
+    return s.len == strlen(want) && memcmp(s.str, want, s.len) == 0;
+}
+
+// Tests are silent and return if everything is OK, or abort if issues
+void store_tests() {
+    store_t *st = store_malloc();
+    assert(st);
+    assert(st->nr_rows==0);
+
+    // Only the accounting rules are kept
+    add(st, "1", "2", "INPUT", "tcp", "22", 1);
+    add(st, "3", "4", "INPUT", "udp", "53", 0);
+    add(st, "18446744073709551615", "6", "OUTPUT", "tcp", NULL, 1);
+    assert(st->nr_rows==2);
+    assert(st->packets[0]==1);
+    assert(st->bytes[0]==2);
+    assert(st->packets[1]==UINT64_MAX);
+    assert(label_is(st, st->chain[0], "INPUT"));
+    assert(label_is(st, st->chain[1], "OUTPUT"));
+    assert(label_is(st, st->port[0], "22"));
+    assert(st->port[1]==STORE_NONE);
+    assert(store_label(st, st->port[1]).str==NULL);
+
+    // Repeated labels share the same id
+    assert(st->proto[0]==st->proto[1]);
+    assert(st->nr_labels==4);
+
+    // Enough rows and labels to need the storage to grow
+    for (int i = 0; i < 1000; i++) {
+        char port[12];
+        snprintf(port, sizeof(port), "%i", i);
+        add(st, port, port, "INPUT", "tcp", port, 1);
+    }
+    assert(!st->error);
+    assert(st->nr_rows==1002);
+    for (int i = 0; i < 1000; i++) {
+        char port[12];
+        snprintf(port, sizeof(port), "%i", i);
+        assert(st->bytes[i + 2]==(uint64_t)i);
+        assert(label_is(st, st->port[i + 2], port));
+    }
+
+    // Only the labels change the fingerprint
+    uint64_t fingerprint = store_fingerprint(st);
+    st->packets[5]++;
+    assert(store_fingerprint(st)==fingerprint);
+    st->port[5] = st->port[6];
+    assert(store_fingerprint(st)!=fingerprint);
+
+    store_zero(st);
+    assert(st->nr_rows==0);
+    assert(st->nr_labels==0);
+    add(st, "1", "2", "INPUT", "tcp", "22", 1);
+    assert(st->chain[0]==0);
+
+    store_free(st);
+}
+
+int main() {
+    printf("Running store tests\n");
+
+    // Many sizes are acceptable, so this is informational only
+    printf("sizeof(store_t) = %li\n", sizeof(store_t));
+
+    store_tests();
+}
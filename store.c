@@ -0,0 +1,273 @@
+/** @file
+ * Hold the counters from each refresh in a structured form.
+ *
+ * The collectors pass every rule to store_add(), which keeps the
+ * accounting rules as rows of parsed numbers and interned label ids.  The
+ * output renderers then work from the store, without needing to know
+ * which collector was used or re-parsing any strings.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+
+#define STORE_ROWS_INITIAL 16
+#define STORE_LABELS_INITIAL 16
+#define STORE_TEXT_MAX (16*1024*1024)
+
+/**
+ * Allocate an empty store.
+ * The storage is allocated as it is needed and is kept when the store is
+ * zeroed, so it only grows to fit the largest refresh.
+ * @return the store or NULL
+ */
+store_t *store_malloc(void) {
+    store_t *st = calloc(1, sizeof(store_t));
+    if (!st) {
+        return NULL;
+    }
+    st->text = sb_malloc(256);
+    if (!st->text) {
+        free(st);
+        return NULL;
+    }
+    st->text->capacity_max = STORE_TEXT_MAX;
+    return st;
+}
+
+void store_free(store_t *st) {
+    free(st->packets);
+    free(st->bytes);
+    free(st->chain);
+    free(st->proto);
+    free(st->port);
+    free(st->label_offset);
+    free(st->label_len);
+    free(st->label_hash);
+    free(st->index);
+    free(st->text);
+    free(st);
+}
+
+/**
+ * Forget all the rows and labels, without changing any allocations
+ */
+void store_zero(store_t *st) {
+    st->nr_rows = 0;
+    st->nr_labels = 0;
+    if (st->index) {
+        memset(st->index, 0xff, (st->mask + 1) * sizeof(st->index[0]));
+    }
+    sb_zero(st->text);
+    st->error = 0;
+}
+
+// Resize one column array, keeping the old one if that fails
+static int store_resize(void **column, size_t size) {
+    void *p = realloc(*column, size);
+    if (!p) {
+        return -1;
+    }
+    *column = p;
+    return 0;
+}
+
+static int store_grow_rows(store_t *st) {
+    unsigned int max = st->max_rows ? st->max_rows * 2 : STORE_ROWS_INITIAL;
+
+    if (store_resize((void **)&st->packets, max * sizeof(uint64_t)) ||
+            store_resize((void **)&st->bytes, max * sizeof(uint64_t)) ||
+            store_resize((void **)&st->chain, max * sizeof(uint32_t)) ||
+            store_resize((void **)&st->proto, max * sizeof(uint32_t)) ||
+            store_resize((void **)&st->port, max * sizeof(uint32_t))) {
+        return -1;
+    }
+    st->max_rows = max;
+    return 0;
+}
+
+static int store_grow_labels(store_t *st) {
+    unsigned int max = st->max_labels ?
+        st->max_labels * 2 : STORE_LABELS_INITIAL;
+
+    if (store_resize((void **)&st->label_offset, max * sizeof(uint32_t)) ||
+            store_resize((void **)&st->label_len, max * sizeof(uint32_t)) ||
+            store_resize((void **)&st->label_hash, max * sizeof(uint32_t))) {
+        return -1;
+    }
+
+    // Keep the hash index at most half full
+    unsigned int size = max * 2;
+    int32_t *index = malloc(size * sizeof(int32_t));
+    if (!index) {
+        return -1;
+    }
+    memset(index, 0xff, size * sizeof(int32_t));
+
+    for (unsigned int i = 0; i < st->nr_labels; i++) {
+        unsigned int pos = st->label_hash[i] & (size - 1);
+        while (index[pos] != -1) {
+            pos = (pos + 1) & (size - 1);
+        }
+        index[pos] = i;
+    }
+
+    free(st->index);
+    st->index = index;
+    st->mask = size - 1;
+    st->max_labels = max;
+    return 0;
+}
+
+// FNV-1a
+static uint32_t store_hash(slice_t s) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < s.len; i++) {
+        hash ^= (uint8_t)s.str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the id for a label, adding it if it is new
+ * @return the label id, or STORE_NONE for a missing label or if there was
+ * no room to add it
+ */
+static uint32_t store_intern(store_t *st, slice_t s) {
+    if (!s.str) {
+        return STORE_NONE;
+    }
+
+    if (st->nr_labels == st->max_labels && store_grow_labels(st)) {
+        st->error = 1;
+        return STORE_NONE;
+    }
+
+    uint32_t hash = store_hash(s);
+    unsigned int pos = hash & st->mask;
+    while (st->index[pos] != -1) {
+        uint32_t id = st->index[pos];
+        if (st->label_hash[id] == hash && st->label_len[id] == s.len &&
+                memcmp(&st->text->str[st->label_offset[id]], s.str, s.len)
+                == 0) {
+            return id;
+        }
+        pos = (pos + 1) & st->mask;
+    }
+
+    if ((size_t)sb_avail(st->text) < s.len) {
+        size_t size = st->text->capacity * 2;
+        if (size < sb_len(st->text) + s.len) {
+            size = sb_len(st->text) + s.len;
+        }
+        if (!sb_realloc(&st->text, size) ||
+                (size_t)sb_avail(st->text) < s.len) {
+            st->error = 1;
+            return STORE_NONE;
+        }
+    }
+    uint32_t offset = sb_len(st->text);
+    sb_append(st->text, (void *)s.str, s.len);
+
+    uint32_t id = st->nr_labels++;
+    st->label_offset[id] = offset;
+    st->label_len[id] = s.len;
+    st->label_hash[id] = hash;
+    st->index[pos] = id;
+    return id;
+}
+
+// Convert the decimal digits at the start of a counter string
+static uint64_t store_u64(slice_t s) {
+    uint64_t val = 0;
+    for (size_t i = 0; i < s.len && s.str[i] >= '0' && s.str[i] <= '9';
+            i++) {
+        val = val * 10 + (s.str[i] - '0');
+    }
+    return val;
+}
+
+/**
+ * Add a row for a rule, if it is an accounting rule.
+ * This has the linedata_cb_t signature so it can be given directly to a
+ * collector.
+ * @param d is the rule details
+ * @param arg is the store
+ */
+void store_add(struct linedata *d, void *arg) {
+    store_t *st = arg;
+
+    if (d->matched != 1) {
+        return;
+    }
+
+    if (st->nr_rows == st->max_rows && store_grow_rows(st)) {
+        st->error = 1;
+        return;
+    }
+
+    unsigned int row = st->nr_rows++;
+    st->packets[row] = store_u64(d->packets);
+    st->bytes[row] = store_u64(d->bytes);
+    st->chain[row] = store_intern(st, d->chain);
+    st->proto[row] = store_intern(st, d->proto);
+    st->port[row] = store_intern(st, d->port);
+}
+
+/**
+ * Get the text of a label.
+ * @param st is the store
+ * @param id is the label id
+ * @return the label, which is only valid until the store is next changed,
+ * or a slice with a NULL str for a missing label
+ */
+slice_t store_label(store_t *st, uint32_t id) {
+    slice_t s;
+    if (id == STORE_NONE) {
+        s.str = NULL;
+        s.len = 0;
+        return s;
+    }
+    s.str = &st->text->str[st->label_offset[id]];
+    s.len = st->label_len[id];
+    return s;
+}
+
+// FNV-1a, continuing from the given hash
+static uint64_t store_hash64(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Identify the structure of the stored rules.
+ * Everything except the counters is included, so the fingerprint only
+ * changes when the accounting rules or their labels change.
+ * @param st is the store
+ * @return the fingerprint, which is never zero
+ */
+uint64_t store_fingerprint(store_t *st) {
+    uint64_t hash = 14695981039346656037ull;
+    uint32_t *columns[] = { st->chain, st->proto, st->port };
+
+    hash = store_hash64(hash, &st->nr_rows, sizeof(st->nr_rows));
+    for (unsigned int i = 0; i < st->nr_rows; i++) {
+        for (unsigned int c = 0; c < 3; c++) {
+            // The length is included so that the labels cannot run together
+            slice_t label = store_label(st, columns[c][i]);
+            uint32_t len = label.str ? label.len : UINT32_MAX;
+            hash = store_hash64(hash, &len, sizeof(len));
+            hash = store_hash64(hash, label.str, label.len);
+        }
+    }
+    return hash ? hash : 1;
+}
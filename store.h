@@ -0,0 +1,54 @@
+/** @file
+ * Internal interface definitions for the accounting counter store
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+
+#include "accounting.h"
+#include "strbuf.h"
+
+/**
+ * The label id used when a label is missing
+ */
+#define STORE_NONE UINT32_MAX
+
+/**
+ * The counters from one refresh, with one row for each accounting rule.
+ * The columns are stored as separate arrays and the label strings are
+ * interned, so the memory used depends on the number of accounting rules
+ * and not on the size of the ruleset they were read from.
+ */
+typedef struct store {
+    unsigned int nr_rows;       //!< The number of rows in use
+    unsigned int max_rows;      //!< The number of rows allocated
+    uint64_t *packets;
+    uint64_t *bytes;
+    uint32_t *chain;            //!< Label id for each row
+    uint32_t *proto;            //!< Label id for each row
+    uint32_t *port;             //!< Label id for each row
+
+    unsigned int nr_labels;     //!< The number of interned labels
+    unsigned int max_labels;    //!< The number of labels allocated
+    uint32_t *label_offset;     //!< Where each label is in the text
+    uint32_t *label_len;
+    uint32_t *label_hash;
+    unsigned int mask;          //!< Size of the hash index, less one
+    int32_t *index;             //!< Open addressed hash index of labels
+    strbuf_t *text;             //!< The text of all the labels
+
+    int error;                  //!< Set if a row could not be added
+} store_t;
+
+store_t *store_malloc(void);
+void store_free(store_t *);
+void store_zero(store_t *);
+void store_add(struct linedata *, void *);
+slice_t store_label(store_t *, uint32_t);
+uint64_t store_fingerprint(store_t *);
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Benchmark rendering the metrics lines with printf against the typed
+ * strbuf appenders
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rope.h"
+#include "strbuf.h"
+
+#define REPEAT 20
+
+// The label values of one rule, as the store would have them
+struct row {
+    char chain[32];
+    char proto[8];
+    char port[8];
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/*
+ * The labels formatted with snprintf and each line with sb_reprintf, into
+ * a strbuf that is grown to the size needed, as the renderer did before
+ */
+static size_t run_reprintf(struct row *rows, int nr_rows) {
+    strbuf_t *p = sb_malloc(1000);
+    p->capacity_max = 64*1024*1024;
+    for (int i = 0; i < nr_rows; i++) {
+        char labels[100];
+        snprintf(labels, sizeof(labels),
+                "chain=\"%s\",proto=\"%s\",port=\"%s\"",
+                rows[i].chain, rows[i].proto, rows[i].port);
+
+        sb_reprintf(&p, "iptables_acct_packets_total{%s} %" PRIu64 "\n",
+                labels, rows[i].packets);
+        sb_reprintf(&p, "iptables_acct_bytes_total{%s} %" PRIu64 "\n",
+                labels, rows[i].bytes);
+    }
+    size_t len = sb_len(p);
+    free(p);
+    return len;
+}
+
+static void put_labels(strbuf_t *p, struct row *row) {
+    sb_put(p, SB_LIT("chain=\""));
+    sb_put(p, row->chain, strlen(row->chain));
+    sb_put(p, SB_LIT("\",proto=\""));
+    sb_put(p, row->proto, strlen(row->proto));
+    sb_put(p, SB_LIT("\",port=\""));
+    sb_put(p, row->port, strlen(row->port));
+    sb_put(p, SB_LIT("\""));
+}
+
+// The same lines, with the room for each row reserved once
+static size_t run_put(struct row *rows, int nr_rows) {
+    strbuf_t *p = sb_malloc(1000);
+    p->capacity_max = 64*1024*1024;
+    for (int i = 0; i < nr_rows; i++) {
+        if (!sb_reserve(&p, 300)) {
+            abort();
+        }
+        sb_put(p, SB_LIT("iptables_acct_packets_total{"));
+        put_labels(p, &rows[i]);
+        sb_put(p, SB_LIT("} "));
+        sb_put_u64(p, rows[i].packets);
+        sb_put(p, SB_LIT("\niptables_acct_bytes_total{"));
+        put_labels(p, &rows[i]);
+        sb_put(p, SB_LIT("} "));
+        sb_put_u64(p, rows[i].bytes);
+        sb_put(p, SB_LIT("\n"));
+    }
+    size_t len = sb_len(p);
+    free(p);
+    return len;
+}
+
+// The same again, into the segments of a rope as the body is made
+static size_t run_rope(struct row *rows, int nr_rows) {
+    rope_t *r = rope_malloc(64*1024*1024);
+    for (int i = 0; i < nr_rows; i++) {
+        strbuf_t *p = rope_reserve(r, 300);
+        if (!p) {
+            abort();
+        }
+        sb_put(p, SB_LIT("iptables_acct_packets_total{"));
+        put_labels(p, &rows[i]);
+        sb_put(p, SB_LIT("} "));
+        sb_put_u64(p, rows[i].packets);
+        sb_put(p, SB_LIT("\niptables_acct_bytes_total{"));
+        put_labels(p, &rows[i]);
+        sb_put(p, SB_LIT("} "));
+        sb_put_u64(p, rows[i].bytes);
+        sb_put(p, SB_LIT("\n"));
+        rope_commit(r);
+    }
+    size_t len = r->len;
+    rope_free(r);
+    return len;
+}
+
+static struct row *generate(int nr_rows) {
+    struct row *rows = malloc(nr_rows * sizeof(struct row));
+    if (!rows) {
+        abort();
+    }
+    uint64_t seed = 1;
+    for (int i = 0; i < nr_rows; i++) {
+        snprintf(rows[i].chain, sizeof(rows[i].chain), "PREROUTING");
+        snprintf(rows[i].proto, sizeof(rows[i].proto), i & 1 ? "udp" : "tcp");
+        snprintf(rows[i].port, sizeof(rows[i].port), "%i", i % 65536);
+
+        // Counters of every size, as a long running host would have
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        rows[i].packets = seed >> (seed & 63);
+        rows[i].bytes = rows[i].packets * 1500;
+    }
+    return rows;
+}
+
+static void bench(const char *name, size_t (*fn)(struct row *, int),
+        struct row *rows, int nr_rows) {
+    struct timespec t0, t1;
+    size_t len = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < REPEAT; i++) {
+        len = fn(rows, nr_rows);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    ns /= REPEAT;
+    printf("%8i rows %-10s %10zu bytes %7.1f ns/row %8.1f MB/s\n",
+            nr_rows, name, len, ns / nr_rows, len / ns * 1e3);
+}
+
+int main(int argc, char **argv) {
+    int sizes[] = { 1000, 100000 };
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int nr_rows = sizes[i];
+        if (argc > 1) {
+            nr_rows = atoi(argv[1]) * (i + 1);
+        }
+
+        struct row *rows = generate(nr_rows);
+        bench("reprintf", run_reprintf, rows, nr_rows);
+        bench("put", run_put, rows, nr_rows);
+        bench("rope", run_rope, rows, nr_rows);
+        free(rows);
+    }
+}
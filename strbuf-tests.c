@@ -6,9 +6,11 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "strbuf.h"
 
@@ -88,6 +90,144 @@ void strbuf_tests() {
     free(p);
 }
 
+void strbuf_reread_tests() {
+    int fds[2];
+    char buf[300];
+    memset(buf, 'x', sizeof(buf));
+
+    int r = pipe(fds);
+    assert(r==0);
+    r = write(fds[1], buf, sizeof(buf));
+    assert(r==sizeof(buf));
+    close(fds[1]);
+
+    strbuf_t *p = sb_malloc(10);
+    p->capacity_max = 1000;
+    ssize_t n = sb_reread(&p, fds[0]);
+    assert(n==300);
+    assert(p->wr_pos==300);
+    assert(!memcmp(p->str, buf, 300));
+    close(fds[0]);
+
+    // The read stops once the max capacity is reached
+    r = pipe(fds);
+    assert(r==0);
+    r = write(fds[1], buf, sizeof(buf));
+    assert(r==sizeof(buf));
+    close(fds[1]);
+
+    sb_zero(p);
+    p->capacity_max = 100;
+    sb_realloc(&p, 10);
+    n = sb_reread(&p, fds[0]);
+    assert(n==100);
+    assert(sb_full(p));
+    close(fds[0]);
+
+    free(p);
+}
+
+void strbuf_getline_tests() {
+    int fds[2];
+    char buf[300];
+    memset(buf, 'x', sizeof(buf));
+    buf[4] = '\n';
+    buf[5] = '\n';
+    buf[250] = '\n';
+
+    int r = pipe(fds);
+    assert(r==0);
+    r = write(fds[1], buf, sizeof(buf));
+    assert(r==sizeof(buf));
+    close(fds[1]);
+
+    // Lines longer than the initial buffer are handled, and the last line
+    // does not need a newline
+    strbuf_t *p = sb_malloc(10);
+    p->capacity_max = 1000;
+    char *line;
+    ssize_t n = sb_getline(&p, fds[0], &line);
+    assert(n==4);
+    assert(line[0]=='x');
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==0);
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==244);
+    assert(line[243]=='x');
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==49);
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==-1);
+    close(fds[0]);
+
+    // A line that will not fit is returned in pieces
+    r = pipe(fds);
+    assert(r==0);
+    r = write(fds[1], buf, sizeof(buf));
+    assert(r==sizeof(buf));
+    close(fds[1]);
+
+    sb_zero(p);
+    p->capacity_max = 100;
+    sb_realloc(&p, 10);
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==4);
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==0);
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==100);
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==100);
+    n = sb_getline(&p, fds[0], &line);
+    assert(n==44);
+    close(fds[0]);
+
+    n = sb_getline(&p, -1, &line);
+    assert(n==-2);
+
+    free(p);
+}
+
+void strbuf_put_tests() {
+    strbuf_t *p = sb_malloc(4);
+    p->capacity_max = 100;
+
+    // Growing doubles the capacity, unless more is needed
+    assert(sb_reserve(&p, 4)==p);
+    assert(p->capacity==4);
+    assert(sb_reserve(&p, 5));
+    assert(p->capacity==8);
+    assert(sb_reserve(&p, 30));
+    assert(p->capacity==30);
+    assert(!sb_reserve(&p, 101));
+    assert(p->capacity==30);
+
+    sb_put(p, SB_LIT("ab"));
+    sb_put(p, "cdef", 2);
+    assert(sb_len(p)==4);
+    assert(memcmp(p->str, "abcd", 4)==0);
+
+    // Every length of number, either side of each power of ten
+    uint64_t val = 1;
+    for (int i = 0; i < SB_U64_MAX; i++) {
+        uint64_t vals[] = { val - 1, val, val + 1, val * 9 };
+        for (int j = 0; j < 4; j++) {
+            if (i == SB_U64_MAX - 1 && j == 3) {
+                vals[j] = UINT64_MAX;
+            }
+            char want[SB_U64_MAX + 1];
+            int len = snprintf(want, sizeof(want), "%" PRIu64, vals[j]);
+            sb_zero(p);
+            sb_put_u64(p, vals[j]);
+            assert(sb_len(p)==(size_t)len);
+            assert(memcmp(p->str, want, len)==0);
+        }
+        val *= 10;
+    }
+
+    free(p);
+}
+
 int main() {
     printf("Running strbuf tests\n");
 
@@ -95,4 +235,7 @@ int main() {
     printf("sizeof(strbuf_t) = %li\n", sizeof(strbuf_t));
 
     strbuf_tests();
+    strbuf_reread_tests();
+    strbuf_getline_tests();
+    strbuf_put_tests();
 }
@@ -6,6 +6,7 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -232,6 +233,95 @@ size_t sb_reprintf(strbuf_t **pp, const char *format, ...) {
     }
 }
 
+/**
+ * Make sure there is room to append len more bytes, so that a series of
+ * sb_put() calls needs only the one check.  When the strbuf has to grow,
+ * it at least doubles, so that reserving a line at a time stays cheap.
+ * @param pp is a pointer to the strbuf pointer, which may be updated
+ * @param len is the most that will be appended
+ * @return the strbuf, or NULL if it would be larger than capacity_max
+ */
+strbuf_t *sb_reserve(strbuf_t **pp, size_t len) {
+    strbuf_t *p = *pp;
+    size_t needed = p->wr_pos + len;
+    if (needed <= p->capacity) {
+        return p;
+    }
+    if (needed > p->capacity_max) {
+        return NULL;
+    }
+
+    size_t size = (size_t)p->capacity * 2;
+    if (size < needed) {
+        size = needed;
+    }
+    return sb_realloc(pp, size);
+}
+
+/**
+ * Append (by copying) a counted string, without any checks.  The room for
+ * it must already have been made with sb_reserve() or similar.  Use
+ * SB_LIT() to give a string literal without it being measured at runtime.
+ * @param p is the strbuf
+ * @param buf is the string
+ * @param len is the length of the string
+ */
+void sb_put(strbuf_t *p, const void *buf, size_t len) {
+    memcpy(&p->str[p->wr_pos], buf, len);
+    p->wr_pos += len;
+}
+
+static const uint64_t sb_pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static const char sb_digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/**
+ * Append a number in decimal, without any checks.  The room for it (at
+ * most SB_U64_MAX bytes) must already have been made.  The number of
+ * digits is found from the highest bit set, and they are then written two
+ * at a time, so there are few branches and no division by a variable.
+ * @param p is the strbuf
+ * @param val is the number
+ */
+void sb_put_u64(strbuf_t *p, uint64_t val) {
+    // An estimate of log10 from log2, which is then corrected
+    unsigned int log2 = 63 - __builtin_clzll(val | 1);
+    unsigned int t = ((log2 + 1) * 1233) >> 12;
+    unsigned int digits = t + 1 - (val < sb_pow10[t]) + (val == 0);
+
+    char *end = &p->str[p->wr_pos + digits];
+    p->wr_pos += digits;
+    while (val >= 100) {
+        unsigned int i = (val % 100) * 2;
+        val /= 100;
+        *--end = sb_digit_pairs[i + 1];
+        *--end = sb_digit_pairs[i];
+    }
+    if (val >= 10) {
+        *--end = sb_digit_pairs[val * 2 + 1];
+        *--end = sb_digit_pairs[val * 2];
+    } else {
+        *--end = '0' + val;
+    }
+}
+
 /**
  * Read from the file descriptor into the strbuf.  Will attempt to read as
  * many bytes as are available in the strbuf.
@@ -248,6 +338,140 @@ ssize_t sb_read(int fd, strbuf_t *p) {
     return size;
 }
 
+/**
+ * Read from the file descriptor until end of file, expanding the strbuf if
+ * needed.  If the strbuf cannot be expanded any further (capacity_max has
+ * been reached) then the reading stops and the strbuf will show the
+ * sb_full() condition.
+ * @param pp is a pointer to strbuf pointer.  This may be updated if there is
+ * a sb_realloc() call.
+ * @param fd is the file descriptor to read from
+ * @return the total length of the stored data or -1 for error
+ */
+ssize_t sb_reread(strbuf_t **pp, int fd) {
+    strbuf_t *p = *pp;
+
+    if (!p) {
+        return -1;
+    }
+
+    while (1) {
+        if (!sb_avail(p)) {
+            if (p->capacity >= p->capacity_max) {
+                // Not allowed to grow any further
+                return sb_len(p);
+            }
+            p = sb_realloc(pp, p->capacity ? p->capacity * 2 : 64);
+            if (!p) {
+                return -1;
+            }
+        }
+
+        ssize_t size = sb_read(fd, p);
+        if (size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (size == 0) {
+            return sb_len(p);
+        }
+    }
+}
+
+/**
+ * Read more data from the file descriptor.
+ * Any data that has already been processed (before the rd_pos) is first
+ * discarded by moving the remaining data to the start of the strbuf, and
+ * the strbuf is expanded if it is still full.
+ * @param pp is a pointer to strbuf pointer.  This may be updated if there is
+ * a sb_realloc() call.
+ * @param fd is the file descriptor to read from
+ * @return the number of bytes read, zero at the end of the file, -1 for
+ * a read error or -2 if the strbuf is full and cannot be expanded
+ */
+ssize_t sb_refill(strbuf_t **pp, int fd) {
+    strbuf_t *p = *pp;
+
+    if (p->rd_pos) {
+        memmove(p->str, &p->str[p->rd_pos], p->wr_pos - p->rd_pos);
+        p->wr_pos -= p->rd_pos;
+        p->rd_pos = 0;
+    }
+
+    if (!sb_avail(p)) {
+        if (p->capacity >= p->capacity_max) {
+            return -2;
+        }
+        p = sb_realloc(pp, p->capacity * 2);
+        if (!p) {
+            return -1;
+        }
+    }
+
+    while (1) {
+        ssize_t size = sb_read(fd, p);
+        if (size == -1 && errno == EINTR) {
+            continue;
+        }
+        return size;
+    }
+}
+
+/**
+ * Get the next line from the strbuf, reading more data from the file
+ * descriptor whenever the strbuf does not hold a complete line.
+ * Lines of any length are handled by expanding the strbuf, up to its
+ * capacity_max - a line longer than that is returned in pieces.
+ * The strbuf rd_pos is used to track the start of the next line, so the
+ * strbuf should start empty and not be otherwise changed between calls.
+ * @param pp is a pointer to strbuf pointer.  This may be updated if there is
+ * a sb_realloc() call.
+ * @param fd is the file descriptor to read from
+ * @param line is set to the start of the line, which is not zero terminated
+ * and is only valid until the next call
+ * @return the length of the line (not including the newline), -1 when there
+ * are no more lines or -2 for a read error
+ */
+ssize_t sb_getline(strbuf_t **pp, int fd, char **line) {
+    size_t scanned = 0;
+
+    while (1) {
+        strbuf_t *p = *pp;
+        char *start = &p->str[p->rd_pos];
+        size_t len = p->wr_pos - p->rd_pos;
+        char *nl = memchr(start + scanned, '\n', len - scanned);
+
+        if (nl) {
+            *line = start;
+            p->rd_pos += nl - start + 1;
+            return nl - start;
+        }
+        scanned = len;
+
+        ssize_t size = sb_refill(pp, fd);
+        if (size == -1) {
+            return -2;
+        }
+        if (size > 0) {
+            continue;
+        }
+
+        // Either the end of the file or no more room, so return any
+        // remaining partial line
+        p = *pp;
+        if (p->wr_pos == p->rd_pos) {
+            return -1;
+        }
+        *line = &p->str[p->rd_pos];
+        len = p->wr_pos - p->rd_pos;
+        p->rd_pos = 0;
+        p->wr_pos = 0;
+        return len;
+    }
+}
+
 /**
  * Write size bytes from the strbuf into a file descriptor.
  * @param fd is the file descriptor to write to
@@ -10,6 +10,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * The strbuf type
@@ -37,6 +39,17 @@ typedef struct strbuf {
         buf->wr_pos = 0; \
 } while(0)
 
+/**
+ * The arguments for appending a string literal, with its length known at
+ * compile time.  Only a literal can be given.
+ */
+#define SB_LIT(s) "" s "", (sizeof(s) - 1)
+
+/**
+ * The most digits in a uint64_t
+ */
+#define SB_U64_MAX 20
+
 void sb_zero(strbuf_t *);
 strbuf_t *sb_malloc(size_t) __attribute__ ((malloc));
 strbuf_t *sb_realloc(strbuf_t **, size_t);
@@ -50,7 +63,13 @@ size_t sb_printf(strbuf_t *, const char *, ...)
 __attribute__ ((format (printf, 2, 3)));
 size_t sb_reprintf(strbuf_t **, const char *, ...)
 __attribute__ ((format (printf, 2, 3)));
+strbuf_t *sb_reserve(strbuf_t **, size_t);
+void sb_put(strbuf_t *, const void *, size_t);
+void sb_put_u64(strbuf_t *, uint64_t);
 ssize_t sb_read(int, strbuf_t *);
+ssize_t sb_reread(strbuf_t **, int);
+ssize_t sb_refill(strbuf_t **, int);
+ssize_t sb_getline(strbuf_t **, int, char **);
 ssize_t sb_write(int, strbuf_t *, int, ssize_t);
 void sb_dump(strbuf_t *);
 
@@ -0,0 +1,105 @@
+/*
+ * Tests for the pre-rendered output templates
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmpl.h"
+
+// Tests are silent and return if everything is OK, or abort if issues
+void tmpl_tests() {
+    tmpl_t *t = tmpl_malloc();
+    assert(t);
+
+    tmpl_zero(t, 42);
+    assert(t->fingerprint==42);
+    assert(!t->valid);
+    for (int i = 0; i < 2; i++) {
+        tmpl_printf(t, "a{n=\"%i\"} ", i);
+        tmpl_hole(t);
+        tmpl_printf(t, "\nb{n=\"%i\"} ", i);
+        tmpl_hole(t);
+        tmpl_printf(t, "\n");
+    }
+    assert(t->nr_holes==4);
+
+    const uint64_t a[] = { 0, UINT64_MAX };
+    const uint64_t b[] = { 10, 7 };
+    const uint64_t *columns[] = { a, b };
+
+    rope_t *r = rope_malloc(1000);
+    rope_printf(r, "x\n");
+    assert(tmpl_render(t, r, columns, 2)==0);
+
+    const char *want =
+        "x\n"
+        "a{n=\"0\"} 0\n"
+        "b{n=\"0\"} 10\n"
+        "a{n=\"1\"} 18446744073709551615\n"
+        "b{n=\"1\"} 7\n";
+    char got[100];
+    assert(r->len==strlen(want));
+    assert(rope_copy(r, 0, got, sizeof(got))==r->len);
+    assert(memcmp(got, want, r->len)==0);
+    rope_free(r);
+
+    // Output that does not fit is not stored, and is reported
+    r = rope_malloc(20);
+    assert(tmpl_render(t, r, columns, 2)==-1);
+    assert(r->overflow);
+    assert(r->len <= 20);
+
+    rope_free(r);
+    tmpl_free(t);
+}
+
+void tmpl_long_tests() {
+    tmpl_t *t = tmpl_malloc();
+    tmpl_zero(t, 42);
+
+    // Long text is kept whole, however much it has to grow
+    char *label = malloc(5000);
+    assert(label);
+    memset(label, 'x', 4999);
+    label[4999] = 0;
+    tmpl_printf(t, "a{n=\"%s\"} ", label);
+    tmpl_hole(t);
+    tmpl_printf(t, "\n");
+    assert(t->fingerprint==42);
+    assert(sb_len(t->text)==4999 + 8 + 1);
+
+    const uint64_t a[] = { 5 };
+    const uint64_t *columns[] = { a };
+    rope_t *r = rope_malloc(10000);
+    assert(tmpl_render(t, r, columns, 1)==0);
+    assert(r->len==4999 + 8 + 2);
+
+    char *got = malloc(r->len);
+    assert(got);
+    assert(rope_copy(r, 0, got, r->len)==r->len);
+    assert(memcmp(got, "a{n=\"xxx", 8)==0);
+    assert(memcmp(&got[r->len - 6], "x\"} 5\n", 6)==0);
+
+    // Text past the limit leaves the template invalid
+    t->text->capacity_max = 12000;
+    tmpl_printf(t, "%s%s", label, label);
+    assert(t->fingerprint==0);
+
+    free(got);
+    free(label);
+    rope_free(r);
+    tmpl_free(t);
+}
+
+int main() {
+    printf("Running tmpl tests\n");
+    tmpl_tests();
+    tmpl_long_tests();
+}
@@ -0,0 +1,148 @@
+/** @file
+ * Cache the text of an output between refreshes.
+ *
+ * The labels in the output only change when the ruleset changes, but the
+ * numbers change every time.  A template keeps the label text with holes
+ * for the numbers, so while the ruleset is unchanged the output is made
+ * by copying the text and writing the digits into the holes, without any
+ * printf formatting.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmpl.h"
+
+#define TMPL_TEXT_MAX (16*1024*1024)
+
+/**
+ * Allocate an empty template
+ * @return the template or NULL
+ */
+tmpl_t *tmpl_malloc(void) {
+    tmpl_t *t = calloc(1, sizeof(tmpl_t));
+    if (!t) {
+        return NULL;
+    }
+    t->text = sb_malloc(1000);
+    if (!t->text) {
+        free(t);
+        return NULL;
+    }
+    t->text->capacity_max = TMPL_TEXT_MAX;
+    return t;
+}
+
+void tmpl_free(tmpl_t *t) {
+    free(t->holes);
+    free(t->text);
+    free(t);
+}
+
+/**
+ * Start building a new template.
+ * The template is invalid until it has been completely built, which is
+ * marked by setting the valid flag.
+ * @param t is the template
+ * @param fingerprint identifies what the template will be for
+ */
+void tmpl_zero(tmpl_t *t, uint64_t fingerprint) {
+    t->fingerprint = fingerprint;
+    t->valid = 0;
+    t->nr_holes = 0;
+    sb_zero(t->text);
+}
+
+/**
+ * Add some text to the template, growing it to fit.  If the text would
+ * make the template too large, the template is left invalid.
+ */
+void tmpl_printf(tmpl_t *t, const char *format, ...) {
+    va_list ap;
+
+    // Most of the time, the text fits in the space already allocated
+    strbuf_t *p = t->text;
+    size_t avail = sb_avail(p);
+    va_start(ap, format);
+    int size = vsnprintf(&p->str[p->wr_pos], avail, format, ap);
+    va_end(ap);
+    if (size < 0) {
+        t->fingerprint = 0;
+        return;
+    }
+    if ((size_t)size < avail) {
+        p->wr_pos += size;
+        return;
+    }
+
+    p = sb_reserve(&t->text, size + 1);
+    if (!p) {
+        // Leaving the template invalid will cause a rebuild
+        t->fingerprint = 0;
+        return;
+    }
+    va_start(ap, format);
+    vsnprintf(&p->str[p->wr_pos], size + 1, format, ap);
+    va_end(ap);
+    p->wr_pos += size;
+}
+
+/**
+ * Add a hole for a number at the current end of the template
+ */
+void tmpl_hole(tmpl_t *t) {
+    if (t->nr_holes == t->max_holes) {
+        unsigned int max = t->max_holes ? t->max_holes * 2 : 64;
+        uint32_t *holes = realloc(t->holes, max * sizeof(uint32_t));
+        if (!holes) {
+            // Leaving the template invalid will cause a rebuild
+            t->fingerprint = 0;
+            return;
+        }
+        t->holes = holes;
+        t->max_holes = max;
+    }
+    t->holes[t->nr_holes++] = sb_len(t->text);
+}
+
+/**
+ * Append the template to a rope, filling in the holes.
+ * The numbers are taken from the columns in turn, so hole n uses
+ * columns[n % nr_columns][n / nr_columns].
+ * @param t is the template
+ * @param r is the rope to append to
+ * @param columns is the array of number columns
+ * @param nr_columns is the number of columns
+ * @return 0 or -1 if it did not all fit, see rope_append()
+ */
+int tmpl_render(tmpl_t *t, rope_t *r, const uint64_t **columns,
+        unsigned int nr_columns) {
+    uint32_t pos = 0;
+    for (unsigned int i = 0; i < t->nr_holes; i++) {
+        size_t len = t->holes[i] - pos;
+        uint64_t val = columns[i % nr_columns][i / nr_columns];
+
+        // The text before each hole is normally a short line, which is
+        // written along with the number after only the one check
+        strbuf_t *p = NULL;
+        if (len + SB_U64_MAX <= ROPE_SEG_SIZE) {
+            p = rope_reserve(r, len + SB_U64_MAX);
+        } else if (rope_append(r, &t->text->str[pos], len) == 0) {
+            len = 0;
+            p = rope_reserve(r, SB_U64_MAX);
+        }
+        if (!p) {
+            return -1;
+        }
+        sb_put(p, &t->text->str[pos], len);
+        sb_put_u64(p, val);
+        rope_commit(r);
+        pos = t->holes[i];
+    }
+    return rope_append(r, &t->text->str[pos], sb_len(t->text) - pos);
+}
@@ -0,0 +1,37 @@
+/** @file
+ * Internal interface definitions for the pre-rendered output templates
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef TMPL_H
+#define TMPL_H
+
+#include <stdint.h>
+
+#include "rope.h"
+#include "strbuf.h"
+
+/**
+ * Rendered output with holes where the numbers go.
+ * The text is stored without the numbers, and each hole records the
+ * offset in the text where its number should be inserted.
+ */
+typedef struct tmpl {
+    uint64_t fingerprint;       //!< Identifies what the template is for
+    int valid;                  //!< Set once the template is complete
+    unsigned int nr_holes;      //!< The number of holes in use
+    unsigned int max_holes;     //!< The number of holes allocated
+    uint32_t *holes;            //!< The text offset for each hole
+    strbuf_t *text;
+} tmpl_t;
+
+tmpl_t *tmpl_malloc(void);
+void tmpl_free(tmpl_t *);
+void tmpl_zero(tmpl_t *, uint64_t);
+void tmpl_printf(tmpl_t *, const char *, ...)
+__attribute__ ((format (printf, 2, 3)));
+void tmpl_hole(tmpl_t *);
+int tmpl_render(tmpl_t *, rope_t *, const uint64_t **, unsigned int);
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Tests for the top-k heavy hitter sketch
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topk.h"
+
+// Tests are silent and return if everything is OK, or abort if issues
+void topk_tests() {
+    // Sizes that could not be allocated are refused
+    assert(!topk_malloc(0, sizeof(uint32_t)));
+    assert(!topk_malloc(TOPK_COUNTERS_MAX + 1, sizeof(uint32_t)));
+    assert(!topk_malloc(UINT32_MAX, sizeof(uint32_t)));
+
+    topk_t *t = topk_malloc(4, sizeof(uint32_t));
+    assert(t);
+    assert(t->nr_counters==4);
+    assert(t->nr_used==0);
+
+    // With no more keys than counters, the counts are exact
+    for (uint32_t key = 1; key <= 4; key++) {
+        for (uint32_t i = 0; i < key; i++) {
+            topk_add(t, &key, 10);
+        }
+    }
+    assert(t->nr_used==4);
+    assert(t->total==100);
+
+    int32_t order[4];
+    unsigned int n = topk_sorted(t, order, 4);
+    assert(n==4);
+    for (unsigned int i = 0; i < n; i++) {
+        uint32_t key;
+        memcpy(&key, topk_key(t, order[i]), sizeof(key));
+        assert(key==4-i);
+        assert(t->counters[order[i]].count==key*10);
+        assert(t->counters[order[i]].error==0);
+    }
+
+    // A new key takes over the smallest counter
+    uint32_t key = 5;
+    topk_add(t, &key, 1);
+    assert(t->nr_used==4);
+    n = topk_sorted(t, order, 4);
+    memcpy(&key, topk_key(t, order[3]), sizeof(key));
+    assert(key==5);
+    assert(t->counters[order[3]].count==11);
+    assert(t->counters[order[3]].error==10);
+
+    topk_zero(t);
+    assert(t->nr_used==0);
+    assert(t->total==0);
+
+    // Heavy keys survive a long tail of light keys, and their counts stay
+    // within the error bound
+    for (uint32_t i = 0; i < 10000; i++) {
+        key = 1000 + i;
+        topk_add(t, &key, 1);
+        if (i % 10 == 0) {
+            key = 1;
+            topk_add(t, &key, 20);
+        }
+        if (i % 20 == 0) {
+            key = 2;
+            topk_add(t, &key, 20);
+        }
+    }
+
+    n = topk_sorted(t, order, 2);
+    assert(n==2);
+    memcpy(&key, topk_key(t, order[0]), sizeof(key));
+    assert(key==1);
+    assert(t->counters[order[0]].count >= 20000);
+    assert(t->counters[order[0]].count - t->counters[order[0]].error <= 20000);
+    memcpy(&key, topk_key(t, order[1]), sizeof(key));
+    assert(key==2);
+    assert(t->counters[order[1]].count >= 10000);
+    assert(t->counters[order[1]].count - t->counters[order[1]].error <= 10000);
+
+    topk_free(t);
+}
+
+int main() {
+    printf("Running topk tests\n");
+
+    // Many sizes are acceptable, so this is informational only
+    printf("sizeof(topk_t) = %li\n", sizeof(topk_t));
+
+    topk_tests();
+}
@@ -0,0 +1,258 @@
+/** @file
+ * A Space-Saving sketch for finding the heaviest keys in a stream.
+ *
+ * Every key that has a counter keeps it until it becomes the smallest
+ * counter and a new key arrives, at which point the new key takes over
+ * the counter (and inherits its count as the error bound).  Any key with a
+ * true total greater than total/nr_counters is guaranteed to be present.
+ *
+ * Each addition costs one hash lookup and O(log nr_counters) heap work.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topk.h"
+
+/**
+ * Allocate a sketch
+ * @param nr_counters is the number of counters to track, up to
+ * TOPK_COUNTERS_MAX
+ * @param keysize is the size of every key, in bytes
+ * @return the sketch or NULL
+ */
+topk_t *topk_malloc(unsigned int nr_counters, size_t keysize) {
+    if (nr_counters < 1 || nr_counters > TOPK_COUNTERS_MAX) {
+        return NULL;
+    }
+    if (keysize > SIZE_MAX / nr_counters) {
+        return NULL;
+    }
+
+    // Keep the hash index at most half full
+    unsigned int size = 1;
+    while (size < nr_counters * 2) {
+        size *= 2;
+    }
+
+    topk_t *t = malloc(sizeof(topk_t) + size * sizeof(t->index[0]));
+    if (!t) {
+        return NULL;
+    }
+    t->nr_counters = nr_counters;
+    t->mask = size - 1;
+    t->keysize = keysize;
+    topk_zero(t);
+
+    // Only added once the index has been cleared, as -fanalyzer loses
+    // track of the other fields when it is
+    t->counters = malloc(nr_counters * sizeof(topk_counter_t));
+    t->keys = malloc(nr_counters * keysize);
+    t->heap = malloc(nr_counters * sizeof(int32_t));
+    if (!t->counters || !t->keys || !t->heap) {
+        topk_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void topk_free(topk_t *t) {
+    free(t->counters);
+    free(t->keys);
+    free(t->heap);
+    free(t);
+}
+
+/**
+ * Forget all the keys, without changing any allocations
+ */
+void topk_zero(topk_t *t) {
+    memset(t->index, 0xff, (t->mask + 1) * sizeof(t->index[0]));
+    t->nr_used = 0;
+    t->total = 0;
+}
+
+const void *topk_key(topk_t *t, int32_t nr) {
+    return &t->keys[nr * t->keysize];
+}
+
+// FNV-1a
+static uint32_t topk_hash(topk_t *t, const void *key) {
+    const uint8_t *p = key;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < t->keysize; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash & t->mask;
+}
+
+// Find the index slot holding the key, or the empty slot where it would go
+static uint32_t topk_find(topk_t *t, const void *key) {
+    uint32_t slot = topk_hash(t, key);
+    while (t->index[slot] != -1) {
+        if (memcmp(topk_key(t, t->index[slot]), key, t->keysize) == 0) {
+            break;
+        }
+        slot = (slot + 1) & t->mask;
+    }
+    return slot;
+}
+
+// Remove a slot from the index, shifting back any following entries that
+// would no longer be reachable
+static void topk_index_remove(topk_t *t, uint32_t hole) {
+    uint32_t slot = hole;
+    while (1) {
+        slot = (slot + 1) & t->mask;
+        if (t->index[slot] == -1) {
+            break;
+        }
+
+        uint32_t home = topk_hash(t, topk_key(t, t->index[slot]));
+
+        // Can the entry at slot stay, or does it need to fill the hole?
+        int stays;
+        if (hole <= slot) {
+            stays = (hole < home) && (home <= slot);
+        } else {
+            stays = (hole < home) || (home <= slot);
+        }
+        if (!stays) {
+            t->index[hole] = t->index[slot];
+            hole = slot;
+        }
+    }
+    t->index[hole] = -1;
+}
+
+static void topk_heap_swap(topk_t *t, int32_t a, int32_t b) {
+    int32_t tmp = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = tmp;
+    t->counters[t->heap[a]].heappos = a;
+    t->counters[t->heap[b]].heappos = b;
+}
+
+static uint64_t topk_heap_count(topk_t *t, int32_t pos) {
+    return t->counters[t->heap[pos]].count;
+}
+
+static void topk_sift_up(topk_t *t, int32_t pos) {
+    while (pos > 0) {
+        int32_t parent = (pos - 1) / 2;
+        if (topk_heap_count(t, parent) <= topk_heap_count(t, pos)) {
+            break;
+        }
+        topk_heap_swap(t, parent, pos);
+        pos = parent;
+    }
+}
+
+static void topk_sift_down(topk_t *t, int32_t pos) {
+    int32_t nr = t->nr_used;
+    while (1) {
+        int32_t smallest = pos;
+        int32_t left = pos * 2 + 1;
+        int32_t right = left + 1;
+
+        if (left < nr && topk_heap_count(t, left) < topk_heap_count(t, smallest)) {
+            smallest = left;
+        }
+        if (right < nr && topk_heap_count(t, right) < topk_heap_count(t, smallest)) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            break;
+        }
+        topk_heap_swap(t, smallest, pos);
+        pos = smallest;
+    }
+}
+
+/**
+ * Add a weight to the total for a key
+ */
+void topk_add(topk_t *t, const void *key, uint64_t weight) {
+    t->total += weight;
+
+    uint32_t slot = topk_find(t, key);
+    int32_t nr = t->index[slot];
+
+    if (nr != -1) {
+        // An existing key, which can only move down the min-heap
+        t->counters[nr].count += weight;
+        topk_sift_down(t, t->counters[nr].heappos);
+        return;
+    }
+
+    if (t->nr_used < t->nr_counters) {
+        // A free counter
+        nr = t->nr_used++;
+        memcpy(&t->keys[nr * t->keysize], key, t->keysize);
+        t->counters[nr].count = weight;
+        t->counters[nr].error = 0;
+        t->counters[nr].heappos = nr;
+        t->heap[nr] = nr;
+        t->index[slot] = nr;
+        topk_sift_up(t, nr);
+        return;
+    }
+
+    // Take over the smallest counter
+    nr = t->heap[0];
+    uint64_t min = t->counters[nr].count;
+
+    topk_index_remove(t, topk_find(t, topk_key(t, nr)));
+    memcpy(&t->keys[nr * t->keysize], key, t->keysize);
+    t->index[topk_find(t, key)] = nr;
+
+    t->counters[nr].count = min + weight;
+    t->counters[nr].error = min;
+    topk_sift_down(t, 0);
+}
+
+static int topk_sort_cmp(const void *a, const void *b, void *arg) {
+    topk_t *t = arg;
+    uint64_t ca = t->counters[*(const int32_t *)a].count;
+    uint64_t cb = t->counters[*(const int32_t *)b].count;
+    if (ca > cb) {
+        return -1;
+    }
+    if (ca < cb) {
+        return 1;
+    }
+
+    // Keep ties in a stable order, for repeatable output
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+/**
+ * Find the counters with the largest counts
+ * @param order is filled with counter numbers, largest count first
+ * @param n is the size of the order array
+ * @return the number of counters placed in the order array
+ */
+unsigned int topk_sorted(topk_t *t, int32_t *order, unsigned int n) {
+    int32_t *all = malloc(t->nr_used * sizeof(int32_t));
+    if (!all) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < t->nr_used; i++) {
+        all[i] = i;
+    }
+
+    qsort_r(all, t->nr_used, sizeof(int32_t), topk_sort_cmp, t);
+
+    if (n > t->nr_used) {
+        n = t->nr_used;
+    }
+    memcpy(order, all, n * sizeof(int32_t));
+    free(all);
+    return n;
+}
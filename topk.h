@@ -0,0 +1,47 @@
+/** @file
+ * Internal interface definitions for the top-k heavy hitter sketch
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct topk_counter {
+    uint64_t count;         //!< Estimated total, never an underestimate
+    uint64_t error;         //!< The most that count could be overestimated
+    int32_t heappos;        //!< Where this counter is in the heap
+} topk_counter_t;
+
+/**
+ * A Space-Saving sketch with a fixed number of counters.
+ * The memory used does not depend on the number of different keys added.
+ */
+typedef struct topk {
+    unsigned int nr_counters;   //!< The number of counters allocated
+    unsigned int nr_used;       //!< The number of counters in use
+    unsigned int mask;          //!< Size of the hash index, less one
+    size_t keysize;             //!< The size of every key, in bytes
+    uint64_t total;             //!< The sum of all the weights added
+    topk_counter_t *counters;
+    uint8_t *keys;              //!< The key for each counter
+    int32_t *heap;              //!< Counters in a min-heap by count
+    int32_t index[];            //!< Open addressed hash index of counters
+} topk_t;
+
+/**
+ * The most counters that a sketch may have
+ */
+#define TOPK_COUNTERS_MAX (1 << 24)
+
+topk_t *topk_malloc(unsigned int, size_t);
+void topk_free(topk_t *);
+void topk_zero(topk_t *);
+void topk_add(topk_t *, const void *, uint64_t);
+unsigned int topk_sorted(topk_t *, int32_t *, unsigned int);
+const void *topk_key(topk_t *, int32_t);
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Tests for the minimal io_uring wrapper
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// Tests are silent and return if everything is OK, or abort if issues
+void uring_tests(uring_t *u) {
+    // Nothing queued, so a wait times out
+    assert(uring_cqe(u)==NULL);
+    assert(uring_enter(u, 1)==-1);
+    assert(errno==ETIME);
+
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    assert(sqe);
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = 42;
+    assert(u->to_submit==1);
+
+    assert(uring_enter(u, -1)==0);
+    assert(u->to_submit==0);
+
+    struct io_uring_cqe *cqe = uring_cqe(u);
+    assert(cqe);
+    assert(cqe->user_data==42);
+    assert(cqe->res==0);
+    uring_cqe_seen(u);
+    assert(uring_cqe(u)==NULL);
+}
+
+void uring_bufs_tests(uring_t *u) {
+    int fds[2];
+    assert(pipe(fds)==0);
+    assert(write(fds[1], "hello", 5)==5);
+
+    // The kernel picks the buffer to read into
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    assert(sqe);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fds[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->len = 16;
+    sqe->user_data = 43;
+
+    assert(uring_enter(u, -1)==0);
+    struct io_uring_cqe *cqe = uring_cqe(u);
+    assert(cqe);
+    assert(cqe->user_data==43);
+    assert(cqe->res==5);
+    assert(cqe->flags & IORING_CQE_F_BUFFER);
+
+    unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    assert(bid < u->nr_bufs);
+    assert(memcmp(uring_buf(u, bid), "hello", 5)==0);
+    uring_cqe_seen(u);
+    uring_buf_recycle(u, bid);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main() {
+    printf("Running uring tests\n");
+
+    uring_t *u = uring_malloc(8, 4, 64);
+    if (!u) {
+        // Informational only, the users fall back to something else
+        printf("io_uring is not available\n");
+        return 0;
+    }
+
+    uring_tests(u);
+    uring_bufs_tests(u);
+    uring_free(u);
+}
@@ -0,0 +1,270 @@
+/** @file
+ * A minimal io_uring wrapper.
+ *
+ * This only covers what the connslot engine needs: one ring, submission
+ * and completion helpers, and a ring of provided buffers so that the
+ * kernel can pick a buffer for each receive.  It uses the system calls
+ * directly, so there is no library dependency, and kernels that do not
+ * have everything that is needed are detected when the ring is set up.
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned int op, void *arg, unsigned int nr) {
+    return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static int uring_syscall(int fd, unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags, void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            arg, argsz);
+}
+
+/**
+ * Set up the provided buffer ring
+ * @return 0 or -1 if the kernel does not support them
+ */
+static int uring_bufs_init(uring_t *u, unsigned int nr_bufs, unsigned int buf_size) {
+    size_t size = nr_bufs * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br == MAP_FAILED) {
+        return -1;
+    }
+    u->br = br;
+    u->nr_bufs = nr_bufs;
+    u->buf_size = buf_size;
+
+    u->bufs = malloc((size_t)nr_bufs * buf_size);
+    if (!u->bufs) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)br;
+    reg.ring_entries = nr_bufs;
+    reg.bgid = URING_BGID;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        return -1;
+    }
+
+    for (unsigned int bid = 0; bid < nr_bufs; bid++) {
+        uring_buf_recycle(u, bid);
+    }
+    return 0;
+}
+
+/**
+ * Create a ring
+ * @param entries is the number of submission queue entries
+ * @param nr_bufs is the number of provided buffers, a power of two
+ * @param buf_size is the size of each provided buffer
+ * @return the ring or NULL if io_uring is not usable here
+ */
+uring_t *uring_malloc(unsigned int entries, unsigned int nr_bufs, unsigned int buf_size) {
+    uring_t *u = calloc(1, sizeof(uring_t));
+    if (!u) {
+        return NULL;
+    }
+    u->fd = -1;
+
+    // Only this thread uses the ring, so the completion work can wait
+    // until we ask for the completions, instead of interrupting us
+    unsigned int flags[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        0,
+    };
+
+    struct io_uring_params p;
+    for (unsigned int i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        memset(&p, 0, sizeof(p));
+        // There are many completions for each multishot submission
+        p.flags = IORING_SETUP_CQSIZE | flags[i];
+        p.cq_entries = entries * 4;
+
+        u->fd = uring_setup(entries, &p);
+        if (u->fd != -1) {
+            break;
+        }
+    }
+    if (u->fd == -1) {
+        goto err;
+    }
+
+    // Needed for the wait timeout and for the rings to be one mapping
+    unsigned int needed = IORING_FEAT_EXT_ARG | IORING_FEAT_SINGLE_MMAP |
+        IORING_FEAT_NODROP;
+    if ((p.features & needed) != needed) {
+        goto err;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        goto err;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto err;
+    }
+
+    char *ring = u->ring;
+    u->sq_entries = p.sq_entries;
+    u->sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+    u->sq_khead = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_ktail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_array = (unsigned int *)(ring + p.sq_off.array);
+    u->sq_tail = *u->sq_ktail;
+    u->cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cq_khead = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_ktail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    if (uring_bufs_init(u, nr_bufs, buf_size) == -1) {
+        goto err;
+    }
+    return u;
+
+err:
+    uring_free(u);
+    return NULL;
+}
+
+void uring_free(uring_t *u) {
+    if (!u) {
+        return;
+    }
+    if (u->fd != -1) {
+        close(u->fd);
+    }
+    if (u->ring) {
+        munmap(u->ring, u->ring_size);
+    }
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->br) {
+        munmap(u->br, u->nr_bufs * sizeof(struct io_uring_buf));
+    }
+    free(u->bufs);
+    free(u);
+}
+
+/**
+ * Get the next free submission entry, submitting the queued entries first
+ * if the queue is full
+ * @return a zeroed entry or NULL
+ */
+struct io_uring_sqe *uring_sqe(uring_t *u) {
+    unsigned int head = __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE);
+    if (u->sq_tail - head >= u->sq_entries) {
+        if (uring_enter(u, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE);
+        if (u->sq_tail - head >= u->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned int idx = u->sq_tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_tail++;
+    u->to_submit++;
+    __atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * Submit any queued entries and wait for a completion
+ * @param timeout_ms is how long to wait, 0 to not wait and -1 for ever
+ * @return 0 or -1 with errno set (ETIME on timeout)
+ */
+int uring_enter(uring_t *u, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+
+    unsigned int flags = IORING_ENTER_EXT_ARG | IORING_ENTER_GETEVENTS;
+    unsigned int min_complete = timeout_ms ? 1 : 0;
+    if (timeout_ms > 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uintptr_t)&ts;
+    }
+
+    int r = uring_syscall(u->fd, u->to_submit, min_complete, flags, &arg,
+            sizeof(arg));
+    if (r == -1) {
+        return -1;
+    }
+    u->to_submit -= r;
+    return 0;
+}
+
+/**
+ * @return the next completion, or NULL if there are none
+ */
+struct io_uring_cqe *uring_cqe(uring_t *u) {
+    unsigned int head = *u->cq_khead;
+    if (head == __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &u->cqes[head & u->cq_mask];
+}
+
+/**
+ * Give the completion returned by uring_cqe() back to the kernel
+ */
+void uring_cqe_seen(uring_t *u) {
+    __atomic_store_n(u->cq_khead, *u->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return the memory for a provided buffer
+ */
+char *uring_buf(uring_t *u, unsigned int bid) {
+    return &u->bufs[(size_t)bid * u->buf_size];
+}
+
+/**
+ * Give a provided buffer back to the kernel to receive into
+ */
+void uring_buf_recycle(uring_t *u, unsigned int bid) {
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (u->nr_bufs - 1)];
+    buf->addr = (uintptr_t)uring_buf(u, bid);
+    buf->len = u->buf_size;
+    buf->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,52 @@
+/** @file
+ * A minimal io_uring wrapper, using the raw system calls
+ *
+ * Copyright (C) 2023 Hamish Coleman
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/**
+ * A submission and completion ring pair, with one group of provided
+ * buffers for the kernel to receive into
+ */
+typedef struct uring {
+    int fd;
+    unsigned int to_submit;     //!< queued sqes not yet given to the kernel
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_tail;       //!< local copy of the tail we are filling
+    unsigned int *sq_khead;
+    unsigned int *sq_ktail;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int cq_mask;
+    unsigned int *cq_khead;
+    unsigned int *cq_ktail;
+    struct io_uring_cqe *cqes;
+    void *ring;                 //!< the mapped sq and cq rings
+    size_t ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *br;   //!< provided buffer ring
+    char *bufs;                 //!< the memory for the provided buffers
+    unsigned int nr_bufs;
+    unsigned int buf_size;
+    unsigned short br_tail;
+} uring_t;
+
+#define URING_BGID 0            //!< the only provided buffer group
+
+uring_t *uring_malloc(unsigned int, unsigned int, unsigned int);
+void uring_free(uring_t *);
+struct io_uring_sqe *uring_sqe(uring_t *);
+int uring_enter(uring_t *, int);
+struct io_uring_cqe *uring_cqe(uring_t *);
+void uring_cqe_seen(uring_t *);
+char *uring_buf(uring_t *, unsigned int);
+void uring_buf_recycle(uring_t *, unsigned int);
+#endif